@@ -9,12 +9,38 @@
 
 #include <treelite/tree.h>
 #include <treelite/data.h>
+#include <memory>
 
 namespace treelite {
 
+/*! \brief file formats for branch annotation */
+enum class AnnotationFormat : int8_t {
+  kJSON = 0,   /*!< nested arrays of decimal numbers; for interchange */
+  kBinary = 1  /*!< compact binary format with varint-encoded counts */
+};
+
 /*! \brief branch annotator class */
 class BranchAnnotator {
  public:
+  /*! \brief information on row sampling used to produce annotation */
+  struct SampleInfo {
+    /*! \brief number of rows in the training data */
+    size_t num_row;
+    /*! \brief number of rows used for counting; equals [num_row] unless the
+               annotation was produced from a sample */
+    size_t num_row_sampled;
+    /*! \brief confidence level used to test stability of branch hints */
+    double confidence;
+    /*! \brief tolerance for the fraction of rows going to the left child */
+    double tolerance;
+    /*! \brief largest half-width of confidence intervals that did not
+               settle the LIKELY/UNLIKELY decision */
+    double margin;
+    SampleInfo() : num_row(0), num_row_sampled(0),
+                   confidence(0.0), tolerance(0.0), margin(0.0) {}
+  };
+
+  BranchAnnotator() : fingerprint(0) {}
   /*!
    * \brief annotate branches in a given model using frequency patterns in the
    *        training data. The annotation can be accessed through Get() method.
@@ -26,15 +52,99 @@ class BranchAnnotator {
   void Annotate(const Model& model, const DMatrix* dmat,
                int nthread, int verbose);
   /*!
-   * \brief load branch annotation from a JSON file
+   * \brief annotate branches using a subset of the rows of the training
+   *        data, without copying the rows
+   * \param model tree ensemble model
+   * \param view rows of training data matrix
+   * \param nthread number of threads to use
+   * \param verbose whether to produce extra messages
+   */
+  void Annotate(const Model& model, const DMatrixView* view,
+                int nthread, int verbose);
+  /*!
+   * \brief annotate branches in a given model by streaming the training data
+   *        from a data parser. Batches are parsed in a background thread
+   *        while earlier batches are being annotated, and only a few batches
+   *        are kept in memory at any time, so the training data does not
+   *        need to fit in memory.
+   * \param model tree ensemble model
+   * \param parser data parser producing training data in small batches
+   * \param nthread number of threads to use
+   * \param verbose whether to produce extra messages
+   */
+  void Annotate(const Model& model, dmlc::Parser<uint32_t>* parser,
+                int nthread, int verbose);
+  /*!
+   * \brief annotate branches in a given model using training data too large
+   *        to fit in memory, one page at a time
+   * \param model tree ensemble model
+   * \param dmat paged training data matrix
+   * \param nthread number of threads to use
+   * \param verbose whether to produce extra messages
+   */
+  void Annotate(const Model& model, PagedDMatrix* dmat,
+                int nthread, int verbose);
+  /*!
+   * \brief annotate branches using a random sample of the training data.
+   *        The sample is drawn without replacement and doubled in size until
+   *        the fraction of rows going to the left child of every test node
+   *        is known within [tolerance] at the given confidence level (or the
+   *        LIKELY/UNLIKELY decision is already certain). Nodes visited by
+   *        very few rows are exempt from the stability test. The resulting
+   *        counts are sample counts, not scaled to the full data.
+   * \param model tree ensemble model
+   * \param dmat training data matrix
+   * \param nthread number of threads to use
+   * \param verbose whether to produce extra messages
+   * \param tolerance tolerance for the fraction of rows going to the left
+   *                  child; must be in range (0, 0.5)
+   * \param confidence confidence level, e.g. 0.95
+   * \param seed seed for random number generator
+   */
+  void AnnotateSampled(const Model& model, const DMatrix* dmat,
+                       int nthread, int verbose, double tolerance,
+                       double confidence, uint64_t seed);
+  /*!
+   * \brief merge another annotation into this one by summing counts. This
+   *        allows annotation to be computed over shards of the training data
+   *        independently, map-reduce style. Both annotations must carry the
+   *        fingerprint of the same model. Counts from a sample are rescaled
+   *        first, so that each annotation is weighted by its number of rows
+   *        rather than by its number of sampled rows.
+   * \param other annotation to be merged into this one
+   */
+  void Merge(const BranchAnnotator& other);
+  /*!
+   * \brief set branch annotation from externally collected counts, e.g. those
+   *        collected by instrumented prediction code. The number of rows is
+   *        taken to be the count of the root node of the first tree.
+   * \param counts node counts for each tree, in the layout of Get()
+   * \param fingerprint fingerprint of the model; 0 if unknown
+   */
+  void Set(std::vector<std::vector<size_t>> counts, uint64_t fingerprint);
+  /*!
+   * \brief load branch annotation from a stream. The format (JSON or binary)
+   *        is detected automatically. For JSON, plain nested arrays of
+   *        counts written by older versions are accepted as well; these
+   *        carry no model fingerprint.
    * \param fi input stream
    */
   void Load(dmlc::Stream* fi);
   /*!
-   * \brief save branch annotation to a JSON file
+   * \brief load branch annotation from a file. The format (JSON or binary)
+   *        is detected automatically. Local binary files are decoded
+   *        directly from a memory mapping, without intermediate copies.
+   * \param filename name of file (local path or URI)
+   */
+  void Load(const char* filename);
+  /*!
+   * \brief save branch annotation to a stream. The model fingerprint and
+   *        sampling information are saved along with the counts.
    * \param fo output stream
+   * \param format file format
    */
-  void Save(dmlc::Stream* fo) const;
+  void Save(dmlc::Stream* fo,
+            AnnotationFormat format = AnnotationFormat::kJSON) const;
   /*!
    * \brief fetch branch annotation.
    * Usage example:
@@ -51,8 +161,70 @@ class BranchAnnotator {
   inline std::vector<std::vector<size_t>> Get() const {
     return counts;
   }
+  /*!
+   * \brief fetch information on row sampling used to produce annotation
+   * \return sampling information
+   */
+  inline SampleInfo GetSampleInfo() const {
+    return sample;
+  }
+  /*!
+   * \brief fetch fingerprint of the model for which the annotation was
+   *        produced
+   * \return fingerprint; 0 if unknown (e.g. loaded from a plain JSON file)
+   */
+  inline uint64_t GetFingerprint() const {
+    return fingerprint;
+  }
+  /*!
+   * \brief compute fingerprint of a model. The fingerprint covers the tree
+   *        structure and split conditions, i.e. everything that determines
+   *        the path a row takes, but not the leaf values.
+   * \param model tree ensemble model
+   * \return 64-bit fingerprint; never 0
+   */
+  static uint64_t ComputeFingerprint(const Model& model);
+
  private:
   std::vector<std::vector<size_t>> counts;
+  SampleInfo sample;
+  uint64_t fingerprint;
+
+  void LoadJSON(dmlc::Stream* fi);
+  void LoadBinary(const char* buf, size_t size);
+  void SaveJSON(dmlc::Stream* fo) const;
+  void SaveBinary(dmlc::Stream* fo) const;
+};
+
+/*!
+ * \brief accumulates branch counts over many batches of rows, e.g. rows
+ *        sampled during prediction. Counters, buffers and the model
+ *        fingerprint are set up once by the constructor, so that counting a
+ *        batch costs no more than traversing its rows.
+ */
+class BranchCounter {
+ public:
+  /*!
+   * \brief set up counters for a model, starting from zero
+   * \param model tree ensemble model; must stay alive as long as the counter
+   * \param nthread number of threads to use for counting
+   */
+  BranchCounter(const Model& model, int nthread);
+  ~BranchCounter();
+  /*!
+   * \brief count branches taken by rows, adding to the counts so far
+   * \param view rows to count
+   */
+  void Count(const DMatrixView& view);
+  /*!
+   * \brief fetch the counts so far as a branch annotation
+   * \param out used to save branch annotation
+   */
+  void GetAnnotation(BranchAnnotator* out);
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl_;
 };
 
 }  // namespace treelite
@@ -34,6 +34,9 @@ typedef void* AnnotationHandle;
 typedef void* CompilerHandle;
 typedef void* PredictorHandle;
 typedef void* DMatrixHandle;
+typedef void* PagedDMatrixHandle;
+typedef void* DMatrixViewHandle;
+typedef void* DMatrixBuilderHandle;
 
 /*!
  * \brief display last error; can be called by different threads
@@ -47,7 +50,7 @@ TREELITE_DLL const char* TreeliteGetLastError();
 /*!
  * \brief create DMatrix from a file
  * \param path file path
- * \param format file format
+ * \param format file format (libsvm/libfm/csv/fast_libsvm/fast_csv/binary)
  * \param nthread number of threads to use
  * \param verbose whether to produce extra messages
  * \param out the created DMatrix
@@ -58,6 +61,36 @@ TREELITE_DLL int TreeliteDMatrixCreateFromFile(const char* path,
                                                int nthread,
                                                int verbose,
                                                DMatrixHandle* out);
+/*!
+ * \brief create DMatrix by parsing text held in memory, e.g. a request body,
+ *        without writing it to a file. The buffer is parsed in place, with
+ *        the parser used for formats fast_libsvm and fast_csv of
+ *        TreeliteDMatrixCreateFromFile(); large buffers are parsed in
+ *        parallel. The buffer need not be NUL-terminated.
+ * \param buf beginning of text
+ * \param len length of text, in bytes
+ * \param format text format (libsvm/csv)
+ * \param nthread number of threads to use
+ * \param verbose whether to produce extra messages
+ * \param out the created DMatrix
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixCreateFromBuffer(const char* buf,
+                                                 size_t len,
+                                                 const char* format,
+                                                 int nthread,
+                                                 int verbose,
+                                                 DMatrixHandle* out);
+/*!
+ * \brief save DMatrix to a file in binary format. The file can be loaded
+ *        much faster than text formats, by passing format="binary" to
+ *        TreeliteDMatrixCreateFromFile(); local files are memory-mapped.
+ * \param handle DMatrix to save
+ * \param path file path
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixSave(DMatrixHandle handle,
+                                     const char* path);
 /*!
  * \brief create DMatrix from a (in-memory) CSR matrix
  * \param data feature values
@@ -74,8 +107,38 @@ TREELITE_DLL int TreeliteDMatrixCreateFromCSR(const float* data,
                                               size_t num_row,
                                               size_t num_col,
                                               DMatrixHandle* out);
+/*!
+ * \brief create DMatrix that refers to a (in-memory) CSR matrix without
+ *        copying it. Unlike TreeliteDMatrixCreateFromCSR(), NaN entries are
+ *        not removed up front; they are treated as missing values when the
+ *        matrix is used.
+ *
+ * The DMatrix borrows the three arrays: the caller must keep them alive and
+ * unmodified until the DMatrix is freed with TreeliteDMatrixFree(). The
+ * arrays are never written to through the DMatrix. The row headers and
+ * feature indices are checked in a single read-only pass.
+ * \param data feature values; must have row_ptr[num_row] elements
+ * \param col_ind feature indices; must have row_ptr[num_row] elements, each
+ *                less than num_col
+ * \param row_ptr pointer to row headers; must have num_row + 1
+ *                non-decreasing elements, the first being 0
+ * \param num_row number of rows
+ * \param num_col number of columns
+ * \param out the created DMatrix
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixCreateFromCSRView(const float* data,
+                                                  const unsigned* col_ind,
+                                                  const size_t* row_ptr,
+                                                  size_t num_row,
+                                                  size_t num_col,
+                                                  DMatrixHandle* out);
 /*!
  * \brief create DMatrix from a (in-memory) dense matrix
+ *
+ * The matrix is stored in dense row-major layout if at least half of its
+ * entries are valid, and in CSR layout otherwise. NaN entries and entries
+ * equal to missing_value are treated as missing.
  * \param data feature values
  * \param num_row number of rows
  * \param num_col number of columns
@@ -88,6 +151,20 @@ TREELITE_DLL int TreeliteDMatrixCreateFromMat(const float* data,
                                               size_t num_col,
                                               float missing_value,
                                               DMatrixHandle* out);
+/*!
+ * \brief compress a DMatrix in CSR layout, in place, to reduce its memory
+ *        usage. Column indices are delta-encoded, and the values of each
+ *        column are dictionary-coded when that is smaller. Dense matrices
+ *        are left as they are. A compressed DMatrix cannot be saved.
+ * \param handle handle to DMatrix
+ * \param allow_float16 whether values may be stored in half precision,
+ *                      losing precision (0 or 1)
+ * \param verbose whether to produce extra messages
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixCompress(DMatrixHandle handle,
+                                         int allow_float16,
+                                         int verbose);
 /*!
  * \brief get dimensions of a DMatrix
  * \param handle handle to DMatrix
@@ -106,6 +183,142 @@ TREELITE_DLL int TreeliteDMatrixGetDimension(DMatrixHandle handle,
  * \return 0 for success, -1 for failure
  */
 TREELITE_DLL int TreeliteDMatrixFree(DMatrixHandle handle);
+/*!
+ * \brief create a builder that assembles a DMatrix row by row. Clearing the
+ *        builder keeps its memory, so that building one small DMatrix per
+ *        request allocates no memory once the builder has grown large enough.
+ * \param num_col number of columns
+ * \param dense whether to build the DMatrix in dense row-major layout
+ *              (1) or in CSR layout (0)
+ * \param out the created builder
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixBuilderCreate(size_t num_col,
+                                              int dense,
+                                              DMatrixBuilderHandle* out);
+/*!
+ * \brief remove all rows from a builder, keeping its memory
+ * \param handle handle to builder
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixBuilderClear(DMatrixBuilderHandle handle);
+/*!
+ * \brief append a row given by (column index, value) pairs to a builder.
+ *        NaN values are treated as missing.
+ * \param handle handle to builder
+ * \param col_ind column indices
+ * \param data feature values
+ * \param num_entry number of pairs
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixBuilderAddSparseRow(DMatrixBuilderHandle handle,
+                                                    const unsigned* col_ind,
+                                                    const float* data,
+                                                    size_t num_entry);
+/*!
+ * \brief append rows given in dense row-major layout to a builder. NaN
+ *        values and values equal to missing_value are treated as missing.
+ * \param handle handle to builder
+ * \param data feature values; num_row rows of num_col values each
+ * \param num_row number of rows
+ * \param missing_value value to represent missing value
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixBuilderAddDenseRows(DMatrixBuilderHandle handle,
+                                                    const float* data,
+                                                    size_t num_row,
+                                                    float missing_value);
+/*!
+ * \brief get the DMatrix built so far. The DMatrix is owned by the builder
+ *        and must not be freed; it is valid until the builder is next
+ *        modified or freed.
+ * \param handle handle to builder
+ * \param out used to save handle to the DMatrix
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixBuilderGetDMatrix(DMatrixBuilderHandle handle,
+                                                  DMatrixHandle* out);
+/*!
+ * \brief delete a builder, along with the DMatrix it built
+ * \param handle handle to builder
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixBuilderFree(DMatrixBuilderHandle handle);
+/*!
+ * \brief create a paged DMatrix from a file, for data too large to fit in
+ *        memory. The file is parsed once and its rows written in pages to a
+ *        cache file; an existing cache file is reused only if it was built
+ *        from the same file, unmodified since, and is rebuilt otherwise.
+ * \param path file path
+ * \param format file format (libsvm/libfm/csv)
+ * \param cache_file path to cache file; must be a local file
+ * \param page_size approximate size of each page, in bytes
+ * \param max_cached_page maximum number of pages to hold in memory
+ * \param verbose whether to produce extra messages
+ * \param out the created paged DMatrix
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePagedDMatrixCreateFromFile(const char* path,
+                                                    const char* format,
+                                                    const char* cache_file,
+                                                    size_t page_size,
+                                                    size_t max_cached_page,
+                                                    int verbose,
+                                                    PagedDMatrixHandle* out);
+/*!
+ * \brief get dimensions of a paged DMatrix
+ * \param handle handle to paged DMatrix
+ * \param out_num_row used to set number of rows
+ * \param out_num_col used to set number of columns
+ * \param out_nelem used to set number of nonzero entries
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePagedDMatrixGetDimension(PagedDMatrixHandle handle,
+                                                  size_t* out_num_row,
+                                                  size_t* out_num_col,
+                                                  size_t* out_nelem);
+/*!
+ * \brief delete paged DMatrix from memory; the cache file is kept
+ * \param handle handle to paged DMatrix
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePagedDMatrixFree(PagedDMatrixHandle handle);
+/*!
+ * \brief create a view of a list of rows of a DMatrix, for predicting or
+ *        annotating with a subset of rows without copying them. Only the
+ *        list of row indices is copied. The DMatrix must not be modified or
+ *        freed until the view is freed with TreeliteDMatrixViewFree().
+ * \param handle handle to DMatrix
+ * \param row_index indices of rows, in any order; sorted lists give better
+ *                  locality
+ * \param num_row number of rows in the view
+ * \param out the created view
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixViewCreateFromRows(DMatrixHandle handle,
+                                                   const size_t* row_index,
+                                                   size_t num_row,
+                                                   DMatrixViewHandle* out);
+/*!
+ * \brief create a view of a range of rows of a DMatrix. The DMatrix must not
+ *        be modified or freed until the view is freed with
+ *        TreeliteDMatrixViewFree().
+ * \param handle handle to DMatrix
+ * \param row_begin index of first row
+ * \param row_end index of one past last row
+ * \param out the created view
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixViewCreateFromRange(DMatrixHandle handle,
+                                                    size_t row_begin,
+                                                    size_t row_end,
+                                                    DMatrixViewHandle* out);
+/*!
+ * \brief delete a view of a DMatrix; the DMatrix itself is kept
+ * \param handle handle to view
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteDMatrixViewFree(DMatrixViewHandle handle);
 
 /***************************************************************************
  * Part 2: branch annotator interface
@@ -126,8 +339,100 @@ TREELITE_DLL int TreeliteAnnotateBranch(ModelHandle model,
                                         int verbose,
                                         AnnotationHandle* out);
 /*!
- * \brief load branch annotation from a JSON file
- * \param path path to JSON file
+ * \brief annotate branches in a given model using a random sample of the
+ *        training data. The sample is grown until the fraction of rows going
+ *        to the left child of every node is known within a given tolerance.
+ * \param model model to annotate
+ * \param dmat training data matrix
+ * \param nthread number of threads to use
+ * \param verbose whether to produce extra messages
+ * \param tolerance tolerance for the fraction of rows going to the left child;
+ *                  must be in range (0, 0.5)
+ * \param confidence confidence level, e.g. 0.95
+ * \param seed seed for random number generator
+ * \param out used to save handle for the created annotation
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteAnnotateBranchSampled(ModelHandle model,
+                                               DMatrixHandle dmat,
+                                               int nthread,
+                                               int verbose,
+                                               double tolerance,
+                                               double confidence,
+                                               uint64_t seed,
+                                               AnnotationHandle* out);
+/*!
+ * \brief annotate branches in a given model using one part of a training data
+ *        file. The file is split into [num_parts] parts of roughly equal size
+ *        and only the rows of part [part_index] are read, streaming, so that
+ *        the parts can be annotated independently (e.g. on different
+ *        machines) and combined with TreeliteAnnotationMerge().
+ * \param model model to annotate
+ * \param path path to training data file
+ * \param format file format (libsvm/libfm/csv/fast_libsvm/fast_csv/binary).
+ *               Fast text formats are read into memory one part at a time,
+ *               rather than streamed; binary files cannot be split into
+ *               parts
+ * \param part_index index of the part to annotate with
+ * \param num_parts number of parts the file is split into
+ * \param nthread number of threads to use
+ * \param verbose whether to produce extra messages
+ * \param out used to save handle for the created annotation
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteAnnotateBranchFromFile(ModelHandle model,
+                                                const char* path,
+                                                const char* format,
+                                                unsigned part_index,
+                                                unsigned num_parts,
+                                                int nthread,
+                                                int verbose,
+                                                AnnotationHandle* out);
+/*!
+ * \brief annotate branches in a given model using a paged training data
+ *        matrix, one page at a time
+ * \param model model to annotate
+ * \param dmat paged training data matrix
+ * \param nthread number of threads to use
+ * \param verbose whether to produce extra messages
+ * \param out used to save handle for the created annotation
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteAnnotateBranchPaged(ModelHandle model,
+                                             PagedDMatrixHandle dmat,
+                                             int nthread,
+                                             int verbose,
+                                             AnnotationHandle* out);
+/*!
+ * \brief annotate branches in a given model using a subset of the rows of
+ *        the training data, given by a view
+ * \param model model to annotate
+ * \param view view of training data matrix
+ * \param nthread number of threads to use
+ * \param verbose whether to produce extra messages
+ * \param out used to save handle for the created annotation
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteAnnotateBranchView(ModelHandle model,
+                                            DMatrixViewHandle view,
+                                            int nthread,
+                                            int verbose,
+                                            AnnotationHandle* out);
+/*!
+ * \brief merge one branch annotation into another by summing counts. Both
+ *        annotations must carry the fingerprint of the same model. Counts
+ *        from a sample are rescaled first, so that each annotation is
+ *        weighted by its number of rows.
+ * \param handle annotation to merge into
+ * \param other annotation to be merged; left unchanged
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteAnnotationMerge(AnnotationHandle handle,
+                                         AnnotationHandle other);
+/*!
+ * \brief load branch annotation from a file. Both JSON and binary formats are
+ *        accepted; the format is detected automatically.
+ * \param path path to annotation file
  * \param out used to save handle for the loaded annotation
  * \return 0 for success, -1 for failure
  */
@@ -141,6 +446,15 @@ TREELITE_DLL int TreeliteAnnotationLoad(const char* path,
  */
 TREELITE_DLL int TreeliteAnnotationSave(AnnotationHandle handle,
                                         const char* path);
+/*!
+ * \brief save branch annotation to a file in compact binary format. Binary
+ *        annotation files are much smaller than JSON and faster to load.
+ * \param handle annotation to save
+ * \param path path to annotation file
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteAnnotationSaveBinary(AnnotationHandle handle,
+                                              const char* path);
 /*!
  * \brief delete branch annotation from memory
  * \param handle annotation to remove
@@ -224,6 +538,80 @@ TREELITE_DLL int TreelitePredictorPredict(PredictorHandle handle,
                                           int nthread,
                                           int verbose,
                                           float* out_result);
+/*!
+ * \brief make predictions on a paged dataset, one page at a time
+ * \param handle predictor
+ * \param dmat paged data matrix
+ * \param nthread number of threads to use
+ * \param verbose whether to produce extra messages
+ * \param out_result used to store result of prediction
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePredictorPredictPaged(PredictorHandle handle,
+                                               PagedDMatrixHandle dmat,
+                                               int nthread,
+                                               int verbose,
+                                               float* out_result);
+/*!
+ * \brief make predictions on a subset of the rows of a dataset, given by a
+ *        view
+ * \param handle predictor
+ * \param view view of data matrix
+ * \param nthread number of threads to use
+ * \param verbose whether to produce extra messages
+ * \param out_result used to store result of prediction, in the order of
+ *                   rows in the view
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePredictorPredictView(PredictorHandle handle,
+                                              DMatrixViewHandle view,
+                                              int nthread,
+                                              int verbose,
+                                              float* out_result);
+/*!
+ * \brief fetch branch annotation collected so far by instrumented prediction
+ *        code. The prediction code must have been generated with compiler
+ *        parameter instrument=1.
+ * \param handle predictor
+ * \param out used to save handle for the created annotation
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePredictorGetBranchAnnotation(PredictorHandle handle,
+                                                      AnnotationHandle* out);
+/*!
+ * \brief reset counters in instrumented prediction code
+ * \param handle predictor
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePredictorResetBranchAnnotation(PredictorHandle handle);
+/*!
+ * \brief enable live profiling of branches. A small random fraction of the
+ *        rows passed to TreelitePredictorPredict() is counted in a background
+ *        thread, and the counts are exported periodically to a branch
+ *        annotation file.
+ * \param handle predictor
+ * \param model model from which the prediction code was generated; must not
+ *              be freed until profiling is disabled
+ * \param sample_rate fraction of rows to sample; must be in range (0, 1]
+ * \param export_path file to which branch counts are exported
+ * \param export_interval interval between exports, in seconds
+ * \param format file format of exported branch counts (json/binary)
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePredictorEnableBranchProfiling(PredictorHandle handle,
+                                                        ModelHandle model,
+                                                        double sample_rate,
+                                                        const char* export_path,
+                                                        double export_interval,
+                                                        const char* format);
+/*!
+ * \brief disable live profiling of branches, exporting the counts one last
+ *        time
+ * \param handle predictor
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreelitePredictorDisableBranchProfiling(
+    PredictorHandle handle);
 /*!
  * \brief delete predictor from memory
  * \param handle predictor to remove
@@ -262,6 +650,23 @@ TREELITE_DLL int TreeliteLoadXGBoostModel(const char* filename,
  */
 TREELITE_DLL int TreeliteLoadProtobufModel(const char* filename,
                                            ModelHandle* out);
+/*!
+ * \brief load a model saved in treelite's native binary format with
+ *        TreeliteSaveModel(). A local file is memory-mapped and used without
+ *        deserialization, so loading takes time independent of model size.
+ * \param filename name of model file
+ * \param out loaded model
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteLoadModel(const char* filename, ModelHandle* out);
+/*!
+ * \brief save a model in treelite's native binary format, so that it can be
+ *        loaded quickly later with TreeliteLoadModel()
+ * \param handle model to save
+ * \param filename name of model file
+ * \return 0 for success, -1 for failure
+ */
+TREELITE_DLL int TreeliteSaveModel(ModelHandle handle, const char* filename);
 /*!
  * \brief delete model from memory
  * \param handle model to remove
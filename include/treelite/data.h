@@ -8,26 +8,360 @@
 #define TREELITE_DATA_H_
 
 #include <dmlc/data.h>
+#include <dmlc/io.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
 
 namespace treelite {
 
-/*! \brief a simple data matrix in CSR (Compressed Sparse Row) storage */
+/*!
+ * \brief contiguous array used to store a data matrix or the nodes of a
+ *        tree. The array either owns its storage, or refers to read-only
+ *        storage owned elsewhere (e.g. a memory-mapped file), so that large
+ *        arrays can be used without copying. Read access is equally fast in
+ *        both cases. Non-const access to an array that refers to external
+ *        storage first makes a private copy, so read through a const
+ *        reference to avoid copying.
+ *        The interface follows std::vector.
+ */
+template <typename T>
+class DataArray {
+ public:
+  DataArray() : ptr_(nullptr), size_(0), external_(false) {}
+  DataArray(const DataArray& other) : DataArray() {
+    *this = other;
+  }
+  DataArray(DataArray&& other) : DataArray() {
+    *this = std::move(other);
+  }
+  DataArray& operator=(const DataArray& other) {
+    if (this != &other) {
+      vec_ = other.vec_;
+      holder_ = other.holder_;
+      external_ = other.external_;
+      if (external_) {
+        ptr_ = other.ptr_;
+        size_ = other.size_;
+      } else {
+        Sync();
+      }
+    }
+    return *this;
+  }
+  DataArray& operator=(DataArray&& other) {
+    if (this != &other) {
+      vec_ = std::move(other.vec_);
+      holder_ = std::move(other.holder_);
+      external_ = other.external_;
+      ptr_ = other.ptr_;
+      size_ = other.size_;
+      if (!external_) {
+        Sync();
+      }
+      other.clear();
+    }
+    return *this;
+  }
+
+  /*! \brief take over the storage of a vector, without copying */
+  DataArray& operator=(std::vector<T>&& vec) {
+    holder_.reset();
+    external_ = false;
+    vec_ = std::move(vec);
+    Sync();
+    return *this;
+  }
+
+  /*!
+   * \brief refer to read-only storage owned elsewhere
+   * \param ptr beginning of storage
+   * \param size number of elements
+   * \param holder object keeping the storage alive; may be null if the
+   *               caller guarantees that the storage outlives the array
+   */
+  inline void SetExternal(const T* ptr, size_t size,
+                          std::shared_ptr<const void> holder) {
+    vec_.clear();
+    vec_.shrink_to_fit();
+    holder_ = std::move(holder);
+    ptr_ = ptr;
+    size_ = size;
+    external_ = true;
+  }
+  /*! \brief whether the array refers to storage owned elsewhere */
+  inline bool IsExternal() const {
+    return external_;
+  }
+
+  inline size_t size() const {
+    return size_;
+  }
+  inline bool empty() const {
+    return size_ == 0;
+  }
+  inline const T* data() const {
+    return ptr_;
+  }
+  inline const T& operator[](size_t i) const {
+    return ptr_[i];
+  }
+  inline const T* begin() const {
+    return ptr_;
+  }
+  inline const T* end() const {
+    return ptr_ + size_;
+  }
+  inline const T& back() const {
+    return ptr_[size_ - 1];
+  }
+
+  inline T* data() {
+    MakeOwned();
+    return vec_.data();
+  }
+  inline T& operator[](size_t i) {
+    MakeOwned();
+    return vec_[i];
+  }
+  inline T* begin() {
+    MakeOwned();
+    return vec_.data();
+  }
+  inline T* end() {
+    MakeOwned();
+    return vec_.data() + vec_.size();
+  }
+  inline T& back() {
+    MakeOwned();
+    return vec_.back();
+  }
+  inline void push_back(const T& value) {
+    MakeOwned();
+    vec_.push_back(value);
+    Sync();
+  }
+  template <typename InputIt>
+  inline void insert(const T* pos, InputIt first, InputIt last) {
+    const size_t offset = pos - ptr_;
+    MakeOwned();
+    vec_.insert(vec_.begin() + offset, first, last);
+    Sync();
+  }
+  inline void resize(size_t size) {
+    MakeOwned();
+    vec_.resize(size);
+    Sync();
+  }
+  inline void resize(size_t size, const T& value) {
+    MakeOwned();
+    vec_.resize(size, value);
+    Sync();
+  }
+  inline void assign(size_t size, const T& value) {
+    Reset();
+    vec_.assign(size, value);
+    Sync();
+  }
+  template <typename InputIt>
+  inline void assign(InputIt first, InputIt last) {
+    Reset();
+    vec_.assign(first, last);
+    Sync();
+  }
+  inline void reserve(size_t size) {
+    MakeOwned();
+    vec_.reserve(size);
+    Sync();
+  }
+  inline void shrink_to_fit() {
+    if (!external_) {
+      vec_.shrink_to_fit();
+      Sync();
+    }
+  }
+  inline void clear() {
+    Reset();
+    vec_.clear();
+    Sync();
+  }
+
+ private:
+  std::vector<T> vec_;
+  std::shared_ptr<const void> holder_;
+  const T* ptr_;
+  size_t size_;
+  bool external_;
+
+  inline void Sync() {
+    ptr_ = vec_.data();
+    size_ = vec_.size();
+  }
+  inline void MakeOwned() {
+    if (external_) {
+      vec_.assign(ptr_, ptr_ + size_);
+      holder_.reset();
+      external_ = false;
+      Sync();
+    }
+  }
+  inline void Reset() {
+    if (external_) {
+      holder_.reset();
+      external_ = false;
+    }
+  }
+};
+
+/*! \brief memory layout of data matrix */
+enum class DMatrixLayout : int8_t {
+  kCSR = 0,           /*!< CSR (Compressed Sparse Row): data, col_ind and
+                           row_ptr */
+  kDense = 1,         /*!< dense row-major: data only, with NaN for missing
+                           values */
+  kCompressedCSR = 2  /*!< CSR with compressed arrays: compressed only */
+};
+
+/*! \brief coding of feature values in compressed CSR layout */
+enum class ValueCoding : int8_t {
+  kFloat32 = 0,      /*!< 4-byte float, uncompressed */
+  kFloat16 = 1,      /*!< 2-byte half-precision float; lossy */
+  kDictionary8 = 2,  /*!< 1-byte index into dictionary of the column */
+  kDictionary16 = 3  /*!< 2-byte index into dictionary of the column */
+};
+
+/*!
+ * \brief CSR arrays in compressed form. Column indices of each row are
+ *        delta-encoded in 1 or 2 bytes per entry, if they are increasing and
+ *        the deltas are small enough, and stored as plain 4-byte indices
+ *        otherwise. Feature values of each column are coded as given by
+ *        [value_coding], so the width of the value codes varies within a
+ *        row. Rows are decoded on the fly, in small chunks, by
+ *        ForEachEntry().
+ */
+struct CompressedCSR {
+  /*! \brief pointer to row headers, in entries; length of num_row + 1 */
+  std::vector<size_t> row_ptr;
+  /*! \brief pointer to row headers, in bytes of [col_code]; the number of
+             bytes per column index of a row is its size in bytes divided by
+             its number of entries */
+  std::vector<size_t> col_ptr;
+  /*! \brief column indices, delta-encoded */
+  std::vector<uint8_t> col_code;
+  /*! \brief coding of feature values of each column */
+  std::vector<ValueCoding> value_coding;
+  /*! \brief pointer to coded feature values of each row, in bytes of
+             [value_code]; length of num_row + 1 */
+  std::vector<size_t> value_ptr;
+  /*! \brief coded feature values, one code per entry */
+  std::vector<uint8_t> value_code;
+  /*! \brief dictionaries of the dictionary-coded columns */
+  std::vector<float> dict;
+  /*! \brief pointer to dictionary of each column within [dict]; the range
+             is empty for columns that are not dictionary-coded */
+  std::vector<size_t> dict_ptr;
+
+  /*!
+   * \brief call func(col_ind, value) for every entry of a row
+   * \param rid index of row
+   * \param func function to call
+   */
+  template <typename Func>
+  inline void ForEachEntry(size_t rid, Func func) const {
+    uint32_t col_ind[kDecodeChunk];
+    float value[kDecodeChunk];
+    const size_t ibegin = row_ptr[rid];
+    const size_t iend = row_ptr[rid + 1];
+    uint32_t last_col = 0;
+    size_t value_pos = value_ptr[rid];
+    for (size_t i = ibegin; i < iend; i += kDecodeChunk) {
+      const size_t n = std::min(kDecodeChunk, iend - i);
+      DecodeColumns(rid, i - ibegin, n, &last_col, col_ind);
+      DecodeValues(n, col_ind, &value_pos, value);
+      for (size_t k = 0; k < n; ++k) {
+        func(col_ind[k], value[k]);
+      }
+    }
+  }
+  /*!
+   * \brief call func(col_ind) for every entry of a row, without decoding
+   *        feature values
+   * \param rid index of row
+   * \param func function to call
+   */
+  template <typename Func>
+  inline void ForEachColumn(size_t rid, Func func) const {
+    uint32_t col_ind[kDecodeChunk];
+    const size_t ibegin = row_ptr[rid];
+    const size_t iend = row_ptr[rid + 1];
+    uint32_t last_col = 0;
+    for (size_t i = ibegin; i < iend; i += kDecodeChunk) {
+      const size_t n = std::min(kDecodeChunk, iend - i);
+      DecodeColumns(rid, i - ibegin, n, &last_col, col_ind);
+      for (size_t k = 0; k < n; ++k) {
+        func(col_ind[k]);
+      }
+    }
+  }
+  /*! \brief size of all arrays, in bytes */
+  size_t MemoryUsage() const;
+
+ private:
+  static constexpr size_t kDecodeChunk = 64;
+  /*!
+   * \brief decode column indices of entries [offset, offset + n) of a row
+   * \param rid index of row
+   * \param offset index of first entry to decode, relative to the row
+   * \param n number of entries to decode
+   * \param last_col last column index decoded from the row so far; updated
+   * \param out_col_ind used to store column indices
+   */
+  void DecodeColumns(size_t rid, size_t offset, size_t n,
+                     uint32_t* last_col, uint32_t* out_col_ind) const;
+  /*!
+   * \brief decode values of n consecutive entries of a row
+   * \param n number of entries to decode
+   * \param col_ind column indices of the entries
+   * \param value_pos position of the first value code in [value_code];
+   *                  advanced past the decoded entries
+   * \param out_value used to store values
+   */
+  void DecodeValues(size_t n, const uint32_t* col_ind, size_t* value_pos,
+                    float* out_value) const;
+};
+
+/*!
+ * \brief a simple data matrix, stored in CSR (Compressed Sparse Row), dense
+ *        row-major or compressed CSR layout. Consumers dispatch on [layout].
+ */
 struct DMatrix {
-  /*! \brief feature values */
-  std::vector<float> data;
+  /*! \brief feature values. NaN values are treated as missing; they only
+             occur in matrices borrowing storage from the caller, as other
+             constructors drop or canonicalize them. */
+  DataArray<float> data;
   /*! \brief feature indices */
-  std::vector<uint32_t> col_ind;
+  DataArray<uint32_t> col_ind;
   /*! \brief pointer to row headers; length of [num_row] + 1 */
-  std::vector<size_t> row_ptr;
+  DataArray<size_t> row_ptr;
   /*! \brief number of rows */
   size_t num_row;
   /*! \brief number of columns */
   size_t num_col;
-  /*! \brief number of nonzero entries */
+  /*! \brief number of stored entries; [num_row] * [num_col] in dense
+             layout */
   size_t nelem;
+  /*! \brief memory layout. In dense layout, [data] holds [num_row] rows of
+             [num_col] values each, missing values are stored as
+             MissingValue(), and [col_ind] and [row_ptr] are empty. */
+  DMatrixLayout layout = DMatrixLayout::kCSR;
+  /*! \brief compressed CSR arrays, in compressed CSR layout only. The arrays
+             are immutable and shared by copies of the matrix. */
+  std::shared_ptr<const CompressedCSR> compressed;
 
   /*!
-   * \brief clear all data fields
+   * \brief clear all data fields; the matrix becomes an empty CSR matrix
    */
   inline void Clear() {
     data.clear();
@@ -35,17 +369,82 @@ struct DMatrix {
     col_ind.clear();
     row_ptr.resize(1, 0);
     num_row = num_col = nelem = 0;
+    layout = DMatrixLayout::kCSR;
+    compressed.reset();
   }
   /*!
-   * \brief construct a new DMatrix from a file
+   * \brief make the matrix a dense matrix with all values missing
+   * \param num_row number of rows
+   * \param num_col number of columns
+   */
+  inline void InitDense(size_t num_row, size_t num_col) {
+    data.assign(num_row * num_col, MissingValue());
+    row_ptr.clear();
+    col_ind.clear();
+    compressed.reset();
+    this->num_row = num_row;
+    this->num_col = num_col;
+    nelem = num_row * num_col;
+    layout = DMatrixLayout::kDense;
+  }
+  /*!
+   * \brief value marking missing entries in dense layout. It is a NaN whose
+   *        bit pattern is that of the integer -1, which also marks missing
+   *        values in the Entry union used by prediction code. Dense rows can
+   *        therefore be copied into Entry arrays as they are.
+   */
+  static inline float MissingValue() {
+    const int32_t bits = -1;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+  /*!
+   * \brief map every NaN to MissingValue(), so that it is stored in dense
+   *        layout as missing
+   */
+  static inline float CanonicalizeMissing(float value) {
+    return std::isnan(value) ? MissingValue() : value;
+  }
+  /*!
+   * \brief construct a new DMatrix from a file. The file may be split into
+   *        [num_parts] parts of roughly equal size, in which case only the
+   *        rows of part [part_index] are loaded.
    * \param filename name of file
-   * \param format format of file (libsvm/libfm/csv)
+   * \param format format of file (libsvm/libfm/csv), or "binary" for a file
+   *               written by Save(); binary files cannot be split into parts.
+   *               CSV files are loaded in dense layout; entries not produced
+   *               by the parser and NaN values are stored as missing.
+   *               "fast_csv" and "fast_libsvm" select treelite's own text
+   *               parser, which parses a memory mapping of the file with
+   *               [nthread] threads even when the file is split into parts.
+   *               It treats empty CSV fields as missing, and ignores labels
+   *               and qid tokens in LIBSVM files.
    * \param nthread number of threads to use
    * \param verbose whether to produce extra messages
+   * \param part_index index of the part to load
+   * \param num_parts number of parts the file is split into
    * \return newly built DMatrix
    */
   static DMatrix* Create(const char* filename, const char* format,
-                         int nthread, int verbose);
+                         int nthread, int verbose,
+                         unsigned part_index = 0, unsigned num_parts = 1);
+  /*!
+   * \brief construct a new DMatrix by parsing text held in memory. The text
+   *        is parsed in place, without copying, by the parser used for the
+   *        "fast_libsvm" and "fast_csv" formats of Create(). Large buffers
+   *        are split among threads.
+   * \param buf beginning of text
+   * \param size size of text, in bytes
+   * \param format format of text (libsvm/csv; fast_libsvm and fast_csv are
+   *               accepted as synonyms)
+   * \param nthread number of threads to use
+   * \param verbose whether to produce extra messages
+   * \return newly built DMatrix
+   */
+  static DMatrix* CreateFromBuffer(const char* buf, size_t size,
+                                   const char* format,
+                                   int nthread, int verbose);
   /*!
    * \brief construct a new DMatrix from a data parser. The data parser here
    *        refers to any iterable object that streams input data in small
@@ -57,6 +456,239 @@ struct DMatrix {
    */
   static DMatrix* Create(dmlc::Parser<uint32_t>* parser,
                          int nthread, int verbose);
+  /*!
+   * \brief convert the matrix from CSR layout to compressed CSR layout, to
+   *        reduce memory usage and memory bandwidth of prediction. The
+   *        coding of values is chosen for each column: a column is
+   *        dictionary-coded if it has few enough distinct values and that
+   *        takes less memory; half precision is used only if allowed,
+   *        smaller still, and all values of the column are in its range.
+   *        Other columns keep plain floats. Dense matrices are left as they
+   *        are.
+   * \param allow_float16 whether values may be stored in half precision,
+   *                      losing precision
+   * \param verbose whether to produce extra messages
+   */
+  void Compress(bool allow_float16, int verbose);
+  /*!
+   * \brief save the data matrix in binary format, so that it can be loaded
+   *        quickly later with Load(). The CSR arrays are stored in separate
+   *        aligned sections, so that they can be used directly from a memory
+   *        mapping of the file.
+   * \param fo output stream
+   */
+  void Save(dmlc::Stream* fo) const;
+  /*!
+   * \brief load a data matrix saved in binary format. A local file is
+   *        memory-mapped and the CSR arrays refer directly to the mapping,
+   *        without copying; the mapping is released when the data matrix is
+   *        deleted. Processes on the same host share the mapped pages.
+   * \param filename name of file (local path or URI)
+   * \return newly loaded DMatrix
+   */
+  static DMatrix* Load(const char* filename);
+};
+
+/*!
+ * \brief builds a data matrix row by row, reusing its memory. Clear() keeps
+ *        the capacity of all arrays, so that once a builder has grown to the
+ *        size of the largest matrix built, building further matrices of at
+ *        most that size allocates no memory. Meant for building a small
+ *        matrix for every request.
+ */
+class DMatrixBuilder {
+ public:
+  /*!
+   * \brief create a builder
+   * \param num_col number of columns
+   * \param layout layout of the matrix to build; CSR or dense
+   */
+  explicit DMatrixBuilder(size_t num_col,
+                          DMatrixLayout layout = DMatrixLayout::kCSR);
+  /*! \brief remove all rows, keeping the memory allocated so far */
+  void Clear();
+  /*!
+   * \brief allocate memory ahead of time
+   * \param num_row number of rows to make room for
+   * \param nelem number of entries to make room for; ignored in dense layout
+   */
+  void Reserve(size_t num_row, size_t nelem);
+  /*!
+   * \brief append a row given by (column index, value) pairs. NaN values are
+   *        treated as missing.
+   * \param col_ind column indices; each must be less than the number of
+   *                columns
+   * \param data feature values
+   * \param num_entry number of pairs
+   */
+  void AddSparseRow(const uint32_t* col_ind, const float* data,
+                    size_t num_entry);
+  /*!
+   * \brief append rows given in dense row-major layout. NaN values and
+   *        values equal to [missing_value] are treated as missing.
+   * \param data feature values; [num_row] rows of [num_col] values each
+   * \param num_row number of rows
+   * \param missing_value value representing missing entries
+   */
+  void AddDenseRows(const float* data, size_t num_row,
+                    float missing_value = std::nanf(""));
+  /*!
+   * \brief the matrix built so far. It remains owned by the builder and is
+   *        valid until the builder is next modified.
+   */
+  inline const DMatrix* Get() const {
+    return &dmat_;
+  }
+
+ private:
+  DMatrix dmat_;
+};
+
+/*!
+ * \brief subset of the rows of a data matrix, given by a range of rows or a
+ *        list of row indices. Rows are not copied; a view given by a list
+ *        holds only the list. The data matrix must stay alive and unchanged
+ *        for as long as the view is in use.
+ */
+class DMatrixView {
+ public:
+  /*!
+   * \brief view all rows of a data matrix
+   * \param dmat data matrix
+   */
+  explicit DMatrixView(const DMatrix* dmat);
+  /*!
+   * \brief view rows [row_begin, row_end) of a data matrix
+   * \param dmat data matrix
+   * \param row_begin index of first row
+   * \param row_end index of one past last row
+   */
+  DMatrixView(const DMatrix* dmat, size_t row_begin, size_t row_end);
+  /*!
+   * \brief view a list of rows of a data matrix. Rows may be listed in any
+   *        order, and more than once; sorted lists give better locality.
+   * \param dmat data matrix
+   * \param row_index indices of rows
+   */
+  DMatrixView(const DMatrix* dmat, std::vector<size_t> row_index);
+
+  /*! \brief the data matrix being viewed */
+  inline const DMatrix* base() const {
+    return dmat_;
+  }
+  /*! \brief number of rows in the view */
+  inline size_t num_row() const {
+    return num_row_;
+  }
+  /*! \brief number of columns */
+  inline size_t num_col() const {
+    return dmat_->num_col;
+  }
+  /*!
+   * \brief map a row of the view to a row of the data matrix
+   * \param i index of row within the view
+   * \return index of row within the data matrix
+   */
+  inline size_t RowIndex(size_t i) const {
+    return row_index_.empty() ? row_begin_ + i : row_index_[i];
+  }
+
+ private:
+  const DMatrix* dmat_;
+  size_t row_begin_;
+  size_t num_row_;
+  std::vector<size_t> row_index_;  // empty for a range of rows
+};
+
+/*!
+ * \brief data matrix too large to fit in memory. Rows are split into pages,
+ *        which are kept in a cache file on disk and read back one at a time.
+ *        At most [max_cached_page] pages are held in memory, evicted in
+ *        least-recently-used order, and the pages following the current one
+ *        are read ahead in a background thread while the current page is
+ *        being processed. Each page is a DMatrix in CSR layout whose number
+ *        of columns is that of the whole matrix.
+ */
+class PagedDMatrix {
+ public:
+  ~PagedDMatrix();
+  /*!
+   * \brief construct a paged data matrix from a file. The file is parsed
+   *        once and its rows written in pages to [cache_file], together with
+   *        the name, format, size and modification time of the file. If
+   *        [cache_file] already exists and was built from the same file,
+   *        unmodified since, it is reused and the input file is not read at
+   *        all; otherwise it is rebuilt. (Size and modification time are
+   *        only checked for local files.)
+   * \param filename name of file
+   * \param format format of file (libsvm/libfm/csv)
+   * \param cache_file name of cache file; must be a local file
+   * \param page_size approximate size of each page, in bytes
+   * \param max_cached_page maximum number of pages to hold in memory
+   * \param verbose whether to produce extra messages
+   * \return newly built PagedDMatrix
+   */
+  static PagedDMatrix* Create(const char* filename, const char* format,
+                              const char* cache_file, size_t page_size,
+                              size_t max_cached_page, int verbose);
+  /*!
+   * \brief open an existing cache file written by Create()
+   * \param cache_file name of cache file
+   * \param max_cached_page maximum number of pages to hold in memory
+   * \return newly opened PagedDMatrix
+   */
+  static PagedDMatrix* Open(const char* cache_file, size_t max_cached_page);
+
+  /*! \brief number of rows */
+  inline size_t num_row() const {
+    return num_row_;
+  }
+  /*! \brief number of columns */
+  inline size_t num_col() const {
+    return num_col_;
+  }
+  /*! \brief number of stored entries */
+  inline size_t nelem() const {
+    return nelem_;
+  }
+  /*! \brief number of pages */
+  inline size_t num_page() const {
+    return num_page_;
+  }
+  /*!
+   * \brief get a page, reading it from the cache file unless it is held in
+   *        memory. The page stays valid as long as the returned pointer is
+   *        held, even after it is evicted. Safe to call from multiple
+   *        threads.
+   * \param page_id index of page
+   * \return the page
+   */
+  std::shared_ptr<const DMatrix> GetPage(size_t page_id);
+
+  /*! \brief rewind the page iterator to the first page */
+  void BeforeFirst();
+  /*!
+   * \brief move the page iterator to the next page, and start reading ahead
+   *        the pages that follow it
+   * \return false if there are no more pages
+   */
+  bool Next();
+  /*! \brief current page of the page iterator */
+  inline const DMatrix& Value() const {
+    return *page_;
+  }
+
+ private:
+  class PageCache;  // defined in data.cc
+
+  PagedDMatrix();
+  size_t num_row_;
+  size_t num_col_;
+  size_t nelem_;
+  size_t num_page_;
+  std::unique_ptr<PageCache> cache_;
+  size_t next_page_;  // page to be returned by the next call to Next()
+  std::shared_ptr<const DMatrix> page_;
 };
 
 }  // namespace treelite
@@ -8,9 +8,14 @@
 #define TREELITE_PREDICTOR_H_
 
 #include <treelite/data.h>
+#include <treelite/annotator.h>
+#include <memory>
+#include <string>
 
 namespace treelite {
 
+class BranchProfiler;
+
 /*! \brief predictor class: wrapper for optimized prediction code */
 class Predictor {
  public:
@@ -25,6 +30,12 @@ class Predictor {
   };
   /*! \brief type alias for prediction function */
   using PredFunc = float (*)(Entry*);
+  /*! \brief type aliases for functions exported by instrumented code */
+  using NumTreeFunc = size_t (*)(void);
+  using NumNodeFunc = size_t (*)(size_t);
+  using FingerprintFunc = unsigned long long (*)(void);  // NOLINT(*)
+  using DumpCountFunc = void (*)(size_t*);
+  using ResetCountFunc = void (*)(void);
 
   Predictor();
   ~Predictor();
@@ -42,7 +53,9 @@ class Predictor {
    */
   void Free();
   /*!
-   * \brief make predictions on a given dataset.
+   * \brief make predictions on a given dataset. Scratch memory is kept for
+   *        each calling thread and reused by later calls, so that repeated
+   *        calls on small matrices (see DMatrixBuilder) allocate no memory.
    * \param dmat data matrix
    * \param nthread number of threads to use for predicting
    * \param verbose whether to produce extra messages
@@ -50,7 +63,75 @@ class Predictor {
    */
   void Predict(const DMatrix* dmat, int nthread, int verbose,
                float* out_result) const;
+  /*!
+   * \brief make predictions on a subset of the rows of a dataset, without
+   *        copying the rows
+   * \param view rows of data matrix
+   * \param nthread number of threads to use for predicting
+   * \param verbose whether to produce extra messages
+   * \param out_result used to save predictions, in the order of rows in the
+   *                   view; must have room for view->num_row() predictions
+   */
+  void Predict(const DMatrixView* view, int nthread, int verbose,
+               float* out_result) const;
+  /*!
+   * \brief make predictions on a paged dataset, one page at a time
+   * \param dmat paged data matrix
+   * \param nthread number of threads to use for predicting
+   * \param verbose whether to produce extra messages
+   * \param out_result used to save predictions; must have room for
+   *                   dmat->num_row() predictions
+   */
+  void Predict(PagedDMatrix* dmat, int nthread, int verbose,
+               float* out_result) const;
 
+  /*!
+   * \brief whether the loaded library was compiled with instrumentation
+   *        (compiler parameter instrument=1), i.e. whether it collects
+   *        branch annotation while predicting
+   */
+  inline bool IsInstrumented() const {
+    return num_tree_func_ != nullptr && num_node_func_ != nullptr
+           && fingerprint_func_ != nullptr && dump_count_func_ != nullptr
+           && reset_count_func_ != nullptr;
+  }
+  /*!
+   * \brief fetch branch annotation collected by instrumented prediction code
+   *        so far, summed over all threads. The result is exact only if no
+   *        prediction is in progress.
+   * \param out used to save branch annotation
+   */
+  void GetBranchAnnotation(BranchAnnotator* out) const;
+  /*!
+   * \brief reset counters in instrumented prediction code
+   */
+  void ResetBranchAnnotation();
+  /*!
+   * \brief enable live profiling of branches. A small random fraction of the
+   *        rows passed to Predict() is handed to a background thread, which
+   *        traverses the model and accumulates branch counts. The counts are
+   *        exported periodically to a file that can be used as a branch
+   *        annotation file, so that prediction code can be rebuilt with
+   *        profiles of real traffic. Rows are collected into per-thread
+   *        buffers without synchronization and handed over once per call to
+   *        Predict(); when the background thread falls behind, samples are
+   *        dropped rather than delaying prediction.
+   * \param model model from which the prediction code was generated; must
+   *              stay alive until profiling is disabled
+   * \param sample_rate fraction of rows to sample; must be in range (0, 1]
+   * \param export_path file to which branch counts are exported
+   * \param export_interval interval between exports, in seconds
+   * \param format file format of exported branch counts
+   */
+  void EnableBranchProfiling(const Model& model, double sample_rate,
+                             const std::string& export_path,
+                             double export_interval,
+                             AnnotationFormat format = AnnotationFormat::kJSON);
+  /*!
+   * \brief disable live profiling of branches. Remaining samples are counted
+   *        and the counts exported one last time.
+   */
+  void DisableBranchProfiling();
   /*!
    * \brief get prediction function
    * \return function pointer pointing to the prediction function
@@ -62,6 +143,12 @@ class Predictor {
  private:
   void* lib_handle_;
   PredFunc func_;
+  NumTreeFunc num_tree_func_;
+  NumNodeFunc num_node_func_;
+  FingerprintFunc fingerprint_func_;
+  DumpCountFunc dump_count_func_;
+  ResetCountFunc reset_count_func_;
+  std::unique_ptr<BranchProfiler> profiler_;
 };
 
 }  // namespace treelite
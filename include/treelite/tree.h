@@ -9,26 +9,41 @@
 
 #include <treelite/base.h>
 #include <treelite/common.h>
+#include <treelite/data.h>
 #include <dmlc/logging.h>
 #include <vector>
 #include <limits>
+#include <cstdint>
 
 namespace treelite {
 
-/*! \brief in-memory representation of a decision tree */
+/*!
+ * \brief in-memory representation of a decision tree. Nodes are stored in
+ *        structure-of-arrays layout: each field of all nodes is kept in an
+ *        array of its own, so that a pass reading a few fields (e.g. a
+ *        traversal reading children, split indices and thresholds) does not
+ *        pull the other fields into cache. Nodes are accessed through the
+ *        Node proxy returned by operator[], or through the read-only
+ *        ConstNode proxy for a const tree. The arrays of a tree loaded with
+ *        Model::Load() refer to the model file and are copied only when the
+ *        tree is modified.
+ */
 class Tree {
  public:
-  /*! \brief tree node */
-  class Node {
+  /*!
+   * \brief read-only reference to one node of the tree. Returned by the const
+   *        version of operator[], so that a const tree cannot be modified
+   *        through it.
+   */
+  class ConstNode {
    public:
-    Node() : sindex_(0) {}
     /*! \brief index of left child */
     inline int cleft() const {
-      return this->cleft_;
+      return tree_->cleft_[nid_];
     }
     /*! \brief index of right child */
     inline int cright() const {
-      return this->cright_;
+      return tree_->cright_[nid_];
     }
     /*! \brief index of default child when feature is missing */
     inline int cdefault() const {
@@ -36,40 +51,55 @@ class Tree {
     }
     /*! \brief feature index of split condition */
     inline unsigned split_index() const {
-      return sindex_ & ((1U << 31) - 1U);
+      return tree_->sindex_[nid_] & ((1U << 31) - 1U);
     }
     /*! \brief when feature is unknown, whether goes to left child */
     inline bool default_left() const {
-      return (sindex_ >> 31) != 0;
+      return (tree_->sindex_[nid_] >> 31) != 0;
     }
     /*! \brief whether current node is leaf node */
     inline bool is_leaf() const {
-      return cleft_ == -1;
+      return tree_->cleft_[nid_] == -1;
     }
     /*! \return get leaf value of leaf node */
     inline tl_float leaf_value() const {
-      return (this->info_).leaf_value;
+      return tree_->leaf_value_[nid_];
     }
     /*! \return get threshold of the node */
     inline tl_float threshold() const {
-      return (this->info_).threshold;
+      return tree_->threshold_[nid_];
     }
     /*! \brief get parent of the node */
     inline int parent() const {
-      return parent_ & ((1U << 31) - 1);
+      return tree_->parent_[nid_] & ((1U << 31) - 1);
     }
     /*! \brief whether current node is left child */
     inline bool is_left_child() const {
-      return (parent_ & (1U << 31)) != 0;
+      return (tree_->parent_[nid_] & (1U << 31)) != 0;
     }
     /*! \brief whether current node is root */
     inline bool is_root() const {
-      return parent_ == -1;
+      return tree_->parent_[nid_] == -1;
     }
     /*! \brief get comparison operator */
     inline Operator comparison_op() const {
-      return cmp_;
+      return tree_->cmp_[nid_];
     }
+
+   private:
+    friend class Tree;
+    ConstNode(const Tree* tree, int nid) : tree_(tree), nid_(nid) {}
+    // reads go through a const tree, so that node arrays referring to
+    // external storage are not copied
+    const Tree* tree_;
+
+   protected:
+    int nid_;
+  };
+
+  /*! \brief tree node; a modifiable reference to one node of the tree */
+  class Node : public ConstNode {
+   public:
     /*!
      * \brief set split condition of current node
      * \param split_index feature index to split
@@ -82,18 +112,18 @@ class Tree {
                           bool default_left, Operator cmp) {
       CHECK_LT(split_index, (1U << 31) - 1) << "split_index too big";
       if (default_left) split_index |= (1U << 31);
-      this->sindex_ = split_index;
-      (this->info_).threshold = threshold;
-      this->cmp_ = cmp;
+      tree_->sindex_[nid_] = split_index;
+      tree_->threshold_[nid_] = threshold;
+      tree_->cmp_[nid_] = cmp;
     }
     /*!
      * \brief set the leaf value of the node
      * \param value leaf value
      */
     inline void set_leaf(tl_float value) {
-      (this->info_).leaf_value = value;
-      this->cleft_ = -1;
-      this->cright_ = -1;
+      tree_->leaf_value_[nid_] = value;
+      tree_->cleft_[nid_] = -1;
+      tree_->cright_[nid_] = -1;
     }
     /*!
      * \brief set parent of the node
@@ -102,47 +132,73 @@ class Tree {
      */
     inline void set_parent(int pidx, bool is_left_child = true) {
       if (is_left_child) pidx |= (1U << 31);
-      this->parent_ = pidx;
+      tree_->parent_[nid_] = pidx;
     }
 
    private:
     friend class Tree;
-    /*! \brief store either leaf value or decision threshold */
-    union Info {
-      tl_float leaf_value;  // for leaf nodes
-      tl_float threshold;   // for non-leaf nodes
-    };
-    /*!
-     * \brief pointer to parent
-     * highest bit is used to indicate whether it's a left child or not
-     */
-    int parent_;
-    /*! \brief pointer to left and right children */
-    int cleft_, cright_;
-    /*!
-     * \brief feature index used for the split
-     * highest bit indicates default direction for missing values
-     */
-    unsigned sindex_;
-    /*! \brief storage for leaf value or decision threshold */
-    Info info_;
-    /*!
-     * \brief operator to use for expression of form [fval] OP [threshold].
-     * If the expression evaluates to true, take the left child;
-     * otherwise, take the right child.
-     */
-    Operator cmp_;
+    Node(Tree* tree, int nid) : ConstNode(tree, nid), tree_(tree) {}
+    // writes go through a non-const tree, which copies node arrays referring
+    // to external storage
+    Tree* tree_;
   };
 
+  friend struct Model;  // for serialization
+
+  /*! \brief number of bytes taken by each node, summed over all arrays */
+  static constexpr size_t kNodeBytes
+    = 3 * sizeof(int) + sizeof(unsigned) + 2 * sizeof(tl_float)
+      + sizeof(Operator);
+
  private:
-  // vector of nodes
-  std::vector<Node> nodes;
+  /*!
+   * \brief pointer to parent
+   * highest bit is used to indicate whether it's a left child or not
+   */
+  DataArray<int> parent_;
+  /*! \brief pointer to left and right children */
+  DataArray<int> cleft_, cright_;
+  /*!
+   * \brief feature index used for the split
+   * highest bit indicates default direction for missing values
+   */
+  DataArray<unsigned> sindex_;
+  /*! \brief decision threshold, for non-leaf nodes */
+  DataArray<tl_float> threshold_;
+  /*! \brief leaf value, for leaf nodes */
+  DataArray<tl_float> leaf_value_;
+  /*!
+   * \brief operator to use for expression of form [fval] OP [threshold].
+   * If the expression evaluates to true, take the left child;
+   * otherwise, take the right child.
+   */
+  DataArray<Operator> cmp_;
+  // empty all node arrays, without copying external storage
+  inline void ClearNodes() {
+    parent_.clear();
+    cleft_.clear();
+    cright_.clear();
+    sindex_.clear();
+    threshold_.clear();
+    leaf_value_.clear();
+    cmp_.clear();
+  }
+  // resize all node arrays; new nodes are leaves with value 0
+  inline void ResizeNodes(size_t size) {
+    parent_.resize(size, -1);
+    cleft_.resize(size, -1);
+    cright_.resize(size, -1);
+    sindex_.resize(size, 0);
+    threshold_.resize(size, 0.0f);
+    leaf_value_.resize(size, 0.0f);
+    cmp_.resize(size, Operator::kEQ);
+  }
   // allocate a new node
   inline int AllocNode() {
     int nd = num_nodes++;
     CHECK_LT(num_nodes, std::numeric_limits<int>::max())
         << "number of nodes in the tree exceed 2^31";
-    nodes.resize(num_nodes);
+    ResizeNodes(num_nodes);
     return nd;
   }
 
@@ -154,23 +210,22 @@ class Tree {
    * \param nid node id
    * \return reference to node
    */
-  inline Node& operator[](int nid) {
-    return nodes[nid];
+  inline Node operator[](int nid) {
+    return Node(this, nid);
   }
   /*!
    * \brief get node given nid (const version)
    * \param nid node id
-   * \return const reference to node
+   * \return read-only reference to node
    */
-  inline const Node& operator[](int nid) const {
-    return nodes[nid];
+  inline ConstNode operator[](int nid) const {
+    return ConstNode(this, nid);
   }
   /*! \brief initialize the model with a single root node */
   inline void Init() {
     num_nodes = 1;
-    nodes.resize(1);
-    nodes[0].set_leaf(0.0f);
-    nodes[0].set_parent(-1);
+    ClearNodes();
+    ResizeNodes(1);
   }
   /*!
    * \brief add child nodes to node
@@ -179,10 +234,109 @@ class Tree {
   inline void AddChilds(int nid) {
     const int cleft = this->AllocNode();
     const int cright = this->AllocNode();
-    nodes[nid].cleft_ = cleft;
-    nodes[nid].cright_ = cright;
-    nodes[cleft].set_parent(nid, true);
-    nodes[cright].set_parent(nid, false);
+    cleft_[nid] = cleft;
+    cright_[nid] = cright;
+    (*this)[cleft].set_parent(nid, true);
+    (*this)[cright].set_parent(nid, false);
+  }
+  /*! \brief content of a source node, as reported to Build() */
+  struct SourceNode {
+    /*! \brief index of left child, or -1 for a leaf */
+    int cleft;
+    /*! \brief index of right child, or -1 for a leaf */
+    int cright;
+    /*! \brief feature index to split; ignored for leaves */
+    unsigned split_index;
+    /*! \brief whether to go to left child when feature is unknown */
+    bool default_left;
+    /*! \brief threshold value; ignored for leaves */
+    tl_float threshold;
+    /*! \brief comparison operator; ignored for leaves */
+    Operator cmp;
+    /*! \brief leaf value; ignored for non-leaf nodes */
+    tl_float leaf_value;
+  };
+  /*!
+   * \brief build the whole tree at once, replacing the current content.
+   *        Source node 0 is the root; nodes are renumbered so that a
+   *        breadth-wise traversal yields the monotonic sequence 0, 1, 2, ...
+   *        Source nodes not reachable from the root (e.g. deleted nodes) are
+   *        dropped. The source is validated and the tree is filled in a
+   *        single pass, with all node arrays allocated up front. Each
+   *        reachable source node is read exactly once.
+   * \param num_nodes number of source nodes
+   * \param get_node function of signature void(int src, SourceNode* out)
+   *                 that reports the content of source node [src]
+   */
+  template <typename NodeSource>
+  inline void Build(int num_nodes, NodeSource get_node) {
+    CHECK_GT(num_nodes, 0) << "Build: tree must have at least one node";
+    // source ID of each node, in the order of new ID's
+    std::vector<int> order;
+    order.reserve(num_nodes);
+    std::vector<uint8_t> visited(num_nodes, 0);
+    ClearNodes();
+    ResizeNodes(num_nodes);
+    order.push_back(0);
+    visited[0] = 1;
+    SourceNode src_node;
+    for (size_t nid = 0; nid < order.size(); ++nid) {
+      const int src = order[nid];
+      get_node(src, &src_node);
+      const int cleft = src_node.cleft;
+      const int cright = src_node.cright;
+      Node node = (*this)[static_cast<int>(nid)];
+      if (cleft == -1 && cright == -1) {
+        node.set_leaf(src_node.leaf_value);
+        continue;
+      }
+      CHECK(cleft >= 0 && cleft < num_nodes && cright >= 0
+            && cright < num_nodes)
+        << "Build: node " << src << " has invalid children ("
+        << cleft << ", " << cright << ")";
+      CHECK(cleft != cright && !visited[cleft] && !visited[cright])
+        << "Build: a child of node " << src
+        << " is reachable by more than one path";
+      visited[cleft] = visited[cright] = 1;
+      const int new_cleft = static_cast<int>(order.size());
+      order.push_back(cleft);
+      order.push_back(cright);
+      cleft_[nid] = new_cleft;
+      cright_[nid] = new_cleft + 1;
+      (*this)[new_cleft].set_parent(static_cast<int>(nid), true);
+      (*this)[new_cleft + 1].set_parent(static_cast<int>(nid), false);
+      node.set_split(src_node.split_index, src_node.threshold,
+                     src_node.default_left, src_node.cmp);
+    }
+    this->num_nodes = static_cast<int>(order.size());
+    ResizeNodes(order.size());
+  }
+  /*!
+   * \brief build the whole tree at once from parallel arrays, replacing the
+   *        current content; see Build(int, NodeSource) for details
+   * \param num_nodes number of source nodes, i.e. length of each array
+   * \param left_child index of left child, or -1 for a leaf
+   * \param right_child index of right child, or -1 for a leaf
+   * \param split_index feature index to split; ignored for leaves
+   * \param default_left whether to go to left child when feature is
+   *                     unknown (0 or 1); ignored for leaves
+   * \param threshold threshold value; ignored for leaves
+   * \param cmp comparison operator; ignored for leaves
+   * \param leaf_value leaf value; ignored for non-leaf nodes
+   */
+  inline void Build(int num_nodes, const int* left_child,
+                    const int* right_child, const unsigned* split_index,
+                    const uint8_t* default_left, const tl_float* threshold,
+                    const Operator* cmp, const tl_float* leaf_value) {
+    Build(num_nodes, [&](int src, SourceNode* out) {
+      out->cleft = left_child[src];
+      out->cright = right_child[src];
+      out->split_index = split_index[src];
+      out->default_left = (default_left[src] != 0);
+      out->threshold = threshold[src];
+      out->cmp = cmp[src];
+      out->leaf_value = leaf_value[src];
+    });
   }
 };
 
@@ -202,6 +356,28 @@ struct Model {
   Model& operator=(const Model&) = delete;
   Model(Model&&) = default;
   Model& operator=(Model&&) = default;
+
+  /*!
+   * \brief save the model in native binary format, so that it can be loaded
+   *        quickly later with Load(). The node arrays of every tree are
+   *        stored in separate aligned sections, so that they can be used
+   *        directly from a memory mapping of the file.
+   * \param fo output stream
+   */
+  void Save(dmlc::Stream* fo) const;
+  /*!
+   * \brief load a model saved in native binary format. A local file is
+   *        memory-mapped and the node arrays refer directly to the mapping,
+   *        without deserialization; the mapping is released when the last
+   *        tree referring to it is deleted. Processes on the same host share
+   *        the mapped pages. The layout of the file and the structure of
+   *        every tree are validated in a single read-only pass over the node
+   *        arrays, so that a corrupted file fails to load rather than leading
+   *        to out-of-bounds access later.
+   * \param filename name of file (local path or URI)
+   * \return loaded model
+   */
+  static Model Load(const char* filename);
 };
 
 }  // namespace treelite
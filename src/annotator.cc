@@ -6,7 +6,15 @@
  */
  
 #include <treelite/annotator.h>
+#include <dmlc/threadediter.h>
+#include <dmlc/memory_io.h>
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <cmath>
+#include <cstring>
 #include <omp.h>
+#include "./common/mmap.h"
 
 namespace {
 
@@ -14,25 +22,37 @@ union Entry {
   int missing;
   float fvalue;
 };
+static_assert(sizeof(Entry) == sizeof(float),
+              "Entry must have the layout of dense DMatrix values");
 
-void Traverse_(const treelite::Tree& tree, const Entry* data,
-               int nid, size_t* out_counts) {
-  const treelite::Tree::Node& node = tree[nid];
-  
+/* maximum number of rows to be processed together as a block. Each thread
+   keeps feature vectors for a whole block of rows, so that every tree is
+   pulled into cache once per block rather than once per row. */
+const size_t kRowBlockSize = 64;
+/* upper bound for the size of feature vectors held by each thread; limits
+   the row block size when the number of features is large */
+const size_t kInstBlockBytes = 4 * 1024 * 1024;
+/* upper bound for the total size of tree nodes in a single tree block;
+   chosen so that a block of trees fits comfortably into L2 cache */
+const size_t kTreeBlockBytes = 256 * 1024;
+
+inline void Traverse(const treelite::Tree& tree, const Entry* data,
+                     size_t* out_counts) {
+  int nid = 0;
   ++out_counts[nid];
-  if (!node.is_leaf()) {
+  while (!tree[nid].is_leaf()) {
+    const treelite::Tree::ConstNode node = tree[nid];
     const unsigned split_index = node.split_index();
-    const treelite::tl_float threshold = node.threshold();
-    const treelite::Operator op = node.comparison_op();
 
     if (data[split_index].missing == -1) {
-      Traverse_(tree, data, node.cdefault(), out_counts);
+      nid = node.cdefault();
     } else {
       // perform comparison with fvalue
       const treelite::tl_float fvalue
         = static_cast<treelite::tl_float>(data[split_index].fvalue);
+      const treelite::tl_float threshold = node.threshold();
       bool result = true;
-      switch (op) {
+      switch (node.comparison_op()) {
        case treelite::Operator::kEQ:
         result = (fvalue == threshold); break;
        case treelite::Operator::kLT:
@@ -46,44 +66,526 @@ void Traverse_(const treelite::Tree& tree, const Entry* data,
        default:
         LOG(FATAL) << "operator undefined";
       }
-      if (result) {  // left child
-        Traverse_(tree, data, node.cleft(), out_counts);
-      } else {  // right child
-        Traverse_(tree, data, node.cright(), out_counts);
-      }
+      nid = result ? node.cleft() : node.cright();  // left or right child
+    }
+    ++out_counts[nid];
+  }
+}
+
+/* row partitioning keeps a private replica of all counters for every thread,
+   followed by a reduction. Once the replicas would take up more than this
+   many bytes, partition trees among threads instead. */
+const size_t kMaxCounterReplicaBytes = 256 * 1024 * 1024;
+/* sampled annotation: size of the first sample, to be doubled every round */
+const size_t kInitialSampleSize = 8192;
+/* sampled annotation: nodes visited by less than this fraction of sampled
+   rows are not required to have stable branch hints */
+const double kMinNodeFraction = 0.01;
+/* streaming annotation: maximum number of parsed batches kept in memory */
+const size_t kMaxBatchInFlight = 2;
+
+/* binary annotation format: magic number at the beginning of the file */
+const char kBinaryMagic[8] = {'T', 'L', 'A', 'N', 'N', 'O', 'T', '\0'};
+/* binary annotation format: current version */
+const uint32_t kBinaryVersion = 1;
+
+/*!
+ * \brief header of binary annotation file. The header is followed by a table
+ *        of [num_tree] BinaryTreeEntry records and then by the payload,
+ *        holding varint-encoded counts for every node. Using the table, the
+ *        counts of any tree can be located directly in a memory-mapped
+ *        file. The header and the table are stored in native byte order,
+ *        so files cannot be moved between hosts of different byte order;
+ *        the varint-encoded counts do not depend on byte order.
+ */
+struct BinaryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t fingerprint;
+  uint64_t num_tree;
+  uint64_t num_row;
+  uint64_t num_row_sampled;
+  double confidence;
+  double tolerance;
+  double margin;
+  uint64_t payload_size;
+};
+static_assert(sizeof(BinaryHeader) == 80,
+              "BinaryHeader must be packed with no padding");
+
+/*! \brief entry in tree table of binary annotation file */
+struct BinaryTreeEntry {
+  uint64_t num_nodes;
+  uint64_t offset;  // byte offset of counts within payload
+};
+
+/* append an integer in LEB128 varint encoding: 7 bits per byte, with the
+   highest bit set on all but the last byte */
+inline void EncodeVarint(uint64_t value, std::vector<uint8_t>* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<uint8_t>(value));
+}
+
+inline const uint8_t* DecodeVarint(const uint8_t* p, const uint8_t* end,
+                                   size_t* out_value) {
+  uint64_t value = 0;
+  for (int shift = 0; ; shift += 7) {
+    CHECK(p < end && shift < 64)
+      << "Ill-formed annotation file: corrupted varint";
+    const uint8_t byte = *p++;
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  *out_value = static_cast<size_t>(value);
+  return p;
+}
+
+/*!
+ * \brief group trees in range [tree_begin, tree_end) into blocks, so that
+ *        nodes of each block add up to no more than kTreeBlockBytes (a block
+ *        holds at least one tree)
+ * \return list of boundaries; block i consists of trees
+ *         [ret[i], ret[i + 1])
+ */
+inline std::vector<size_t> ComputeTreeBlocks(const treelite::Model& model,
+                                             size_t tree_begin,
+                                             size_t tree_end) {
+  std::vector<size_t> tree_block_ptr{tree_begin};
+  size_t block_bytes = 0;
+  for (size_t tree_id = tree_begin; tree_id < tree_end; ++tree_id) {
+    const size_t tree_bytes
+      = model.trees[tree_id].num_nodes * treelite::Tree::kNodeBytes;
+    if (block_bytes > 0 && block_bytes + tree_bytes > kTreeBlockBytes) {
+      tree_block_ptr.push_back(tree_id);
+      block_bytes = 0;
+    }
+    block_bytes += tree_bytes;
+  }
+  tree_block_ptr.push_back(tree_end);
+  return tree_block_ptr;
+}
+
+/*!
+ * \brief split trees into [nthread] contiguous ranges with roughly equal
+ *        number of nodes
+ * \return list of boundaries; range i consists of trees
+ *         [ret[i], ret[i + 1])
+ */
+inline std::vector<size_t>
+PartitionTrees(const std::vector<size_t>& count_row_ptr, int nthread) {
+  const size_t ntree = count_row_ptr.size() - 1;
+  std::vector<size_t> tree_part_ptr{0};
+  for (int i = 1; i < nthread; ++i) {
+    const size_t target = count_row_ptr[ntree] * i / nthread;
+    const size_t tree_id
+      = std::lower_bound(count_row_ptr.begin(), count_row_ptr.end(), target)
+        - count_row_ptr.begin();
+    tree_part_ptr.push_back(std::max(tree_part_ptr.back(), tree_id));
+  }
+  tree_part_ptr.push_back(ntree);
+  return tree_part_ptr;
+}
+
+inline void FillRowBlock(const treelite::DMatrixView& view,
+                         size_t row_begin, size_t row_end, Entry* block_inst) {
+  const treelite::DMatrix* dmat = view.base();
+  const size_t num_col = dmat->num_col;
+  if (dmat->layout == treelite::DMatrixLayout::kDense) {
+    // missing values are stored with the bit pattern of Entry::missing
+    for (size_t i = row_begin; i < row_end; ++i) {
+      std::memcpy(&block_inst[num_col * (i - row_begin)],
+                  dmat->data.data() + view.RowIndex(i) * num_col,
+                  num_col * sizeof(Entry));
+    }
+    return;
+  }
+  if (dmat->layout == treelite::DMatrixLayout::kCompressedCSR) {
+    for (size_t i = row_begin; i < row_end; ++i) {
+      Entry* row_inst = &block_inst[num_col * (i - row_begin)];
+      dmat->compressed->ForEachEntry(view.RowIndex(i),
+                                     [row_inst](uint32_t col, float value) {
+        row_inst[col].fvalue = treelite::DMatrix::CanonicalizeMissing(value);
+      });
+    }
+    return;
+  }
+  for (size_t i = row_begin; i < row_end; ++i) {
+    Entry* row_inst = &block_inst[num_col * (i - row_begin)];
+    const size_t rid = view.RowIndex(i);
+    for (size_t j = dmat->row_ptr[rid]; j < dmat->row_ptr[rid + 1]; ++j) {
+      // borrowed matrices may hold NaN, which must read as missing
+      row_inst[dmat->col_ind[j]].fvalue
+        = treelite::DMatrix::CanonicalizeMissing(dmat->data[j]);
     }
   }
 }
 
-void Traverse(const treelite::Tree& tree, const Entry* data,
-              size_t* out_counts) {
-  Traverse_(tree, data, 0, out_counts);
+inline void ClearRowBlock(const treelite::DMatrixView& view,
+                          size_t row_begin, size_t row_end, Entry* block_inst) {
+  const treelite::DMatrix* dmat = view.base();
+  const size_t num_col = dmat->num_col;
+  if (dmat->layout == treelite::DMatrixLayout::kDense) {
+    return;  // FillRowBlock() overwrites every entry
+  }
+  if (dmat->layout == treelite::DMatrixLayout::kCompressedCSR) {
+    for (size_t i = row_begin; i < row_end; ++i) {
+      Entry* row_inst = &block_inst[num_col * (i - row_begin)];
+      dmat->compressed->ForEachColumn(view.RowIndex(i),
+                                      [row_inst](uint32_t col) {
+        row_inst[col].missing = -1;
+      });
+    }
+    return;
+  }
+  for (size_t i = row_begin; i < row_end; ++i) {
+    Entry* row_inst = &block_inst[num_col * (i - row_begin)];
+    const size_t rid = view.RowIndex(i);
+    for (size_t j = dmat->row_ptr[rid]; j < dmat->row_ptr[rid + 1]; ++j) {
+      row_inst[dmat->col_ind[j]].missing = -1;
+    }
+  }
 }
 
+/* stream a block of rows through each block of trees */
+inline void TraverseRowBlock(const treelite::Model& model,
+                             const Entry* block_inst, size_t num_col,
+                             size_t num_row,
+                             const std::vector<size_t>& tree_block_ptr,
+                             const size_t* count_row_ptr, size_t* counts) {
+  const size_t ntree_block = tree_block_ptr.size() - 1;
+  for (size_t tb = 0; tb < ntree_block; ++tb) {
+    for (size_t i = 0; i < num_row; ++i) {
+      const Entry* row_inst = &block_inst[num_col * i];
+      for (size_t tree_id = tree_block_ptr[tb];
+           tree_id < tree_block_ptr[tb + 1]; ++tree_id) {
+        Traverse(model.trees[tree_id], row_inst,
+                 &counts[count_row_ptr[tree_id]]);
+      }
+    }
+  }
+}
+
+/* row partitioning: each thread takes blocks of rows and traverses all trees,
+   accumulating into its own replica of counters */
 inline void ComputeBranchLoop(const treelite::Model& model,
-                              const treelite::DMatrix* dmat,
+                              const treelite::DMatrixView& view,
                               size_t rbegin, size_t rend, int nthread,
                               const size_t* count_row_ptr,
+                              const std::vector<size_t>& tree_block_ptr,
+                              size_t row_block_size,
                               size_t* counts_tloc, Entry* inst) {
   const size_t ntree = model.trees.size();
+  const size_t num_col = view.num_col();
+  const size_t nrow_block = (rend - rbegin + row_block_size - 1)
+                            / row_block_size;
   #pragma omp parallel for schedule(static) num_threads(nthread)
-  for (size_t rid = rbegin; rid < rend; ++rid) {
+  for (size_t block_id = 0; block_id < nrow_block; ++block_id) {
     const int tid = omp_get_thread_num();
-    const size_t off = dmat->num_col * tid;
-    const size_t off2 = count_row_ptr[ntree] * tid;
-    const size_t ibegin = dmat->row_ptr[rid];
-    const size_t iend = dmat->row_ptr[rid + 1];
-    for (size_t i = ibegin; i < iend; ++i) {
-      inst[off + dmat->col_ind[i]].fvalue = dmat->data[i];
+    const size_t row_begin = rbegin + block_id * row_block_size;
+    const size_t row_end = std::min(row_begin + row_block_size, rend);
+    Entry* block_inst = &inst[num_col * row_block_size * tid];
+    FillRowBlock(view, row_begin, row_end, block_inst);
+    TraverseRowBlock(model, block_inst, num_col, row_end - row_begin,
+                     tree_block_ptr, count_row_ptr,
+                     &counts_tloc[count_row_ptr[ntree] * tid]);
+    ClearRowBlock(view, row_begin, row_end, block_inst);
+  }
+}
+
+/* tree partitioning: each thread owns a range of trees and scans all rows,
+   writing directly to the counters of the trees it owns */
+inline void ComputeBranchLoopTreeParallel(
+    const treelite::Model& model, const treelite::DMatrixView& view,
+    size_t rbegin, size_t rend, int nthread, const size_t* count_row_ptr,
+    const std::vector<std::vector<size_t>>& tree_block_ptr_per_part,
+    size_t row_block_size, size_t* counts, Entry* inst) {
+  const size_t num_col = view.num_col();
+  #pragma omp parallel num_threads(nthread)
+  {
+    const int tid = omp_get_thread_num();
+    Entry* block_inst = &inst[num_col * row_block_size * tid];
+    // loop in case the runtime provides fewer threads than requested
+    for (int part_id = tid; part_id < nthread;
+         part_id += omp_get_num_threads()) {
+      const std::vector<size_t>& tree_block_ptr
+        = tree_block_ptr_per_part[part_id];
+      if (tree_block_ptr.front() == tree_block_ptr.back()) {
+        continue;  // no tree assigned to this part
+      }
+      for (size_t row_begin = rbegin; row_begin < rend;
+           row_begin += row_block_size) {
+        const size_t row_end = std::min(row_begin + row_block_size, rend);
+        FillRowBlock(view, row_begin, row_end, block_inst);
+        TraverseRowBlock(model, block_inst, num_col, row_end - row_begin,
+                         tree_block_ptr, count_row_ptr, counts);
+        ClearRowBlock(view, row_begin, row_end, block_inst);
+      }
+    }
+  }
+}
+
+/*!
+ * \brief counts how many times each node is visited by rows. Counter
+ *        replicas, tree blocks and feature vector buffers are set up once
+ *        and reused for every call to Count(), so that many small batches
+ *        of rows can be counted without per-batch setup.
+ */
+class NodeCounter {
+ public:
+  /*!
+   * \param count_row_ptr offset of each tree's counters within [counts]
+   * \param counts flat array of node counters; results are added to
+   *               existing values by Count() and Reduce()
+   */
+  NodeCounter(const treelite::Model& model, int nthread, int verbose,
+              const std::vector<size_t>& count_row_ptr, size_t* counts)
+    : model_(model), nthread_(nthread), count_row_ptr_(count_row_ptr),
+      counts_(counts), inst_dirty_(false) {
+    const size_t ntree = model.trees.size();
+    // choose between row and tree partitioning
+    tree_parallel_
+      = (nthread > 1 && ntree >= static_cast<size_t>(nthread)
+         && count_row_ptr[ntree] * sizeof(size_t) * nthread
+            > kMaxCounterReplicaBytes);
+    if (tree_parallel_) {
+      const std::vector<size_t> tree_part_ptr
+        = PartitionTrees(count_row_ptr, nthread);
+      for (int i = 0; i < nthread; ++i) {
+        tree_block_ptr_per_part_.push_back(
+          ComputeTreeBlocks(model, tree_part_ptr[i], tree_part_ptr[i + 1]));
+      }
+    } else {
+      // a single thread needs no replica
+      if (nthread > 1) {
+        counts_tloc_.resize(count_row_ptr[ntree] * nthread, 0);
+      }
+      tree_block_ptr_ = ComputeTreeBlocks(model, 0, ntree);
+    }
+    if (verbose > 0) {
+      LOG(INFO) << "Annotating with " << nthread << " thread(s); "
+                << "partitioning " << (tree_parallel_ ? "trees" : "rows")
+                << " among threads";
+    }
+  }
+  /*!
+   * \brief count node visits by rows in the view. With row partitioning,
+   *        counts are accumulated in per-thread replicas until Reduce()
+   */
+  inline void Count(const treelite::DMatrixView& view, int verbose) {
+    const size_t num_col = view.num_col();
+    const size_t num_row = view.num_row();
+    const size_t row_block_size
+      = std::max(static_cast<size_t>(1),
+                 std::min(kRowBlockSize, kInstBlockBytes
+                          / (std::max(num_col, static_cast<size_t>(1))
+                             * sizeof(Entry))));
+    // every entry of the buffer reads as missing between row blocks, except
+    // after dense rows, which are overwritten rather than cleared
+    const size_t inst_size = nthread_ * row_block_size * num_col;
+    const bool dense
+      = (view.base()->layout == treelite::DMatrixLayout::kDense);
+    if (inst_.size() < inst_size || (inst_dirty_ && !dense)) {
+      inst_.assign(std::max(inst_.size(), inst_size), {-1});
     }
-    for (size_t tree_id = 0; tree_id < ntree; ++tree_id) {
-      Traverse(model.trees[tree_id], &inst[off],
-               &counts_tloc[off2 + count_row_ptr[tree_id]]);
+    inst_dirty_ = dense;
+    // interval to display progress; round up to a multiple of row block size
+    const size_t pstep = ((num_row + 99) / 100 + row_block_size - 1)
+                         / row_block_size * row_block_size;
+    for (size_t rbegin = 0; rbegin < num_row; rbegin += pstep) {
+      const size_t rend = std::min(rbegin + pstep, num_row);
+      if (tree_parallel_) {
+        ComputeBranchLoopTreeParallel(model_, view, rbegin, rend, nthread_,
+                                      &count_row_ptr_[0],
+                                      tree_block_ptr_per_part_,
+                                      row_block_size, counts_, &inst_[0]);
+      } else {
+        ComputeBranchLoop(model_, view, rbegin, rend, nthread_,
+                          &count_row_ptr_[0], tree_block_ptr_,
+                          row_block_size,
+                          counts_tloc_.empty() ? counts_ : &counts_tloc_[0],
+                          &inst_[0]);
+      }
+      if (verbose > 0) {
+        LOG(INFO) << rend << " of " << num_row << " rows processed";
+      }
+    }
+  }
+  /*!
+   * \brief add per-thread replicas of counters to the output and reset
+   *        them (only needed for row partitioning with multiple threads)
+   */
+  inline void Reduce() {
+    if (counts_tloc_.empty()) {
+      return;
+    }
+    const size_t num_counter = count_row_ptr_.back();
+    for (int tid = 0; tid < nthread_; ++tid) {
+      size_t* tloc = &counts_tloc_[num_counter * tid];
+      for (size_t i = 0; i < num_counter; ++i) {
+        counts_[i] += tloc[i];
+        tloc[i] = 0;
+      }
+    }
+  }
+
+ private:
+  const treelite::Model& model_;
+  int nthread_;
+  const std::vector<size_t>& count_row_ptr_;
+  size_t* counts_;
+  bool tree_parallel_;
+  std::vector<size_t> counts_tloc_;
+  std::vector<size_t> tree_block_ptr_;
+  std::vector<std::vector<size_t>> tree_block_ptr_per_part_;
+  std::vector<Entry> inst_;
+  bool inst_dirty_;  // whether inst_ holds values of dense rows
+};
+
+/*!
+ * \brief draws rows uniformly at random without replacement. Implements
+ *        Fisher-Yates shuffle lazily, recording only the swapped positions,
+ *        so that memory usage is proportional to the number of rows drawn.
+ */
+class RowSampler {
+ public:
+  RowSampler(size_t num_row, uint64_t seed)
+    : num_row_(num_row), num_drawn_(0), rng_(seed) {}
+  /*!
+   * \brief draw up to [n] more rows, excluding all rows drawn previously
+   * \param n number of rows to draw
+   * \param out_rows used to store the row indices being drawn
+   */
+  inline void Draw(size_t n, std::vector<size_t>* out_rows) {
+    for (; n > 0 && num_drawn_ < num_row_; --n, ++num_drawn_) {
+      std::uniform_int_distribution<size_t> dist(num_drawn_, num_row_ - 1);
+      const size_t pos = dist(rng_);
+      out_rows->push_back(Lookup(pos));
+      swapped_[pos] = Lookup(num_drawn_);
+      swapped_.erase(num_drawn_);
+    }
+  }
+  inline size_t NumDrawn() const {
+    return num_drawn_;
+  }
+
+ private:
+  size_t num_row_;
+  size_t num_drawn_;
+  std::mt19937_64 rng_;
+  std::unordered_map<size_t, size_t> swapped_;
+
+  inline size_t Lookup(size_t pos) const {
+    auto it = swapped_.find(pos);
+    return (it == swapped_.end()) ? pos : it->second;
+  }
+};
+
+/*!
+ * \brief z-score for a given two-sided confidence level, e.g. 1.96 for 0.95
+ */
+inline double ConfidenceToZScore(double confidence) {
+  // solve erfc(z / sqrt(2)) = 1 - confidence with bisection
+  double low = 0.0, high = 10.0;
+  for (int i = 0; i < 100; ++i) {
+    const double mid = (low + high) / 2;
+    if (std::erfc(mid / std::sqrt(2.0)) > 1.0 - confidence) {
+      low = mid;
+    } else {
+      high = mid;
     }
-    for (size_t i = ibegin; i < iend; ++i) {
-      inst[off + dmat->col_ind[i]].missing = -1;
+  }
+  return (low + high) / 2;
+}
+
+/*!
+ * \brief check whether the branch hints computed from sampled counts are
+ *        stable. For every test node, we compute the Wilson score interval
+ *        for the fraction of rows going to the left child. A node is
+ *        considered settled if its interval excludes 1/2, so that the
+ *        LIKELY/UNLIKELY decision is certain at the given confidence level,
+ *        or if the interval is narrower than the tolerance, so that a flip
+ *        would not matter. Nodes visited by less than [min_node_count] rows
+ *        are ignored, since their hints hardly affect prediction speed.
+ * \param out_margin used to store the largest half-width among intervals
+ *                   that include 1/2
+ * \return whether all nodes are settled
+ */
+inline bool CheckStability(const treelite::Model& model,
+                           const std::vector<size_t>& count_row_ptr,
+                           const std::vector<size_t>& counts,
+                           double z, double tolerance, size_t min_node_count,
+                           double* out_margin) {
+  bool stable = true;
+  double max_margin = 0.0;
+  for (size_t tree_id = 0; tree_id < model.trees.size(); ++tree_id) {
+    const treelite::Tree& tree = model.trees[tree_id];
+    const size_t* tree_counts = &counts[count_row_ptr[tree_id]];
+    for (int nid = 0; nid < tree.num_nodes; ++nid) {
+      const treelite::Tree::ConstNode node = tree[nid];
+      const size_t count = tree_counts[nid];
+      if (node.is_leaf() || count == 0 || count < min_node_count) {
+        continue;
+      }
+      const double n = static_cast<double>(count);
+      const double p = tree_counts[node.cleft()] / n;
+      const double denom = 1.0 + z * z / n;
+      const double center = (p + z * z / (2 * n)) / denom;
+      const double margin
+        = z / denom * std::sqrt(p * (1 - p) / n + z * z / (4 * n * n));
+      if (std::abs(center - 0.5) > margin) {
+        continue;  // decision is settled
+      }
+      max_margin = std::max(max_margin, margin);
+      if (margin > tolerance) {
+        stable = false;
+      }
     }
   }
+  *out_margin = max_margin;
+  return stable;
+}
+
+/*!
+ * \brief convert a batch of rows produced by a data parser into a data matrix
+ * \param batch batch of rows
+ * \param num_feature number of features used by the model; the data matrix
+ *                    will have at least this many columns
+ * \param out used to store the data matrix
+ */
+inline void BatchToDMatrix(const dmlc::RowBlock<uint32_t>& batch,
+                           size_t num_feature, treelite::DMatrix* out) {
+  const size_t ibegin = batch.offset[0];
+  const size_t iend = batch.offset[batch.size];
+  out->Clear();
+  out->data.resize(iend - ibegin);
+  out->col_ind.assign(batch.index + ibegin, batch.index + iend);
+  out->row_ptr.resize(batch.size + 1);
+  size_t num_col = num_feature;
+  for (size_t i = ibegin; i < iend; ++i) {
+    out->data[i - ibegin] = (batch.value == nullptr) ? 1.0f :
+                            static_cast<float>(batch.value[i]);
+    num_col = std::max(num_col, static_cast<size_t>(batch.index[i]) + 1);
+  }
+  for (size_t i = 0; i <= batch.size; ++i) {
+    out->row_ptr[i] = batch.offset[i] - ibegin;
+  }
+  out->num_row = batch.size;
+  out->num_col = num_col;
+  out->nelem = iend - ibegin;
+}
+
+inline std::vector<size_t> ComputeCountRowPtr(const treelite::Model& model) {
+  std::vector<size_t> count_row_ptr{0};
+  for (const treelite::Tree& tree : model.trees) {
+    count_row_ptr.push_back(count_row_ptr.back() + tree.num_nodes);
+  }
+  return count_row_ptr;
 }
 
 }  // namespace anonymous
@@ -93,58 +595,498 @@ namespace treelite {
 void
 BranchAnnotator::Annotate(const Model& model, const DMatrix* dmat,
                           int nthread, int verbose) {
-  std::vector<size_t> counts;
-  std::vector<size_t> counts_tloc;
-  std::vector<size_t> count_row_ptr;
-  count_row_ptr = {0};
+  const DMatrixView view(dmat);
+  Annotate(model, &view, nthread, verbose);
+}
+
+void
+BranchAnnotator::Annotate(const Model& model, const DMatrixView* view,
+                          int nthread, int verbose) {
+  const int max_thread = omp_get_max_threads();
+  nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
+  const std::vector<size_t> count_row_ptr = ComputeCountRowPtr(model);
   const size_t ntree = model.trees.size();
+  std::vector<size_t> counts(count_row_ptr[ntree], 0);
+  NodeCounter counter(model, nthread, verbose, count_row_ptr, &counts[0]);
+  counter.Count(*view, verbose);
+  counter.Reduce();
+
+  // change layout of counts
+  this->counts.clear();
+  for (size_t i = 0; i < ntree; ++i) {
+    this->counts.emplace_back(&counts[count_row_ptr[i]],
+                              &counts[count_row_ptr[i + 1]]);
+  }
+  this->sample = SampleInfo();
+  this->sample.num_row = this->sample.num_row_sampled = view->num_row();
+  this->fingerprint = ComputeFingerprint(model);
+}
+
+void
+BranchAnnotator::Annotate(const Model& model,
+                          dmlc::Parser<uint32_t>* parser,
+                          int nthread, int verbose) {
   const int max_thread = omp_get_max_threads();
   nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
-  for (const Tree& tree : model.trees) {
-    count_row_ptr.push_back(count_row_ptr.back() + tree.num_nodes);
+  const std::vector<size_t> count_row_ptr = ComputeCountRowPtr(model);
+  const size_t ntree = model.trees.size();
+  std::vector<size_t> counts(count_row_ptr[ntree], 0);
+  const size_t num_feature = static_cast<size_t>(model.num_features);
+
+  // parse the next batch in a background thread while the current batch is
+  // being annotated; at most kMaxBatchInFlight batches are kept in memory
+  dmlc::ThreadedIter<DMatrix> iter(kMaxBatchInFlight);
+  parser->BeforeFirst();
+  iter.Init([parser, num_feature](DMatrix** dptr) {
+    if (!parser->Next()) {
+      return false;
+    }
+    if (*dptr == nullptr) {
+      *dptr = new DMatrix();
+    }
+    BatchToDMatrix(parser->Value(), num_feature, *dptr);
+    return true;
+  }, [parser]() { parser->BeforeFirst(); });
+
+  // counter replicas and buffers are shared by all batches, and replicas
+  // are reduced once at the end
+  NodeCounter counter(model, nthread, verbose, count_row_ptr, &counts[0]);
+  size_t num_row = 0;
+  DMatrix* batch = nullptr;
+  while (iter.Next(&batch)) {
+    counter.Count(DMatrixView(batch), 0);
+    num_row += batch->num_row;
+    iter.Recycle(&batch);
+    if (verbose > 0) {
+      LOG(INFO) << num_row << " rows processed";
+    }
+  }
+  iter.Destroy();
+  counter.Reduce();
+
+  // change layout of counts
+  this->counts.clear();
+  for (size_t i = 0; i < ntree; ++i) {
+    this->counts.emplace_back(&counts[count_row_ptr[i]],
+                              &counts[count_row_ptr[i + 1]]);
   }
-  counts.resize(count_row_ptr[ntree], 0);
-  counts_tloc.resize(count_row_ptr[ntree] * nthread, 0);
-  
-  std::vector<Entry> inst(nthread * dmat->num_col, {-1});
-  const size_t pstep = (dmat->num_row + 99) / 100;
-      // interval to display progress
-  for (size_t rbegin = 0; rbegin < dmat->num_row; rbegin += pstep) {
-    const size_t rend = std::min(rbegin + pstep, dmat->num_row);
-    ComputeBranchLoop(model, dmat, rbegin, rend, nthread,
-                      &count_row_ptr[0], &counts_tloc[0], &inst[0]);
+  this->sample = SampleInfo();
+  this->sample.num_row = this->sample.num_row_sampled = num_row;
+  this->fingerprint = ComputeFingerprint(model);
+}
+
+void
+BranchAnnotator::Annotate(const Model& model, PagedDMatrix* dmat,
+                          int nthread, int verbose) {
+  const int max_thread = omp_get_max_threads();
+  nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
+  const std::vector<size_t> count_row_ptr = ComputeCountRowPtr(model);
+  const size_t ntree = model.trees.size();
+  std::vector<size_t> counts(count_row_ptr[ntree], 0);
+
+  // the paged data matrix reads the next pages in a background thread while
+  // the current page is being annotated
+  NodeCounter counter(model, nthread, verbose, count_row_ptr, &counts[0]);
+  size_t num_row = 0;
+  dmat->BeforeFirst();
+  while (dmat->Next()) {
+    const DMatrix& page = dmat->Value();
+    counter.Count(DMatrixView(&page), 0);
+    num_row += page.num_row;
     if (verbose > 0) {
-      LOG(INFO) << rend << " of " << dmat->num_row << " rows processed";
+      LOG(INFO) << num_row << " of " << dmat->num_row() << " rows processed";
     }
   }
+  counter.Reduce();
+
+  // change layout of counts
+  this->counts.clear();
+  for (size_t i = 0; i < ntree; ++i) {
+    this->counts.emplace_back(&counts[count_row_ptr[i]],
+                              &counts[count_row_ptr[i + 1]]);
+  }
+  this->sample = SampleInfo();
+  this->sample.num_row = this->sample.num_row_sampled = num_row;
+  this->fingerprint = ComputeFingerprint(model);
+}
+
+void
+BranchAnnotator::AnnotateSampled(const Model& model, const DMatrix* dmat,
+                                 int nthread, int verbose, double tolerance,
+                                 double confidence, uint64_t seed) {
+  CHECK(tolerance > 0.0 && tolerance < 0.5)
+    << "AnnotateSampled: tolerance must be in range (0, 0.5)";
+  CHECK(confidence > 0.0 && confidence < 1.0)
+    << "AnnotateSampled: confidence must be in range (0, 1)";
+  const int max_thread = omp_get_max_threads();
+  nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
+  const std::vector<size_t> count_row_ptr = ComputeCountRowPtr(model);
+  const size_t ntree = model.trees.size();
+  std::vector<size_t> counts(count_row_ptr[ntree], 0);
+  const double z = ConfidenceToZScore(confidence);
 
-  // perform reduction on counts
-  for (int tid = 0; tid < nthread; ++tid) {
-    const size_t off = count_row_ptr[ntree] * tid;
-    for (size_t i = 0; i < count_row_ptr[ntree]; ++i) {
-      counts[i] += counts_tloc[off + i];
+  NodeCounter counter(model, nthread, verbose, count_row_ptr, &counts[0]);
+  RowSampler sampler(dmat->num_row, seed);
+  std::vector<size_t> rows;
+  double margin = 0.0;
+  size_t sample_size = std::min(kInitialSampleSize, dmat->num_row);
+  while (true) {
+    // grow the sample and count branches for the newly drawn rows
+    rows.clear();
+    sampler.Draw(sample_size - sampler.NumDrawn(), &rows);
+    // sorted for better locality; the sampled rows are not copied
+    std::sort(rows.begin(), rows.end());
+    counter.Count(DMatrixView(dmat, std::move(rows)), 0);
+    counter.Reduce();  // stability is checked on the counts so far
+    const size_t min_node_count
+      = static_cast<size_t>(kMinNodeFraction * sampler.NumDrawn());
+    const bool stable = CheckStability(model, count_row_ptr, counts, z,
+                                       tolerance, min_node_count, &margin);
+    if (verbose > 0) {
+      LOG(INFO) << sampler.NumDrawn() << " of " << dmat->num_row
+                << " rows sampled; largest margin of error = " << margin;
+    }
+    if (stable || sampler.NumDrawn() == dmat->num_row) {
+      break;
     }
+    sample_size = std::min(sample_size * 2, dmat->num_row);
   }
-  
+
   // change layout of counts
+  this->counts.clear();
   for (size_t i = 0; i < ntree; ++i) {
     this->counts.emplace_back(&counts[count_row_ptr[i]],
                               &counts[count_row_ptr[i + 1]]);
   }
+  this->sample.num_row = dmat->num_row;
+  this->sample.num_row_sampled = sampler.NumDrawn();
+  this->sample.confidence = confidence;
+  this->sample.tolerance = tolerance;
+  this->sample.margin = margin;
+  this->fingerprint = ComputeFingerprint(model);
+}
+
+class BranchCounter::Impl {
+ public:
+  Impl(const Model& model, int nthread)
+    : count_row_ptr(ComputeCountRowPtr(model)),
+      counts(count_row_ptr.back(), 0),
+      counter(model, nthread, 0, count_row_ptr, counts.data()),
+      fingerprint(BranchAnnotator::ComputeFingerprint(model)) {}
+
+  std::vector<size_t> count_row_ptr;
+  std::vector<size_t> counts;
+  NodeCounter counter;
+  uint64_t fingerprint;
+};
+
+BranchCounter::BranchCounter(const Model& model, int nthread) {
+  const int max_thread = omp_get_max_threads();
+  nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
+  pimpl_.reset(new Impl(model, nthread));
+}
+
+BranchCounter::~BranchCounter() = default;
+
+void
+BranchCounter::Count(const DMatrixView& view) {
+  pimpl_->counter.Count(view, 0);
+}
+
+void
+BranchCounter::GetAnnotation(BranchAnnotator* out) {
+  pimpl_->counter.Reduce();
+  const std::vector<size_t>& count_row_ptr = pimpl_->count_row_ptr;
+  const size_t* counts = pimpl_->counts.data();
+  std::vector<std::vector<size_t>> annotation;
+  annotation.reserve(count_row_ptr.size() - 1);
+  for (size_t i = 0; i + 1 < count_row_ptr.size(); ++i) {
+    annotation.emplace_back(counts + count_row_ptr[i],
+                            counts + count_row_ptr[i + 1]);
+  }
+  out->Set(std::move(annotation), pimpl_->fingerprint);
+}
+
+void
+BranchAnnotator::Merge(const BranchAnnotator& other) {
+  CHECK(fingerprint != 0 && other.fingerprint != 0)
+    << "Merge: cannot merge an annotation without model fingerprint; "
+    << "annotate again with this version of treelite";
+  CHECK_EQ(fingerprint, other.fingerprint)
+    << "Merge: cannot merge annotations produced for different models";
+  CHECK_EQ(counts.size(), other.counts.size())
+    << "Merge: cannot merge annotations with different numbers of trees";
+  for (size_t tree_id = 0; tree_id < counts.size(); ++tree_id) {
+    CHECK_EQ(counts[tree_id].size(), other.counts[tree_id].size())
+      << "Merge: cannot merge annotations with different numbers of nodes "
+      << "in tree " << tree_id;
+  }
+  const bool sampled = (sample.num_row_sampled < sample.num_row);
+  const bool other_sampled
+    = (other.sample.num_row_sampled < other.sample.num_row);
+  if (sampled && other_sampled) {
+    CHECK(sample.confidence == other.sample.confidence
+          && sample.tolerance == other.sample.tolerance)
+      << "Merge: sampled annotations must use the same confidence level "
+      << "and tolerance";
+  }
+  // Counts from a sample stand for [num_row / num_row_sampled] times as
+  // many rows. Rescale both sides to the merged sampling fraction, so that
+  // each side contributes in proportion to its number of rows; the merged
+  // counts are then sample counts for the merged sample.
+  const size_t num_row = sample.num_row + other.sample.num_row;
+  const size_t num_row_sampled
+    = sample.num_row_sampled + other.sample.num_row_sampled;
+  auto scale = [num_row, num_row_sampled](const SampleInfo& info) {
+    if (info.num_row_sampled == 0) {
+      return 0.0;  // no row was counted, so all counts are zero
+    }
+    return static_cast<double>(info.num_row) / info.num_row_sampled
+           * num_row_sampled / num_row;
+  };
+  const bool exact = (!sampled && !other_sampled);
+  const double scale_self = exact ? 1.0 : scale(sample);
+  const double scale_other = exact ? 1.0 : scale(other.sample);
+  for (size_t tree_id = 0; tree_id < counts.size(); ++tree_id) {
+    std::vector<size_t>& dest = counts[tree_id];
+    const std::vector<size_t>& src = other.counts[tree_id];
+    for (size_t nid = 0; nid < dest.size(); ++nid) {
+      if (exact) {
+        dest[nid] += src[nid];
+      } else {
+        dest[nid] = static_cast<size_t>(std::llround(
+          dest[nid] * scale_self + src[nid] * scale_other));
+      }
+    }
+  }
+
+  // combine sampling information
+  if (!sampled && other_sampled) {
+    sample.confidence = other.sample.confidence;
+    sample.tolerance = other.sample.tolerance;
+  }
+  // a larger sample can only narrow the margin; keep the conservative bound
+  sample.margin = std::max(sample.margin, other.sample.margin);
+  sample.num_row = num_row;
+  sample.num_row_sampled = num_row_sampled;
+}
+
+void
+BranchAnnotator::Set(std::vector<std::vector<size_t>> counts,
+                     uint64_t fingerprint) {
+  this->counts = std::move(counts);
+  this->sample = SampleInfo();
+  if (!this->counts.empty() && !this->counts[0].empty()) {
+    this->sample.num_row = this->sample.num_row_sampled = this->counts[0][0];
+  }
+  this->fingerprint = fingerprint;
+}
+
+uint64_t
+BranchAnnotator::ComputeFingerprint(const Model& model) {
+  // 64-bit FNV-1a hash
+  uint64_t hash = 14695981039346656037ULL;
+  auto update = [&hash](uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+      hash ^= (value >> (i * 8)) & 0xFF;
+      hash *= 1099511628211ULL;
+    }
+  };
+  update(model.trees.size());
+  for (const Tree& tree : model.trees) {
+    update(tree.num_nodes);
+    for (int nid = 0; nid < tree.num_nodes; ++nid) {
+      const Tree::ConstNode node = tree[nid];
+      if (node.is_leaf()) {
+        update(static_cast<uint64_t>(-1));
+      } else {
+        const tl_float threshold = node.threshold();
+        uint32_t threshold_bits;
+        std::memcpy(&threshold_bits, &threshold, sizeof(threshold_bits));
+        update(node.cleft());
+        update(node.cright());
+        update(node.split_index());
+        update(node.default_left());
+        update(static_cast<uint64_t>(node.comparison_op()));
+        update(threshold_bits);
+      }
+    }
+  }
+  return (hash == 0) ? 1 : hash;  // reserve 0 for unknown fingerprint
 }
 
 void
 BranchAnnotator::Load(dmlc::Stream* fi) {
+  // read whole stream, so that the format can be detected
+  std::string buf;
+  {
+    const size_t chunk_size = 16 * 1024 * 1024;  // 16 MB
+    size_t size = 0;
+    size_t nread;
+    do {
+      buf.resize(size + chunk_size);
+      nread = fi->Read(&buf[size], chunk_size);
+      size += nread;
+    } while (nread == chunk_size);
+    buf.resize(size);
+  }
+  if (buf.size() >= sizeof(kBinaryMagic)
+      && std::memcmp(buf.data(), kBinaryMagic, sizeof(kBinaryMagic)) == 0) {
+    LoadBinary(buf.data(), buf.size());
+  } else {
+    dmlc::MemoryStringStream fs(&buf);
+    LoadJSON(&fs);
+  }
+}
+
+void
+BranchAnnotator::Load(const char* filename) {
+  if (common::MemoryMappedFile::IsLocalFile(filename)) {
+    common::MemoryMappedFile mapping(filename);
+    if (mapping.size() >= sizeof(kBinaryMagic)
+        && std::memcmp(mapping.data(), kBinaryMagic,
+                       sizeof(kBinaryMagic)) == 0) {
+      LoadBinary(mapping.data(), mapping.size());
+    } else {
+      dmlc::MemoryFixedSizeStream fs(const_cast<char*>(mapping.data()),
+                                     mapping.size());
+      LoadJSON(&fs);
+    }
+  } else {
+    std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(filename, "r"));
+    Load(fi.get());
+  }
+}
+
+void
+BranchAnnotator::Save(dmlc::Stream* fo, AnnotationFormat format) const {
+  switch (format) {
+   case AnnotationFormat::kJSON:
+    SaveJSON(fo); break;
+   case AnnotationFormat::kBinary:
+    SaveBinary(fo); break;
+   default:
+    LOG(FATAL) << "Unknown annotation format";
+  }
+}
+
+void
+BranchAnnotator::LoadJSON(dmlc::Stream* fi) {
   dmlc::istream is(fi);
   auto reader = common::make_unique<dmlc::JSONReader>(&is);
-  reader->Read(&counts);
+  sample = SampleInfo();
+  fingerprint = 0;
+  is >> std::ws;
+  if (is.peek() == '{') {  // counts with fingerprint and sampling info
+    dmlc::JSONObjectReadHelper helper;
+    helper.DeclareField("counts", &counts);
+    helper.DeclareField("num_row", &sample.num_row);
+    helper.DeclareField("num_row_sampled", &sample.num_row_sampled);
+    helper.DeclareField("confidence", &sample.confidence);
+    helper.DeclareField("tolerance", &sample.tolerance);
+    helper.DeclareField("margin", &sample.margin);
+    helper.DeclareOptionalField("fingerprint", &fingerprint);
+    helper.ReadAllFields(reader.get());
+  } else {  // plain nested array of counts, written by older versions
+    reader->Read(&counts);
+    if (!counts.empty() && !counts[0].empty()) {
+      sample.num_row = sample.num_row_sampled = counts[0][0];
+    }
+  }
 }
 
 void
-BranchAnnotator::Save(dmlc::Stream* fo) const {
+BranchAnnotator::SaveJSON(dmlc::Stream* fo) const {
   dmlc::ostream os(fo);
   auto writer = common::make_unique<dmlc::JSONWriter>(&os);
-  writer->Write(counts);
+  // always record the fingerprint, so that partial annotations can be
+  // checked against each other before being merged
+  writer->BeginObject();
+  writer->WriteObjectKeyValue("num_row", sample.num_row);
+  writer->WriteObjectKeyValue("num_row_sampled", sample.num_row_sampled);
+  writer->WriteObjectKeyValue("confidence", sample.confidence);
+  writer->WriteObjectKeyValue("tolerance", sample.tolerance);
+  writer->WriteObjectKeyValue("margin", sample.margin);
+  writer->WriteObjectKeyValue("fingerprint", fingerprint);
+  writer->WriteObjectKeyValue("counts", counts);
+  writer->EndObject();
+}
+
+void
+BranchAnnotator::LoadBinary(const char* buf, size_t size) {
+  BinaryHeader header;
+  CHECK_GE(size, sizeof(header))
+    << "Ill-formed annotation file: truncated header";
+  std::memcpy(&header, buf, sizeof(header));
+  CHECK_EQ(std::memcmp(header.magic, kBinaryMagic, sizeof(kBinaryMagic)), 0)
+    << "Ill-formed annotation file: bad magic number";
+  CHECK_LE(header.version, kBinaryVersion)
+    << "Annotation file has version " << header.version
+    << "; this version of treelite supports up to " << kBinaryVersion;
+  const size_t table_size = header.num_tree * sizeof(BinaryTreeEntry);
+  CHECK_LE(header.num_tree, (size - sizeof(header)) / sizeof(BinaryTreeEntry))
+    << "Ill-formed annotation file: truncated tree table";
+  CHECK_EQ(size - sizeof(header) - table_size, header.payload_size)
+    << "Ill-formed annotation file: payload size mismatch";
+  const char* table = buf + sizeof(header);
+  const uint8_t* payload
+    = reinterpret_cast<const uint8_t*>(table + table_size);
+
+  sample.num_row = header.num_row;
+  sample.num_row_sampled = header.num_row_sampled;
+  sample.confidence = header.confidence;
+  sample.tolerance = header.tolerance;
+  sample.margin = header.margin;
+  fingerprint = header.fingerprint;
+  counts.clear();
+  counts.resize(header.num_tree);
+  for (uint64_t tree_id = 0; tree_id < header.num_tree; ++tree_id) {
+    BinaryTreeEntry entry;
+    std::memcpy(&entry, table + tree_id * sizeof(entry), sizeof(entry));
+    CHECK_LE(entry.offset, header.payload_size)
+      << "Ill-formed annotation file: tree offset out of bound";
+    CHECK_LE(entry.num_nodes, header.payload_size - entry.offset)
+      << "Ill-formed annotation file: node count out of bound";
+    const uint8_t* p = payload + entry.offset;
+    const uint8_t* end = payload + header.payload_size;
+    std::vector<size_t>& tree_counts = counts[tree_id];
+    tree_counts.resize(entry.num_nodes);
+    for (uint64_t nid = 0; nid < entry.num_nodes; ++nid) {
+      p = DecodeVarint(p, end, &tree_counts[nid]);
+    }
+  }
+}
+
+void
+BranchAnnotator::SaveBinary(dmlc::Stream* fo) const {
+  std::vector<BinaryTreeEntry> table(counts.size());
+  std::vector<uint8_t> payload;
+  for (size_t tree_id = 0; tree_id < counts.size(); ++tree_id) {
+    table[tree_id].num_nodes = counts[tree_id].size();
+    table[tree_id].offset = payload.size();
+    for (size_t count : counts[tree_id]) {
+      EncodeVarint(count, &payload);
+    }
+  }
+  BinaryHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kBinaryMagic, sizeof(kBinaryMagic));
+  header.version = kBinaryVersion;
+  header.fingerprint = fingerprint;
+  header.num_tree = counts.size();
+  header.num_row = sample.num_row;
+  header.num_row_sampled = sample.num_row_sampled;
+  header.confidence = sample.confidence;
+  header.tolerance = sample.tolerance;
+  header.margin = sample.margin;
+  header.payload_size = payload.size();
+  fo->Write(&header, sizeof(header));
+  if (!table.empty()) {
+    fo->Write(&table[0], table.size() * sizeof(BinaryTreeEntry));
+  }
+  if (!payload.empty()) {
+    fo->Write(&payload[0], payload.size());
+  }
 }
 
 }  // namespace treelite
@@ -38,6 +38,30 @@ const std::unordered_map<std::string, Operator> optable{
   {">=", Operator::kGE}
 };
 
+/*!
+ * \brief count NaN entries and entries equal to [missing_value] in a dense
+ *        row. The loop has no branches, so that the compiler turns the
+ *        comparisons into SIMD compares.
+ */
+inline void CountMissing(const float* row, size_t num_col,
+                         float missing_value,
+                         uint32_t* out_num_nan, uint32_t* out_num_missing) {
+  uint32_t num_nan = 0;
+  uint32_t num_missing = 0;
+  for (size_t j = 0; j < num_col; ++j) {
+    num_nan += (row[j] != row[j]);
+    num_missing += (row[j] == missing_value);  // never true for NaN
+  }
+  *out_num_nan = num_nan;
+  *out_num_missing = num_missing;
+}
+
+/*! \brief whether an entry of a dense matrix holds a valid value */
+inline bool IsValidEntry(float value, float missing_value) {
+  // NaN compares unequal to everything, so this works for NaN missing_value
+  return (value == value) & (value != missing_value);
+}
+
 }  // namespace anonymous
 
 int TreeliteDMatrixCreateFromFile(const char* path,
@@ -51,6 +75,27 @@ int TreeliteDMatrixCreateFromFile(const char* path,
   API_END();
 }
 
+int TreeliteDMatrixCreateFromBuffer(const char* buf,
+                                    size_t len,
+                                    const char* format,
+                                    int nthread,
+                                    int verbose,
+                                    DMatrixHandle* out) {
+  API_BEGIN();
+  *out = static_cast<DMatrixHandle>(DMatrix::CreateFromBuffer(buf, len,
+                                    format, nthread, verbose));
+  API_END();
+}
+
+int TreeliteDMatrixSave(DMatrixHandle handle,
+                        const char* path) {
+  API_BEGIN();
+  const DMatrix* dmat = static_cast<DMatrix*>(handle);
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(path, "w"));
+  dmat->Save(fo.get());
+  API_END();
+}
+
 int TreeliteDMatrixCreateFromCSR(const float* data,
                                  const unsigned* col_ind,
                                  const size_t* row_ptr,
@@ -89,6 +134,48 @@ int TreeliteDMatrixCreateFromCSR(const float* data,
   API_END();
 }
 
+int TreeliteDMatrixCreateFromCSRView(const float* data,
+                                     const unsigned* col_ind,
+                                     const size_t* row_ptr,
+                                     size_t num_row,
+                                     size_t num_col,
+                                     DMatrixHandle* out) {
+  static_assert(sizeof(unsigned) == sizeof(uint32_t),
+                "col_ind must be a uint32_t array to be used without copying");
+  API_BEGIN();
+  CHECK_EQ(row_ptr[0], 0) << "row_ptr[0] must be 0";
+  CHECK_LT(num_col, std::numeric_limits<uint32_t>::max())
+    << "num_col argument is too big";
+  const size_t nelem = row_ptr[num_row];
+  // the arrays are used without copying, so check that every row range and
+  // feature index is within bounds; this reads each element once
+  bool valid_row_ptr = true;
+  bool valid_col_ind = true;
+  #pragma omp parallel for schedule(static) reduction(&&:valid_row_ptr)
+  for (size_t i = 0; i < num_row; ++i) {
+    valid_row_ptr = valid_row_ptr && (row_ptr[i] <= row_ptr[i + 1]);
+  }
+  CHECK(valid_row_ptr) << "row_ptr must be non-decreasing";
+  #pragma omp parallel for schedule(static) reduction(&&:valid_col_ind)
+  for (size_t i = 0; i < nelem; ++i) {
+    valid_col_ind = valid_col_ind && (col_ind[i] < num_col);
+  }
+  CHECK(valid_col_ind) << "col_ind must be less than num_col";
+  std::unique_ptr<DMatrix> dmat(new DMatrix());
+  dmat->Clear();
+  // the caller owns the arrays, so no holder is needed
+  dmat->data.SetExternal(data, nelem, nullptr);
+  dmat->col_ind.SetExternal(reinterpret_cast<const uint32_t*>(col_ind),
+                            nelem, nullptr);
+  dmat->row_ptr.SetExternal(row_ptr, num_row + 1, nullptr);
+  dmat->num_row = num_row;
+  dmat->num_col = num_col;
+  dmat->nelem = nelem;  // NaN entries are kept and skipped at use
+
+  *out = static_cast<DMatrixHandle>(dmat.release());
+  API_END();
+}
+
 int TreeliteDMatrixCreateFromMat(const float* data,
                                  size_t num_row,
                                  size_t num_col,
@@ -98,41 +185,74 @@ int TreeliteDMatrixCreateFromMat(const float* data,
   API_BEGIN();
   CHECK_LT(num_col, std::numeric_limits<uint32_t>::max())
     << "num_col argument is too big";
-  DMatrix* dmat = new DMatrix();
-  dmat->Clear();
-  auto& data_ = dmat->data;
-  auto& col_ind_ = dmat->col_ind;
-  auto& row_ptr_ = dmat->row_ptr;
-  // make an educated guess for initial sizes,
-  // so as to present initial wave of allocation
-  const size_t guess_size
-    = std::min(std::min(num_row * num_col, num_row * 1000),
-               static_cast<size_t>(64 * 1024 * 1024));
-  data_.reserve(guess_size);
-  col_ind_.reserve(guess_size);
-  row_ptr_.reserve(num_row + 1);
-  const float* row = &data[0];  // points to beginning of each row
-  for (size_t i = 0; i < num_row; ++i, row += num_col) {
-    for (size_t j = 0; j < num_col; ++j) {
-      if (common::CheckNAN(row[j])) {
-        CHECK(nan_missing)
-          << "The missing_value argument must be set to NaN if there is any "
-          << "NaN in the matrix.";
-      } else if (nan_missing || row[j] != missing_value) {
-        // row[j] is a valid entry
-        data_.push_back(row[j]);
-        col_ind_.push_back(static_cast<uint32_t>(j));
+  // Pass 1: count valid entries of every row in parallel
+  std::vector<size_t> row_ptr(num_row + 1, 0);
+  size_t num_nan = 0;
+  #pragma omp parallel for schedule(static) reduction(+:num_nan)
+  for (size_t i = 0; i < num_row; ++i) {
+    uint32_t row_num_nan, row_num_missing;
+    CountMissing(&data[i * num_col], num_col, missing_value,
+                 &row_num_nan, &row_num_missing);
+    row_ptr[i + 1] = num_col - row_num_nan - row_num_missing;
+    num_nan += row_num_nan;
+  }
+  CHECK(nan_missing || num_nan == 0)
+    << "The missing_value argument must be set to NaN if there is any "
+    << "NaN in the matrix.";
+  for (size_t i = 0; i < num_row; ++i) {
+    row_ptr[i + 1] += row_ptr[i];
+  }
+  const size_t num_valid = row_ptr[num_row];
+
+  // Pass 2: fill rows in parallel. Choose the layout that uses less memory:
+  // dense layout takes 4 bytes per entry, CSR 8 bytes per valid entry
+  std::unique_ptr<DMatrix> dmat(new DMatrix());
+  if (num_valid * 2 >= num_row * num_col) {
+    dmat->InitDense(num_row, num_col);
+    float* data_ = dmat->data.data();
+    const float missing = DMatrix::MissingValue();
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < num_row; ++i) {
+      const float* row = &data[i * num_col];
+      float* out_row = &data_[i * num_col];
+      for (size_t j = 0; j < num_col; ++j) {
+        out_row[j] = IsValidEntry(row[j], missing_value) ? row[j] : missing;
       }
     }
-    row_ptr_.push_back(data_.size());
+  } else {
+    dmat->Clear();
+    dmat->data.resize(num_valid);
+    dmat->col_ind.resize(num_valid);
+    float* data_ = dmat->data.data();
+    uint32_t* col_ind_ = dmat->col_ind.data();
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < num_row; ++i) {
+      const float* row = &data[i * num_col];
+      size_t k = row_ptr[i];
+      for (size_t j = 0; j < num_col; ++j) {
+        if (IsValidEntry(row[j], missing_value)) {
+          data_[k] = row[j];
+          col_ind_[k] = static_cast<uint32_t>(j);
+          ++k;
+        }
+      }
+    }
+    dmat->row_ptr = std::move(row_ptr);
+    dmat->num_row = num_row;
+    dmat->num_col = num_col;
+    dmat->nelem = num_valid;  // missing values have been skipped
   }
-  data_.shrink_to_fit();
-  col_ind_.shrink_to_fit();
-  dmat->num_row = num_row;
-  dmat->num_col = num_col;
-  dmat->nelem = data_.size();  // some nonzeros may have been deleted as NaN
 
-  *out = static_cast<DMatrixHandle>(dmat);
+  *out = static_cast<DMatrixHandle>(dmat.release());
+  API_END();
+}
+
+int TreeliteDMatrixCompress(DMatrixHandle handle,
+                            int allow_float16,
+                            int verbose) {
+  API_BEGIN();
+  DMatrix* dmat = static_cast<DMatrix*>(handle);
+  dmat->Compress(allow_float16 != 0, verbose);
   API_END();
 }
 
@@ -154,6 +274,118 @@ int TreeliteDMatrixFree(DMatrixHandle handle) {
   API_END();
 }
 
+int TreeliteDMatrixBuilderCreate(size_t num_col,
+                                 int dense,
+                                 DMatrixBuilderHandle* out) {
+  API_BEGIN();
+  *out = static_cast<DMatrixBuilderHandle>(new DMatrixBuilder(num_col,
+           dense ? DMatrixLayout::kDense : DMatrixLayout::kCSR));
+  API_END();
+}
+
+int TreeliteDMatrixBuilderClear(DMatrixBuilderHandle handle) {
+  API_BEGIN();
+  static_cast<DMatrixBuilder*>(handle)->Clear();
+  API_END();
+}
+
+int TreeliteDMatrixBuilderAddSparseRow(DMatrixBuilderHandle handle,
+                                       const unsigned* col_ind,
+                                       const float* data,
+                                       size_t num_entry) {
+  static_assert(sizeof(unsigned) == sizeof(uint32_t),
+                "unsigned must be 32 bits wide");
+  API_BEGIN();
+  static_cast<DMatrixBuilder*>(handle)->AddSparseRow(
+    reinterpret_cast<const uint32_t*>(col_ind), data, num_entry);
+  API_END();
+}
+
+int TreeliteDMatrixBuilderAddDenseRows(DMatrixBuilderHandle handle,
+                                       const float* data,
+                                       size_t num_row,
+                                       float missing_value) {
+  API_BEGIN();
+  static_cast<DMatrixBuilder*>(handle)->AddDenseRows(data, num_row,
+                                                     missing_value);
+  API_END();
+}
+
+int TreeliteDMatrixBuilderGetDMatrix(DMatrixBuilderHandle handle,
+                                     DMatrixHandle* out) {
+  API_BEGIN();
+  const DMatrixBuilder* builder = static_cast<DMatrixBuilder*>(handle);
+  *out = static_cast<DMatrixHandle>(const_cast<DMatrix*>(builder->Get()));
+  API_END();
+}
+
+int TreeliteDMatrixBuilderFree(DMatrixBuilderHandle handle) {
+  API_BEGIN();
+  delete static_cast<DMatrixBuilder*>(handle);
+  API_END();
+}
+
+int TreelitePagedDMatrixCreateFromFile(const char* path,
+                                       const char* format,
+                                       const char* cache_file,
+                                       size_t page_size,
+                                       size_t max_cached_page,
+                                       int verbose,
+                                       PagedDMatrixHandle* out) {
+  API_BEGIN();
+  *out = static_cast<PagedDMatrixHandle>(PagedDMatrix::Create(path, format,
+                                         cache_file, page_size,
+                                         max_cached_page, verbose));
+  API_END();
+}
+
+int TreelitePagedDMatrixGetDimension(PagedDMatrixHandle handle,
+                                     size_t* out_num_row,
+                                     size_t* out_num_col,
+                                     size_t* out_nelem) {
+  API_BEGIN();
+  const PagedDMatrix* dmat = static_cast<PagedDMatrix*>(handle);
+  *out_num_row = dmat->num_row();
+  *out_num_col = dmat->num_col();
+  *out_nelem = dmat->nelem();
+  API_END();
+}
+
+int TreelitePagedDMatrixFree(PagedDMatrixHandle handle) {
+  API_BEGIN();
+  delete static_cast<PagedDMatrix*>(handle);
+  API_END();
+}
+
+int TreeliteDMatrixViewCreateFromRows(DMatrixHandle handle,
+                                      const size_t* row_index,
+                                      size_t num_row,
+                                      DMatrixViewHandle* out) {
+  API_BEGIN();
+  const DMatrix* dmat = static_cast<DMatrix*>(handle);
+  std::vector<size_t> row_index_(row_index, row_index + num_row);
+  *out = static_cast<DMatrixViewHandle>(
+    new DMatrixView(dmat, std::move(row_index_)));
+  API_END();
+}
+
+int TreeliteDMatrixViewCreateFromRange(DMatrixHandle handle,
+                                       size_t row_begin,
+                                       size_t row_end,
+                                       DMatrixViewHandle* out) {
+  API_BEGIN();
+  const DMatrix* dmat = static_cast<DMatrix*>(handle);
+  *out = static_cast<DMatrixViewHandle>(
+    new DMatrixView(dmat, row_begin, row_end));
+  API_END();
+}
+
+int TreeliteDMatrixViewFree(DMatrixViewHandle handle) {
+  API_BEGIN();
+  delete static_cast<DMatrixView*>(handle);
+  API_END();
+}
+
 int TreeliteAnnotateBranch(ModelHandle model,
                            DMatrixHandle dmat,
                            int nthread,
@@ -168,12 +400,96 @@ int TreeliteAnnotateBranch(ModelHandle model,
   API_END();
 }
 
+int TreeliteAnnotateBranchPaged(ModelHandle model,
+                                PagedDMatrixHandle dmat,
+                                int nthread,
+                                int verbose,
+                                AnnotationHandle* out) {
+  API_BEGIN();
+  BranchAnnotator* annotator = new BranchAnnotator();
+  const Model* model_ = static_cast<Model*>(model);
+  PagedDMatrix* dmat_ = static_cast<PagedDMatrix*>(dmat);
+  annotator->Annotate(*model_, dmat_, nthread, verbose);
+  *out = static_cast<AnnotationHandle>(annotator);
+  API_END();
+}
+
+int TreeliteAnnotateBranchView(ModelHandle model,
+                               DMatrixViewHandle view,
+                               int nthread,
+                               int verbose,
+                               AnnotationHandle* out) {
+  API_BEGIN();
+  BranchAnnotator* annotator = new BranchAnnotator();
+  const Model* model_ = static_cast<Model*>(model);
+  const DMatrixView* view_ = static_cast<DMatrixView*>(view);
+  annotator->Annotate(*model_, view_, nthread, verbose);
+  *out = static_cast<AnnotationHandle>(annotator);
+  API_END();
+}
+
+int TreeliteAnnotateBranchSampled(ModelHandle model,
+                                  DMatrixHandle dmat,
+                                  int nthread,
+                                  int verbose,
+                                  double tolerance,
+                                  double confidence,
+                                  uint64_t seed,
+                                  AnnotationHandle* out) {
+  API_BEGIN();
+  BranchAnnotator* annotator = new BranchAnnotator();
+  const Model* model_ = static_cast<Model*>(model);
+  const DMatrix* dmat_ = static_cast<DMatrix*>(dmat);
+  annotator->AnnotateSampled(*model_, dmat_, nthread, verbose,
+                             tolerance, confidence, seed);
+  *out = static_cast<AnnotationHandle>(annotator);
+  API_END();
+}
+
+int TreeliteAnnotateBranchFromFile(ModelHandle model,
+                                   const char* path,
+                                   const char* format,
+                                   unsigned part_index,
+                                   unsigned num_parts,
+                                   int nthread,
+                                   int verbose,
+                                   AnnotationHandle* out) {
+  API_BEGIN();
+  CHECK_LT(part_index, num_parts) << "part_index must be less than num_parts";
+  std::unique_ptr<BranchAnnotator> annotator(new BranchAnnotator());
+  const Model* model_ = static_cast<Model*>(model);
+  const std::string format_str(format);
+  if (format_str == "binary" || format_str == "fast_csv"
+      || format_str == "fast_libsvm") {
+    // Binary DMatrix files are memory-mapped, so they need not be streamed.
+    // Fast text formats are not understood by dmlc parsers.
+    std::unique_ptr<DMatrix> dmat(DMatrix::Create(path, format, nthread,
+                                                  verbose, part_index,
+                                                  num_parts));
+    annotator->Annotate(*model_, dmat.get(), nthread, verbose);
+  } else {
+    std::unique_ptr<dmlc::Parser<uint32_t>> parser(
+      dmlc::Parser<uint32_t>::Create(path, part_index, num_parts, format));
+    annotator->Annotate(*model_, parser.get(), nthread, verbose);
+  }
+  *out = static_cast<AnnotationHandle>(annotator.release());
+  API_END();
+}
+
+int TreeliteAnnotationMerge(AnnotationHandle handle,
+                            AnnotationHandle other) {
+  API_BEGIN();
+  BranchAnnotator* annotator = static_cast<BranchAnnotator*>(handle);
+  const BranchAnnotator* other_ = static_cast<BranchAnnotator*>(other);
+  annotator->Merge(*other_);
+  API_END();
+}
+
 int TreeliteAnnotationLoad(const char* path,
                            AnnotationHandle* out) {
   API_BEGIN();
   BranchAnnotator* annotator = new BranchAnnotator();
-  std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(path, "r"));
-  annotator->Load(fi.get());
+  annotator->Load(path);
   *out = static_cast<AnnotationHandle>(annotator);
   API_END();
 }
@@ -187,6 +503,15 @@ int TreeliteAnnotationSave(AnnotationHandle handle,
   API_END();
 }
 
+int TreeliteAnnotationSaveBinary(AnnotationHandle handle,
+                                 const char* path) {
+  API_BEGIN();
+  const BranchAnnotator* annotator = static_cast<BranchAnnotator*>(handle);
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(path, "w"));
+  annotator->Save(fo.get(), AnnotationFormat::kBinary);
+  API_END();
+}
+
 int TreeliteAnnotationFree(AnnotationHandle handle) {
   API_BEGIN();
   delete static_cast<BranchAnnotator*>(handle);
@@ -350,6 +675,75 @@ int TreelitePredictorPredict(PredictorHandle handle,
   API_END();
 }
 
+int TreelitePredictorPredictPaged(PredictorHandle handle,
+                                  PagedDMatrixHandle dmat,
+                                  int nthread,
+                                  int verbose,
+                                  float* out_result) {
+  API_BEGIN();
+  const Predictor* predictor_ = static_cast<Predictor*>(handle);
+  PagedDMatrix* dmat_ = static_cast<PagedDMatrix*>(dmat);
+  predictor_->Predict(dmat_, nthread, verbose, out_result);
+  API_END();
+}
+
+int TreelitePredictorPredictView(PredictorHandle handle,
+                                 DMatrixViewHandle view,
+                                 int nthread,
+                                 int verbose,
+                                 float* out_result) {
+  API_BEGIN();
+  const Predictor* predictor_ = static_cast<Predictor*>(handle);
+  const DMatrixView* view_ = static_cast<DMatrixView*>(view);
+  predictor_->Predict(view_, nthread, verbose, out_result);
+  API_END();
+}
+
+int TreelitePredictorGetBranchAnnotation(PredictorHandle handle,
+                                         AnnotationHandle* out) {
+  API_BEGIN();
+  const Predictor* predictor_ = static_cast<Predictor*>(handle);
+  BranchAnnotator* annotator = new BranchAnnotator();
+  predictor_->GetBranchAnnotation(annotator);
+  *out = static_cast<AnnotationHandle>(annotator);
+  API_END();
+}
+
+int TreelitePredictorResetBranchAnnotation(PredictorHandle handle) {
+  API_BEGIN();
+  Predictor* predictor_ = static_cast<Predictor*>(handle);
+  predictor_->ResetBranchAnnotation();
+  API_END();
+}
+
+int TreelitePredictorEnableBranchProfiling(PredictorHandle handle,
+                                           ModelHandle model,
+                                           double sample_rate,
+                                           const char* export_path,
+                                           double export_interval,
+                                           const char* format) {
+  API_BEGIN();
+  Predictor* predictor_ = static_cast<Predictor*>(handle);
+  const Model* model_ = static_cast<Model*>(model);
+  const std::string format_(format);
+  AnnotationFormat annotation_format = AnnotationFormat::kJSON;
+  if (format_ == "binary") {
+    annotation_format = AnnotationFormat::kBinary;
+  } else {
+    CHECK_EQ(format_, "json") << "Unknown annotation format: " << format_;
+  }
+  predictor_->EnableBranchProfiling(*model_, sample_rate, export_path,
+                                    export_interval, annotation_format);
+  API_END();
+}
+
+int TreelitePredictorDisableBranchProfiling(PredictorHandle handle) {
+  API_BEGIN();
+  Predictor* predictor_ = static_cast<Predictor*>(handle);
+  predictor_->DisableBranchProfiling();
+  API_END();
+}
+
 int TreelitePredictorFree(PredictorHandle handle) {
   API_BEGIN();
   delete static_cast<Predictor*>(handle);
@@ -380,6 +774,27 @@ int TreeliteLoadProtobufModel(const char* filename,
   API_END();
 }
 
+int TreeliteLoadModel(const char* filename, ModelHandle* out) {
+  API_BEGIN();
+  Model* model = new Model(Model::Load(filename));
+  *out = static_cast<ModelHandle>(model);
+  API_END();
+}
+
+int TreeliteSaveModel(ModelHandle handle, const char* filename) {
+  API_BEGIN();
+  const Model* model_ = static_cast<Model*>(handle);
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(filename, "w"));
+  model_->Save(fo.get());
+  API_END();
+}
+
+int TreeliteFreeModel(ModelHandle handle) {
+  API_BEGIN();
+  delete static_cast<Model*>(handle);
+  API_END();
+}
+
 int TreeliteCreateModelBuilder(int num_features,
                                ModelBuilderHandle* out) {
   API_BEGIN();
@@ -9,6 +9,7 @@
 #include <treelite/annotator.h>
 #include <treelite/compiler.h>
 #include <treelite/semantic.h>
+#include <dmlc/common.h>
 #include <dmlc/config.h>
 #include <dmlc/data.h>
 #include <fstream>
@@ -24,18 +25,30 @@ namespace treelite {
 
 enum CLITask {
   kCodegen = 0,
-  kAnnotate = 1
+  kAnnotate = 1,
+  kMergeAnnotation = 2,
+  kConvertData = 3,
+  kConvertModel = 4
 };
 
 enum InputFormat {
   kLibSVM = 0,
   kCSV = 1,
   kLibFM = 2,
+  kBinaryDMatrix = 3,
+  kFastCSV = 4,
+  kFastLibSVM = 5
+};
+
+enum AnnotationFileFormat {
+  kAnnotateJSON = 0,
+  kAnnotateBinary = 1
 };
 
 enum ModelFormat {
   kXGBModel = 0,
-  kLGBModel = 1
+  kLGBModel = 1,
+  kNativeModel = 2
 };
 
 inline const char* FileFormatString(int format) {
@@ -43,6 +56,9 @@ inline const char* FileFormatString(int format) {
     case kLibSVM: return "libsvm";
     case kCSV: return "csv";
     case kLibFM: return "libfm";
+    case kBinaryDMatrix: return "binary";
+    case kFastCSV: return "fast_csv";
+    case kFastLibSVM: return "fast_libsvm";
   }
   return "";
 }
@@ -56,14 +72,33 @@ struct CLIParam : public dmlc::Parameter<CLIParam> {
   int format;
   /*! \brief model file */
   std::string model_in;
+  /*! \brief output path of model in native binary format */
+  std::string model_out;
   /*! \brief generated code file */
   std::string name_codegen;
   /*! \brief name of generated annotation file */
   std::string name_annotate;
+  /*! \brief format of generated annotation file */
+  int annotate_format;
   /*! \brief the path of training set -- used for annotation */
   std::string train_path;
   /*! \brief training set file format */
   int train_format;
+  /*! \brief if >0, annotate with a random sample of the training set, growing
+             it until branch frequencies are known within this tolerance */
+  float annotate_tolerance;
+  /*! \brief confidence level for sampled annotation */
+  float annotate_confidence;
+  /*! \brief random seed for sampled annotation */
+  int seed;
+  /*! \brief index of the part of the training set to annotate with */
+  int part_index;
+  /*! \brief number of parts the training set is split into */
+  int num_parts;
+  /*! \brief comma-separated list of partial annotation files to merge */
+  std::string annotate_merge;
+  /*! \brief output path of binary data matrix */
+  std::string data_out;
   // number of threads to use if OpenMP is enabled
   // if equals 0, use system default
   int nthread;
@@ -75,24 +110,58 @@ struct CLIParam : public dmlc::Parameter<CLIParam> {
     DMLC_DECLARE_FIELD(task).set_default(kCodegen)
         .add_enum("train", kCodegen)
         .add_enum("annotate", kAnnotate)
+        .add_enum("merge_annotate", kMergeAnnotation)
+        .add_enum("convert_data", kConvertData)
+        .add_enum("convert_model", kConvertModel)
         .describe("Task to be performed by the CLI program.");
     DMLC_DECLARE_FIELD(verbose).set_default(0)
         .describe("Produce extra messages if >0");
     DMLC_DECLARE_FIELD(format)
         .add_enum("xgboost", kXGBModel)
         .add_enum("lightgbm", kLGBModel)
+        .add_enum("treelite", kNativeModel)
         .describe("Model format");
     DMLC_DECLARE_FIELD(model_in).describe("Input model path");
+    DMLC_DECLARE_FIELD(model_out).set_default("NULL")
+        .describe("Output path of model in native binary format; used for "
+                  "convert_model");
     DMLC_DECLARE_FIELD(name_codegen).set_default("dump.c")
         .describe("generated code file");
     DMLC_DECLARE_FIELD(name_annotate).set_default("annotate.json")
         .describe("Name of generated annotation file");
+    DMLC_DECLARE_FIELD(annotate_format).set_default(kAnnotateJSON)
+        .add_enum("json", kAnnotateJSON)
+        .add_enum("binary", kAnnotateBinary)
+        .describe("Format of generated annotation file");
     DMLC_DECLARE_FIELD(train_path).set_default("NULL")
         .describe("Training data path; used for annotation");
     DMLC_DECLARE_FIELD(train_format).set_default(kLibSVM)
         .add_enum("libsvm", kLibSVM)
         .add_enum("csv", kCSV)
-        .add_enum("libfm", kLibFM);
+        .add_enum("libfm", kLibFM)
+        .add_enum("binary", kBinaryDMatrix)
+        .add_enum("fast_csv", kFastCSV)
+        .add_enum("fast_libsvm", kFastLibSVM);
+    DMLC_DECLARE_FIELD(annotate_tolerance).set_default(0.0f)
+        .set_range(0.0f, 0.5f)
+        .describe("If >0, annotate with a random sample of the training set, "
+                  "growing it until branch frequencies are known within this "
+                  "tolerance; must be less than 0.5");
+    DMLC_DECLARE_FIELD(annotate_confidence).set_default(0.95f)
+        .set_range(0.0f, 1.0f)
+        .describe("Confidence level for sampled annotation; must be "
+                  "strictly between 0 and 1");
+    DMLC_DECLARE_FIELD(seed).set_default(0)
+        .describe("Random seed for sampled annotation");
+    DMLC_DECLARE_FIELD(part_index).set_default(0).set_lower_bound(0)
+        .describe("Index of the part of the training set to annotate with");
+    DMLC_DECLARE_FIELD(num_parts).set_default(1).set_lower_bound(1)
+        .describe("Number of parts the training set is split into; each part "
+                  "can be annotated independently and merged afterwards");
+    DMLC_DECLARE_FIELD(annotate_merge).set_default("")
+        .describe("Comma-separated list of partial annotation files to merge");
+    DMLC_DECLARE_FIELD(data_out).set_default("NULL")
+        .describe("Output path of binary data matrix; used for convert_data");
     DMLC_DECLARE_FIELD(nthread).set_default(0).describe(
         "Number of threads to use.");
 
@@ -115,6 +184,8 @@ Model ParseModel(const CLIParam& param) {
     return frontend::LoadXGBoostModel(param.model_in.c_str());
    case kLGBModel:
     return frontend::LoadLightGBMModel(param.model_in.c_str());
+   case kNativeModel:
+    return Model::Load(param.model_in.c_str());
    default:
     LOG(FATAL) << "Unknown model format";
     return {};  // avoid compiler warning
@@ -199,15 +270,104 @@ void CLIAnnotate(const CLIParam& param) {
 
   CHECK_NE(param.train_path, "NULL")
     << "Need to specify train_path paramter for annotation task";
+  CHECK_LT(param.part_index, param.num_parts)
+    << "part_index must be less than num_parts";
+  // the parameter ranges are inclusive, but sampling needs open intervals;
+  // check here, before any data is read
+  if (param.annotate_tolerance > 0.0f) {
+    CHECK_LT(param.annotate_tolerance, 0.5f)
+      << "annotate_tolerance must be in range [0, 0.5)";
+    CHECK(param.annotate_confidence > 0.0f
+          && param.annotate_confidence < 1.0f)
+      << "annotate_confidence must be in range (0, 1)";
+  }
+  BranchAnnotator annotator;
+  if (param.annotate_tolerance > 0.0f
+      || param.train_format == kBinaryDMatrix
+      || param.train_format == kFastCSV
+      || param.train_format == kFastLibSVM) {
+    // sampling needs random access to rows; load all data into memory.
+    // Binary DMatrix files are memory-mapped, so they need not be streamed.
+    // Fast text formats are not understood by dmlc parsers.
+    std::unique_ptr<DMatrix> dmat(DMatrix::Create(param.train_path.c_str(),
+                                           FileFormatString(param.train_format),
+                                           param.nthread, param.verbose,
+                                           param.part_index, param.num_parts));
+    if (param.annotate_tolerance > 0.0f) {
+      annotator.AnnotateSampled(model, dmat.get(), param.nthread,
+                                param.verbose, param.annotate_tolerance,
+                                param.annotate_confidence, param.seed);
+    } else {
+      annotator.Annotate(model, dmat.get(), param.nthread, param.verbose);
+    }
+  } else {
+    // stream data from the parser, so that memory usage stays bounded
+    std::unique_ptr<dmlc::Parser<uint32_t>> parser(
+      dmlc::Parser<uint32_t>::Create(param.train_path.c_str(),
+                                     param.part_index, param.num_parts,
+                                     FileFormatString(param.train_format)));
+    annotator.Annotate(model, parser.get(), param.nthread, param.verbose);
+  }
+  // write to annotation file
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(
+                                   param.name_annotate.c_str(), "w"));
+  annotator.Save(fo.get(), (param.annotate_format == kAnnotateBinary)
+                           ? AnnotationFormat::kBinary
+                           : AnnotationFormat::kJSON);
+}
+
+void CLIMergeAnnotation(const CLIParam& param) {
+  const std::vector<std::string> paths
+    = dmlc::Split(param.annotate_merge, ',');
+  CHECK(!paths.empty())
+    << "Need to specify annotate_merge parameter for merge_annotate task";
+  BranchAnnotator annotator;
+  annotator.Load(paths[0].c_str());
+  CHECK_NE(annotator.GetFingerprint(), 0)
+    << "Annotation file " << paths[0] << " has no model fingerprint; "
+    << "annotate again with this version of treelite";
+  for (size_t i = 1; i < paths.size(); ++i) {
+    BranchAnnotator partial;
+    partial.Load(paths[i].c_str());
+    CHECK_NE(partial.GetFingerprint(), 0)
+      << "Annotation file " << paths[i] << " has no model fingerprint; "
+      << "annotate again with this version of treelite";
+    annotator.Merge(partial);
+  }
+  if (param.verbose > 0) {
+    LOG(INFO) << "Merged " << paths.size() << " annotation files";
+  }
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(
+                                   param.name_annotate.c_str(), "w"));
+  annotator.Save(fo.get(), (param.annotate_format == kAnnotateBinary)
+                           ? AnnotationFormat::kBinary
+                           : AnnotationFormat::kJSON);
+}
+
+void CLIConvertData(const CLIParam& param) {
+  CHECK_NE(param.train_path, "NULL")
+    << "Need to specify train_path paramter for convert_data task";
+  CHECK_NE(param.data_out, "NULL")
+    << "Need to specify data_out paramter for convert_data task";
   std::unique_ptr<DMatrix> dmat(DMatrix::Create(param.train_path.c_str(),
                                          FileFormatString(param.train_format),
                                          param.nthread, param.verbose));
-  BranchAnnotator annotator;
-  annotator.Annotate(model, dmat.get(), param.nthread, param.verbose);
-  // write to json file
   std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(
-                                   param.name_annotate.c_str(), "w"));
-  annotator.Save(fo.get());
+                                   param.data_out.c_str(), "w"));
+  dmat->Save(fo.get());
+  LOG(INFO) << "Saved " << dmat->num_row << " rows to binary data matrix `"
+            << param.data_out << "'";
+}
+
+void CLIConvertModel(const CLIParam& param) {
+  CHECK_NE(param.model_out, "NULL")
+    << "Need to specify model_out paramter for convert_model task";
+  Model model = ParseModel(param);
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(
+                                   param.model_out.c_str(), "w"));
+  model.Save(fo.get());
+  LOG(INFO) << "Saved " << model.trees.size() << " trees to model file `"
+            << param.model_out << "'";
 }
 
 int CLIRunTask(int argc, char* argv[]) {
@@ -238,6 +398,9 @@ int CLIRunTask(int argc, char* argv[]) {
   switch (param.task) {
     case kCodegen: CLICodegen(param); break;
     case kAnnotate: CLIAnnotate(param); break;
+    case kMergeAnnotation: CLIMergeAnnotation(param); break;
+    case kConvertData: CLIConvertData(param); break;
+    case kConvertModel: CLIConvertModel(param); break;
   }
 
   return 0;
@@ -0,0 +1,99 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file mmap.cc
+ * \author Philip Cho
+ * \brief Read-only memory mapping of local files
+ */
+
+#include <dmlc/logging.h>
+#include "./mmap.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace treelite {
+namespace common {
+
+bool
+MemoryMappedFile::IsLocalFile(const std::string& uri) {
+  const size_t pos = uri.find("://");
+  return (pos == std::string::npos || uri.compare(0, pos, "file") == 0);
+}
+
+#ifdef _WIN32
+MemoryMappedFile::MemoryMappedFile(const std::string& filename)
+  : addr_(nullptr), size_(0),
+    file_handle_(INVALID_HANDLE_VALUE), mapping_handle_(nullptr) {
+  const std::string path = (filename.compare(0, 7, "file://") == 0)
+                           ? filename.substr(7) : filename;
+  file_handle_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             nullptr);
+  CHECK(file_handle_ != INVALID_HANDLE_VALUE)
+    << "Failed to open file `" << path << "'";
+  LARGE_INTEGER file_size;
+  CHECK(GetFileSizeEx(file_handle_, &file_size))
+    << "Failed to obtain size of file `" << path << "'";
+  size_ = static_cast<size_t>(file_size.QuadPart);
+  if (size_ > 0) {
+    mapping_handle_ = CreateFileMappingA(file_handle_, nullptr, PAGE_READONLY,
+                                         0, 0, nullptr);
+    CHECK(mapping_handle_ != nullptr)
+      << "Failed to map file `" << path << "' into memory";
+    addr_ = MapViewOfFile(mapping_handle_, FILE_MAP_READ, 0, 0, 0);
+    CHECK(addr_ != nullptr)
+      << "Failed to map file `" << path << "' into memory";
+  }
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+  if (addr_ != nullptr) {
+    UnmapViewOfFile(addr_);
+  }
+  if (mapping_handle_ != nullptr) {
+    CloseHandle(mapping_handle_);
+  }
+  if (file_handle_ != INVALID_HANDLE_VALUE) {
+    CloseHandle(file_handle_);
+  }
+}
+#else
+MemoryMappedFile::MemoryMappedFile(const std::string& filename)
+  : addr_(nullptr), size_(0) {
+  const std::string path = (filename.compare(0, 7, "file://") == 0)
+                           ? filename.substr(7) : filename;
+  const int fd = open(path.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1) << "Failed to open file `" << path << "'";
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    LOG(FATAL) << "Failed to obtain size of file `" << path << "'";
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ > 0) {  // mmap() does not accept zero length
+    addr_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr_ == MAP_FAILED) {
+      addr_ = nullptr;
+      close(fd);
+      LOG(FATAL) << "Failed to map file `" << path << "' into memory";
+    }
+  }
+  close(fd);  // mapping remains valid after closing the descriptor
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+  if (addr_ != nullptr) {
+    munmap(addr_, size_);
+  }
+}
+#endif
+
+}  // namespace common
+}  // namespace treelite
@@ -0,0 +1,60 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file mmap.h
+ * \author Philip Cho
+ * \brief Read-only memory mapping of local files
+ */
+#ifndef TREELITE_COMMON_MMAP_H_
+#define TREELITE_COMMON_MMAP_H_
+
+#include <string>
+#include <cstddef>
+
+namespace treelite {
+namespace common {
+
+/*!
+ * \brief read-only memory mapping of a whole local file. The mapping stays
+ *        valid for the lifetime of the object.
+ */
+class MemoryMappedFile {
+ public:
+  /*!
+   * \brief map a file into memory
+   * \param filename name of local file
+   */
+  explicit MemoryMappedFile(const std::string& filename);
+  ~MemoryMappedFile();
+  MemoryMappedFile(const MemoryMappedFile&) = delete;
+  MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+  /*! \brief pointer to beginning of mapped content */
+  inline const char* data() const {
+    return static_cast<const char*>(addr_);
+  }
+  /*! \brief size of mapped content, in bytes */
+  inline size_t size() const {
+    return size_;
+  }
+  /*!
+   * \brief check whether a URI refers to a local file that can be mapped.
+   *        Remote URIs (e.g. s3://, hdfs://) need to be read through
+   *        dmlc::Stream instead.
+   * \param uri URI to check
+   * \return whether URI refers to local file
+   */
+  static bool IsLocalFile(const std::string& uri);
+
+ private:
+  void* addr_;
+  size_t size_;
+#ifdef _WIN32
+  void* file_handle_;
+  void* mapping_handle_;
+#endif
+};
+
+}  // namespace common
+}  // namespace treelite
+
+#endif  // TREELITE_COMMON_MMAP_H_
@@ -0,0 +1,55 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file omp_exception.h
+ * \author Philip Cho
+ * \brief Carry exceptions out of OpenMP parallel regions
+ */
+#ifndef TREELITE_COMMON_OMP_EXCEPTION_H_
+#define TREELITE_COMMON_OMP_EXCEPTION_H_
+
+#include <exception>
+#include <mutex>
+
+namespace treelite {
+namespace common {
+
+/*!
+ * \brief capture an exception thrown inside an OpenMP parallel region.
+ *        An exception may not leave the thread that threw it, so each
+ *        iteration runs its body through Run() and the first exception is
+ *        thrown again by Rethrow() once the region has finished.
+ */
+class OMPException {
+ public:
+  OMPException() : exception_(nullptr) {}
+  /*!
+   * \brief run a function, capturing any exception it throws
+   * \param f function to run
+   */
+  template <typename Function>
+  inline void Run(Function f) {
+    try {
+      f();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!exception_) {
+        exception_ = std::current_exception();
+      }
+    }
+  }
+  /*! \brief throw the captured exception, if any */
+  inline void Rethrow() {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+
+ private:
+  std::exception_ptr exception_;
+  std::mutex mutex_;
+};
+
+}  // namespace common
+}  // namespace treelite
+
+#endif  // TREELITE_COMMON_OMP_EXCEPTION_H_
@@ -0,0 +1,288 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file text_parser.cc
+ * \author Philip Cho
+ * \brief Fast parallel parser for CSV and LIBSVM text held in memory
+ */
+
+#include <dmlc/logging.h>
+#include <omp.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include "./text_parser.h"
+#include "./omp_exception.h"
+
+namespace {
+
+using treelite::common::ParsedPart;
+
+/* powers of 10 that are exactly representable as double */
+const double kPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+/* largest mantissa that is exactly representable as double */
+const uint64_t kMaxExactMantissa = (static_cast<uint64_t>(1) << 53) - 1;
+/* maximum number of significant digits to accumulate */
+const int kMaxDigit = 19;
+
+inline bool IsBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool IsDigit(char c) {
+  return static_cast<unsigned>(c - '0') < 10u;
+}
+
+/*! \brief locate a character; return [end] if it does not occur */
+inline const char* Find(const char* begin, const char* end, char c) {
+  const void* pos = std::memchr(begin, c, end - begin);
+  return (pos == nullptr) ? end : static_cast<const char*>(pos);
+}
+
+/*! \brief parse a token with strtof(), which needs a NUL-terminated copy */
+inline float ParseFloatSlow(const char* begin, const char* end) {
+  const std::string token(begin, end);
+  char* endptr;
+  const float value = std::strtof(token.c_str(), &endptr);
+  CHECK(endptr != token.c_str()) << "Invalid number `" << token << "'";
+  return value;
+}
+
+/*!
+ * \brief parse a decimal floating-point number occupying [begin, end).
+ *        Numbers whose digits fit in 53 bits and whose decimal exponent is
+ *        small are converted with exactly one rounding of a double, which is
+ *        then rounded to float; all other numbers (including nan and inf)
+ *        are handed to strtof(). The result is identical to strtof().
+ */
+inline float ParseFloat(const char* begin, const char* end) {
+  const char* p = begin;
+  bool negative = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    ++p;
+  }
+  uint64_t mantissa = 0;
+  int num_digit = 0;  // number of significant digits in mantissa
+  int exponent = 0;
+  bool truncated = false;
+  const char* digit_begin = p;
+  for (; p != end && IsDigit(*p); ++p) {
+    if (num_digit < kMaxDigit) {
+      mantissa = mantissa * 10 + (*p - '0');
+      num_digit += (mantissa != 0);
+    } else {
+      ++exponent;
+      truncated = true;
+    }
+  }
+  size_t num_char = p - digit_begin;
+  if (p != end && *p == '.') {
+    ++p;
+    digit_begin = p;
+    for (; p != end && IsDigit(*p); ++p) {
+      if (num_digit < kMaxDigit) {
+        mantissa = mantissa * 10 + (*p - '0');
+        num_digit += (mantissa != 0);
+        --exponent;
+      } else {
+        truncated = true;
+      }
+    }
+    num_char += p - digit_begin;
+  }
+  if (num_char > 0 && p != end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool negative_exp = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+      negative_exp = (*p == '-');
+      ++p;
+    }
+    if (p == end || !IsDigit(*p)) {
+      return ParseFloatSlow(begin, end);
+    }
+    int exp_value = 0;
+    for (; p != end && IsDigit(*p); ++p) {
+      if (exp_value < 100000) {  // saturate; result is 0 or inf anyway
+        exp_value = exp_value * 10 + (*p - '0');
+      }
+    }
+    exponent += negative_exp ? -exp_value : exp_value;
+  }
+  if (num_char == 0 || p != end || truncated || mantissa > kMaxExactMantissa
+      || exponent < -22 || exponent > 22) {
+    return ParseFloatSlow(begin, end);
+  }
+  // Both mantissa and 10^|exponent| are exact, so a single multiplication
+  // or division gives the correctly rounded double
+  double value = static_cast<double>(mantissa);
+  value = (exponent < 0) ? value / kPow10[-exponent]
+                         : value * kPow10[exponent];
+  // Rounding the double to float again gives the correctly rounded float,
+  // unless the double lies exactly halfway between two floats
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  if ((bits & 0x1FFFFFFFULL) == 0x10000000ULL) {
+    return ParseFloatSlow(begin, end);
+  }
+  const float result = static_cast<float>(value);
+  return negative ? -result : result;
+}
+
+/*! \brief parse a feature index occupying [begin, end) */
+inline uint32_t ParseIndex(const char* begin, const char* end) {
+  CHECK(begin != end) << "Empty feature index";
+  uint64_t index = 0;
+  for (const char* p = begin; p != end; ++p) {
+    CHECK(IsDigit(*p) && index <= std::numeric_limits<uint32_t>::max())
+      << "Invalid feature index `" << std::string(begin, end) << "'";
+    index = index * 10 + (*p - '0');
+  }
+  CHECK_LE(index, std::numeric_limits<uint32_t>::max())
+    << "Feature index `" << std::string(begin, end) << "' is too large";
+  return static_cast<uint32_t>(index);
+}
+
+inline void ParseCSVLine(const char* begin, const char* end,
+                         ParsedPart* out) {
+  uint32_t col = 0;
+  const char* p = begin;
+  while (true) {
+    const char* field_end = Find(p, end, ',');
+    const char* q = field_end;
+    while (p != q && IsBlank(*p)) {
+      ++p;
+    }
+    while (q != p && IsBlank(q[-1])) {
+      --q;
+    }
+    if (p != q) {  // empty fields are missing
+      out->data.push_back(ParseFloat(p, q));
+      out->col_ind.push_back(col);
+    }
+    if (field_end == end) {
+      break;
+    }
+    p = field_end + 1;
+    ++col;
+  }
+  out->max_col_ind = std::max(out->max_col_ind, static_cast<size_t>(col));
+  out->row_ptr.push_back(out->data.size());
+}
+
+inline void ParseLibSVMLine(const char* begin, const char* end,
+                            ParsedPart* out) {
+  const char* p = begin;
+  // skip label
+  while (p != end && !IsBlank(*p)) {
+    ++p;
+  }
+  while (true) {
+    while (p != end && IsBlank(*p)) {
+      ++p;
+    }
+    if (p == end) {
+      break;
+    }
+    const char* token_end = p;
+    while (token_end != end && !IsBlank(*token_end)) {
+      ++token_end;
+    }
+    const char* colon = Find(p, token_end, ':');
+    if (colon - p != 3 || std::memcmp(p, "qid", 3) != 0) {
+      const uint32_t index = ParseIndex(p, colon);
+      // a feature index without value has value 1
+      out->data.push_back((colon == token_end) ? 1.0f
+                          : ParseFloat(colon + 1, token_end));
+      out->col_ind.push_back(index);
+      out->max_col_ind = std::max(out->max_col_ind,
+                                  static_cast<size_t>(index));
+    }
+    p = token_end;
+  }
+  out->row_ptr.push_back(out->data.size());
+}
+
+inline void ParsePart(const char* begin, const char* end,
+                      treelite::common::TextFormat format, ParsedPart* out) {
+  out->data.clear();
+  out->col_ind.clear();
+  out->row_ptr.assign(1, 0);
+  out->max_col_ind = 0;
+  const char* p = begin;
+  while (p < end) {
+    const char* line_end = Find(p, end, '\n');
+    const char* next = (line_end == end) ? end : line_end + 1;
+    if (format == treelite::common::TextFormat::kLibSVM) {
+      line_end = Find(p, line_end, '#');  // strip comment
+    }
+    while (p != line_end && IsBlank(*p)) {
+      ++p;
+    }
+    while (line_end != p && IsBlank(line_end[-1])) {
+      --line_end;
+    }
+    if (p != line_end) {  // skip blank lines
+      if (format == treelite::common::TextFormat::kCSV) {
+        ParseCSVLine(p, line_end, out);
+      } else {
+        ParseLibSVMLine(p, line_end, out);
+      }
+    }
+    p = next;
+  }
+}
+
+/*! \brief locate the first beginning of a line at or after [pos] */
+inline const char* LineBegin(const char* begin, const char* end,
+                             const char* pos) {
+  if (pos == begin || pos == end || pos[-1] == '\n') {
+    return pos;
+  }
+  const char* line_end = Find(pos, end, '\n');
+  return (line_end == end) ? end : line_end + 1;
+}
+
+}  // namespace anonymous
+
+namespace treelite {
+namespace common {
+
+void
+SplitText(const char* begin, const char* end,
+          size_t part_index, size_t num_parts,
+          const char** out_begin, const char** out_end) {
+  CHECK_LT(part_index, num_parts) << "part_index must be less than num_parts";
+  const size_t size = end - begin;
+  const size_t step = (size + num_parts - 1) / num_parts;
+  *out_begin = LineBegin(begin, end,
+                         begin + std::min(size, step * part_index));
+  *out_end = LineBegin(begin, end,
+                       begin + std::min(size, step * (part_index + 1)));
+}
+
+void
+ParseText(const char* begin, const char* end, TextFormat format,
+          int nthread, std::vector<ParsedPart>* out) {
+  nthread = std::max(nthread, 1);
+  out->clear();
+  out->resize(nthread);
+  OMPException omp_exc;
+  #pragma omp parallel for schedule(static, 1) num_threads(nthread)
+  for (int i = 0; i < nthread; ++i) {
+    omp_exc.Run([&] {
+      const char* part_begin;
+      const char* part_end;
+      SplitText(begin, end, i, nthread, &part_begin, &part_end);
+      ParsePart(part_begin, part_end, format, &(*out)[i]);
+    });
+  }
+  omp_exc.Rethrow();
+}
+
+}  // namespace common
+}  // namespace treelite
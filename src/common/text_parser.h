@@ -0,0 +1,72 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file text_parser.h
+ * \author Philip Cho
+ * \brief Fast parallel parser for CSV and LIBSVM text held in memory
+ */
+#ifndef TREELITE_COMMON_TEXT_PARSER_H_
+#define TREELITE_COMMON_TEXT_PARSER_H_
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace treelite {
+namespace common {
+
+/*! \brief text formats understood by ParseText() */
+enum class TextFormat : int {
+  /*!
+   * \brief comma-separated values; every column is a feature and empty
+   *        fields are missing
+   */
+  kCSV = 0,
+  /*!
+   * \brief LIBSVM format: a label followed by index:value pairs. The label
+   *        and qid:<id> tokens are ignored and '#' starts a comment.
+   */
+  kLibSVM = 1
+};
+
+/*! \brief rows parsed by a single thread, in CSR layout */
+struct ParsedPart {
+  std::vector<float> data;
+  std::vector<uint32_t> col_ind;
+  std::vector<size_t> row_ptr;
+  size_t max_col_ind;
+};
+
+/*!
+ * \brief split a text buffer into [num_parts] parts of roughly equal size
+ *        and locate part [part_index]. Every part boundary is moved forward
+ *        to the nearest beginning of a line, so that each line belongs to
+ *        exactly one part. Splitting a part further yields exactly the lines
+ *        of that part.
+ * \param begin beginning of buffer
+ * \param end end of buffer
+ * \param part_index index of the part to locate
+ * \param num_parts number of parts
+ * \param out_begin used to save beginning of the part
+ * \param out_end used to save end of the part
+ */
+void SplitText(const char* begin, const char* end,
+               size_t part_index, size_t num_parts,
+               const char** out_begin, const char** out_end);
+
+/*!
+ * \brief parse a text buffer. The buffer is split into [nthread] parts
+ *        with SplitText(), each of which is parsed by its own thread.
+ *        Blank lines are skipped.
+ * \param begin beginning of buffer
+ * \param end end of buffer
+ * \param format format of text
+ * \param nthread number of threads to use
+ * \param out used to save rows of each part, in order
+ */
+void ParseText(const char* begin, const char* end, TextFormat format,
+               int nthread, std::vector<ParsedPart>* out);
+
+}  // namespace common
+}  // namespace treelite
+
+#endif  // TREELITE_COMMON_TEXT_PARSER_H_
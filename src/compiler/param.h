@@ -24,6 +24,10 @@ struct CompilerParam : public dmlc::Parameter<CompilerParam> {
   int parallel_comp;
   /*! \brief if >0, produce extra messages */
   int verbose;
+  /*! \brief whether to instrument generated code with per-node counters,
+             so that branch annotation can be collected while predicting
+             (0: no, >0: yes) */
+  int instrument;
 
   // declare parameters
   DMLC_DECLARE_PARAMETER(CompilerParam) {
@@ -37,6 +41,10 @@ struct CompilerParam : public dmlc::Parameter<CompilerParam> {
                 "into [parallel_comp] files.");
     DMLC_DECLARE_FIELD(verbose).set_default(0)
       .describe("if >0, produce extra messages");
+    DMLC_DECLARE_FIELD(instrument).set_lower_bound(0).set_default(0)
+      .describe("whether to instrument generated code with per-node "
+                "counters, so that branch annotation can be collected "
+                "while predicting (0: no, >0: yes)");
   }
 };
 
@@ -23,12 +23,12 @@ class SplitCondition : public treelite::semantic::Condition {
   using NumericAdapter
     = std::function<std::string(treelite::Operator, unsigned,
                                 treelite::tl_float)>;
-  explicit SplitCondition(const treelite::Tree::Node& node,
+  explicit SplitCondition(const treelite::Tree::ConstNode& node,
                           const NumericAdapter& numeric_adapter)
    : split_index(node.split_index()), default_left(node.default_left()),
      op(node.comparison_op()), threshold(node.threshold()),
      numeric_adapter(numeric_adapter) {}
-  explicit SplitCondition(const treelite::Tree::Node& node,
+  explicit SplitCondition(const treelite::Tree::ConstNode& node,
                           NumericAdapter&& numeric_adapter)
    : split_index(node.split_index()), default_left(node.default_left()),
      op(node.comparison_op()), threshold(node.threshold()),
@@ -98,10 +98,17 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
     bool annotate = false;
     if (param.annotate_in != "NULL") {
       BranchAnnotator annotator;
-      std::unique_ptr<dmlc::Stream> fi(
-        dmlc::Stream::Create(param.annotate_in.c_str(), "r"));
-      annotator.Load(fi.get());
+      annotator.Load(param.annotate_in.c_str());
       annotation = annotator.Get();
+      CHECK_EQ(annotation.size(), model.trees.size())
+        << "Branch annotation file `" << param.annotate_in
+        << "' does not match the model: number of trees differ";
+      if (annotator.GetFingerprint() != 0) {
+        CHECK_EQ(annotator.GetFingerprint(),
+                 BranchAnnotator::ComputeFingerprint(model))
+          << "Branch annotation file `" << param.annotate_in
+          << "' was produced for a different model";
+      }
       annotate = true;
       if (param.verbose > 0) {
         LOG(INFO) << "Using branch annotation file `"
@@ -109,6 +116,16 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
       }
     }
 
+    // offsets of per-tree node counters, when instrumentation is enabled
+    std::vector<size_t> count_row_ptr{0};
+    for (const Tree& tree : model.trees) {
+      count_row_ptr.push_back(count_row_ptr.back() + tree.num_nodes);
+    }
+    if (param.instrument > 0 && param.verbose > 0) {
+      LOG(INFO) << "Instrumenting generated code with "
+                << count_row_ptr.back() << " node counters";
+    }
+
     SemanticModel semantic_model;
     SequenceBlock sequence;
     if (param.parallel_comp > 0) {
@@ -132,16 +149,21 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
                   << "dump to a single source file. This may increase "
                   << "compilation time and memory usage.";
       }
-      sequence.Reserve(model.trees.size() + 3);
+      sequence.Reserve(model.trees.size() + 4);
       sequence.PushBack(PlainBlock("float sum = 0.0f;"));
+      if (param.instrument > 0) {
+        sequence.PushBack(PlainBlock("size_t* count = node_count_buffer();"));
+      }
       sequence.PushBack(PlainBlock(QuantizePolicy::Preprocessing()));
       for (size_t tree_id = 0; tree_id < model.trees.size(); ++tree_id) {
         const Tree& tree = model.trees[tree_id];
         if (!annotation.empty()) {
           sequence.PushBack(common::MoveUniquePtr(WalkTree(tree,
-                                                  annotation[tree_id])));
+                                                  annotation[tree_id],
+                                                  count_row_ptr[tree_id])));
         } else {
-          sequence.PushBack(common::MoveUniquePtr(WalkTree(tree, {})));
+          sequence.PushBack(common::MoveUniquePtr(WalkTree(tree, {},
+                                                  count_row_ptr[tree_id])));
         }
       }
       sequence.PushBack(PlainBlock("return sum;"));
@@ -149,6 +171,12 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
     FunctionBlock function("float predict_margin(union Entry* data)",
       std::move(sequence), &semantic_model.function_registry);
     auto file_preamble = QuantizePolicy::PreprocessingPreamble();
+    if (param.instrument > 0) {
+      auto instr_preamble = InstrumentPreamble(model, count_row_ptr,
+                                            &semantic_model.function_registry);
+      file_preamble.insert(file_preamble.end(), instr_preamble.begin(),
+                           instr_preamble.end());
+    }
     semantic_model.units.emplace_back(PlainBlock(file_preamble),
                                       std::move(function));
     if (param.parallel_comp > 0) {
@@ -159,15 +187,21 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
         const size_t tree_end = std::min((group_id + 1) * group_size,
                                          model.trees.size());
         SequenceBlock group_seq;
-        group_seq.Reserve(tree_end - tree_begin + 2);
+        group_seq.Reserve(tree_end - tree_begin + 3);
         group_seq.PushBack(PlainBlock("float sum = 0.0f;"));
+        if (param.instrument > 0) {
+          group_seq.PushBack(
+            PlainBlock("size_t* count = node_count_buffer();"));
+        }
         for (size_t tree_id = tree_begin; tree_id < tree_end; ++tree_id) {
           const Tree& tree = model.trees[tree_id];
           if (!annotation.empty()) {
             group_seq.PushBack(common::MoveUniquePtr(WalkTree(tree,
-                                                     annotation[tree_id])));
+                                                     annotation[tree_id],
+                                                     count_row_ptr[tree_id])));
           } else {
-            group_seq.PushBack(common::MoveUniquePtr(WalkTree(tree, {})));
+            group_seq.PushBack(common::MoveUniquePtr(WalkTree(tree, {},
+                                                     count_row_ptr[tree_id])));
           }
         }
         group_seq.PushBack(PlainBlock("return sum;"));
@@ -179,6 +213,9 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
       }
     }
     auto header = QuantizePolicy::CommonHeader();
+    if (param.instrument > 0) {
+      header.insert(header.begin(), {"#include <stddef.h>", ""});
+    }
     if (annotate) {
       header.emplace_back();
       header.emplace_back("#define LIKELY(x)     __builtin_expect(!!(x), 1)");
@@ -193,19 +230,30 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
   CompilerParam param;
 
   std::unique_ptr<CodeBlock> WalkTree(const Tree& tree,
-                                      const std::vector<size_t>& counts) const {
-    return WalkTree_(tree, counts, 0);
+                                      const std::vector<size_t>& counts,
+                                      size_t count_offset) const {
+    return WalkTree_(tree, counts, count_offset, 0);
   }
 
   std::unique_ptr<CodeBlock> WalkTree_(const Tree& tree,
                                        const std::vector<size_t>& counts,
+                                       size_t count_offset,
                                        int nid) const {
     using semantic::BranchHint;
-    const Tree::Node& node = tree[nid];
+    const Tree::ConstNode node = tree[nid];
+    // instrumented code counts every visit to every node, in the same
+    // layout as BranchAnnotator
+    const std::string count_line
+      = std::string("++count[") + std::to_string(count_offset + nid) + "];";
     if (node.is_leaf()) {
       const tl_float leaf_value = node.leaf_value();
-      return std::unique_ptr<CodeBlock>(new PlainBlock(
-        std::string("sum += ") + common::FloatToString(leaf_value) + ";"));
+      const std::string leaf_line
+        = std::string("sum += ") + common::FloatToString(leaf_value) + ";";
+      if (param.instrument > 0) {
+        return std::unique_ptr<CodeBlock>(new PlainBlock(
+          std::vector<std::string>{count_line, leaf_line}));
+      }
+      return std::unique_ptr<CodeBlock>(new PlainBlock(leaf_line));
     } else {
       BranchHint branch_hint = BranchHint::kNone;
       if (!counts.empty()) {
@@ -214,14 +262,114 @@ class RecursiveCompiler : public Compiler, private QuantizePolicy {
         branch_hint = (left_count > right_count) ? BranchHint::kLikely
                                                  : BranchHint::kUnlikely;
       }
-      return std::unique_ptr<CodeBlock>(new IfElseBlock(
+      std::unique_ptr<CodeBlock> if_else(new IfElseBlock(
         SplitCondition(node, QuantizePolicy::NumericAdapter()),
-        common::MoveUniquePtr(WalkTree_(tree, counts, node.cleft())),
-        common::MoveUniquePtr(WalkTree_(tree, counts, node.cright())),
+        common::MoveUniquePtr(WalkTree_(tree, counts, count_offset,
+                                        node.cleft())),
+        common::MoveUniquePtr(WalkTree_(tree, counts, count_offset,
+                                        node.cright())),
         branch_hint)
       );
+      if (param.instrument > 0) {
+        std::unique_ptr<SequenceBlock> seq(new SequenceBlock());
+        seq->Reserve(2);
+        seq->PushBack(PlainBlock(count_line));
+        seq->PushBack(common::MoveUniquePtr(if_else));
+        return std::unique_ptr<CodeBlock>(seq.release());
+      }
+      return if_else;
     }
   }
+
+  /*
+   * Runtime support for instrumented code. Each thread lazily allocates its
+   * own array of node counters on first use and pushes it onto a global
+   * lock-free list, so that prediction threads never contend on counters.
+   * Arrays of exited threads stay on the list, so their counts are kept.
+   * The exported functions read and reset the counters of all threads;
+   * counts are exact when no prediction is in progress.
+   */
+  std::vector<std::string>
+  InstrumentPreamble(const Model& model,
+                     const std::vector<size_t>& count_row_ptr,
+                     std::vector<std::string>* p_function_registry) const {
+    const std::string num_tree = std::to_string(model.trees.size());
+    const std::string num_node = std::to_string(count_row_ptr.back());
+    std::vector<std::string> ret{
+      "#include <stdlib.h>",
+      "",
+      "struct NodeCountBuffer {",
+      "  struct NodeCountBuffer* next;",
+      std::string("  size_t count[") + num_node + "];",
+      "};",
+      "",
+      "static struct NodeCountBuffer* node_count_list = NULL;",
+      "static __thread struct NodeCountBuffer* node_count_tloc = NULL;",
+      ""};
+    ret.emplace_back("static const size_t node_count_row_ptr[] = {");
+    {
+      std::ostringstream oss;
+      size_t length = 2;
+      oss << "  ";
+      for (size_t e : count_row_ptr) {
+        common::WrapText(&oss, &length, std::to_string(e), 80);
+      }
+      ret.push_back(oss.str());
+      ret.emplace_back("};");
+      ret.emplace_back();
+    }
+    std::vector<semantic::FunctionBlock> funcs;
+    funcs.emplace_back("size_t* node_count_buffer(void)", PlainBlock({
+      "if (node_count_tloc == NULL) {",
+      "  struct NodeCountBuffer* buf",
+      "    = (struct NodeCountBuffer*)calloc(1, sizeof(*buf));",
+      "  if (buf == NULL) {",
+      "    abort();",
+      "  }",
+      "  do {",
+      "    buf->next = node_count_list;",
+      "  } while (!__sync_bool_compare_and_swap(&node_count_list,",
+      "                                         buf->next, buf));",
+      "  node_count_tloc = buf;",
+      "}",
+      "return node_count_tloc->count;"}), p_function_registry);
+    funcs.emplace_back("size_t get_num_tree(void)",
+      PlainBlock(std::string("return ") + num_tree + ";"),
+      p_function_registry);
+    funcs.emplace_back("size_t get_num_node(size_t tree_id)",
+      PlainBlock("return node_count_row_ptr[tree_id + 1]"
+                 " - node_count_row_ptr[tree_id];"),
+      p_function_registry);
+    {
+      std::ostringstream oss;
+      oss << "return " << BranchAnnotator::ComputeFingerprint(model) << "ULL;";
+      funcs.emplace_back("unsigned long long get_model_fingerprint(void)",
+        PlainBlock(oss.str()), p_function_registry);
+    }
+    funcs.emplace_back("void dump_node_count(size_t* out)", PlainBlock({
+      "const struct NodeCountBuffer* buf;",
+      std::string("for (size_t i = 0; i < ") + num_node + "; ++i) {",
+      "  out[i] = 0;",
+      "}",
+      "for (buf = node_count_list; buf != NULL; buf = buf->next) {",
+      std::string("  for (size_t i = 0; i < ") + num_node + "; ++i) {",
+      "    out[i] += buf->count[i];",
+      "  }",
+      "}"}), p_function_registry);
+    funcs.emplace_back("void reset_node_count(void)", PlainBlock({
+      "struct NodeCountBuffer* buf;",
+      "for (buf = node_count_list; buf != NULL; buf = buf->next) {",
+      std::string("  for (size_t i = 0; i < ") + num_node + "; ++i) {",
+      "    buf->count[i] = 0;",
+      "  }",
+      "}"}), p_function_registry);
+    for (const auto& func : funcs) {
+      auto lines = func.Compile();
+      ret.insert(ret.end(), lines.begin(), lines.end());
+      ret.emplace_back();
+    }
+    return ret;
+  }
 };
 
 class MetadataStore {
@@ -407,7 +555,7 @@ ExtractCutPoints(const Model& model) {
     Q.push(0);
     while (!Q.empty()) {
       const int nid = Q.front();
-      const Tree::Node& node = tree[nid];
+      const Tree::ConstNode node = tree[nid];
       Q.pop();
       if (!node.is_leaf()) {
         const tl_float threshold = node.threshold();
@@ -6,17 +6,905 @@
  */
 
 #include <treelite/data.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <omp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "./common/mmap.h"
+#include "./common/omp_exception.h"
+#include "./common/text_parser.h"
+
+namespace {
+
+/* binary DMatrix format: magic number */
+const char kBinaryMagic[8] = {'T', 'L', 'D', 'M', 'A', 'T', 'X', '\0'};
+/* binary DMatrix format: current version */
+const uint32_t kBinaryVersion = 1;
+/* binary DMatrix format: alignment of array sections, in bytes */
+const uint64_t kSectionAlign = 64;
+
+/*!
+ * \brief header of binary DMatrix file. The header is followed by three
+ *        sections, each aligned to [kSectionAlign] bytes: row_ptr (uint64),
+ *        col_ind (uint32) and data (float). In dense layout, the row_ptr and
+ *        col_ind sections are empty. Offsets are relative to the beginning
+ *        of the file. All numbers are stored in native byte order, as the
+ *        sections are used in place; a file written on a host of different
+ *        byte order fails the version check.
+ */
+struct BinaryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;  // value of DMatrixLayout
+  uint64_t num_row;
+  uint64_t num_col;
+  uint64_t nelem;
+  uint64_t row_ptr_offset;
+  uint64_t col_ind_offset;
+  uint64_t data_offset;
+  uint64_t file_size;
+};
+static_assert(sizeof(BinaryHeader) == 72,
+              "BinaryHeader must be packed with no padding");
+
+inline uint64_t AlignSection(uint64_t offset) {
+  return (offset + kSectionAlign - 1) / kSectionAlign * kSectionAlign;
+}
+
+inline BinaryHeader MakeBinaryHeader(const treelite::DMatrix& dmat) {
+  BinaryHeader header;
+  std::memcpy(header.magic, kBinaryMagic, sizeof(kBinaryMagic));
+  header.version = kBinaryVersion;
+  header.layout = static_cast<uint32_t>(dmat.layout);
+  header.num_row = dmat.num_row;
+  header.num_col = dmat.num_col;
+  header.nelem = dmat.nelem;
+  header.row_ptr_offset = AlignSection(sizeof(BinaryHeader));
+  header.col_ind_offset
+    = AlignSection(header.row_ptr_offset
+                   + dmat.row_ptr.size() * sizeof(uint64_t));
+  header.data_offset = AlignSection(header.col_ind_offset
+                                    + dmat.col_ind.size() * sizeof(uint32_t));
+  header.file_size = header.data_offset + dmat.nelem * sizeof(float);
+  return header;
+}
+
+/*!
+ * \brief set up CSR arrays from a binary DMatrix file in memory
+ * \param buf beginning of file content; must be 8-byte aligned
+ * \param size size of file content, in bytes
+ * \param holder object keeping [buf] alive; if null, arrays are copied
+ * \param out data matrix to fill
+ */
+inline void LoadBinaryBuffer(const char* buf, size_t size,
+                             std::shared_ptr<const void> holder,
+                             treelite::DMatrix* out) {
+  BinaryHeader header;
+  CHECK(size >= sizeof(header)) << "Binary DMatrix file is truncated";
+  std::memcpy(&header, buf, sizeof(header));
+  CHECK(std::memcmp(header.magic, kBinaryMagic, sizeof(kBinaryMagic)) == 0)
+    << "Not a binary DMatrix file";
+  CHECK_EQ(header.version, kBinaryVersion)
+    << "Unsupported version of binary DMatrix format";
+  CHECK(header.layout == static_cast<uint32_t>(treelite::DMatrixLayout::kCSR)
+        || header.layout
+           == static_cast<uint32_t>(treelite::DMatrixLayout::kDense))
+    << "Binary DMatrix file is corrupted: unknown layout";
+  const bool dense
+    = (header.layout == static_cast<uint32_t>(treelite::DMatrixLayout::kDense));
+  // bound the array lengths first, so that section sizes cannot overflow
+  CHECK(header.nelem <= size / sizeof(float)
+        && (dense || header.num_row < size / sizeof(uint64_t)))
+    << "Binary DMatrix file is corrupted: invalid dimensions";
+  const uint64_t row_ptr_len = dense ? 0 : header.num_row + 1;
+  const uint64_t col_ind_len = dense ? 0 : header.nelem;
+  CHECK(header.row_ptr_offset % kSectionAlign == 0
+        && header.col_ind_offset % kSectionAlign == 0
+        && header.data_offset % kSectionAlign == 0)
+    << "Binary DMatrix file is corrupted: misaligned section";
+  CHECK_EQ(header.file_size, size) << "Binary DMatrix file is truncated";
+  // offsets come from the file; bound each one by the file size before
+  // comparing the room left after it with the length of its section
+  CHECK(header.row_ptr_offset >= sizeof(header)
+        && header.row_ptr_offset <= size
+        && row_ptr_len <= (size - header.row_ptr_offset) / sizeof(uint64_t)
+        && header.col_ind_offset >= header.row_ptr_offset
+                                    + row_ptr_len * sizeof(uint64_t)
+        && header.col_ind_offset <= size
+        && col_ind_len <= (size - header.col_ind_offset) / sizeof(uint32_t)
+        && header.data_offset >= header.col_ind_offset
+                                 + col_ind_len * sizeof(uint32_t)
+        && header.data_offset <= size
+        && size - header.data_offset == header.nelem * sizeof(float))
+    << "Binary DMatrix file is corrupted: inconsistent section offsets";
+
+  const uint64_t* row_ptr
+    = reinterpret_cast<const uint64_t*>(buf + header.row_ptr_offset);
+  const uint32_t* col_ind
+    = reinterpret_cast<const uint32_t*>(buf + header.col_ind_offset);
+  const float* data = reinterpret_cast<const float*>(buf + header.data_offset);
+  if (dense) {
+    CHECK(header.num_col == 0
+          ? header.nelem == 0
+          : (header.num_row <= header.nelem / header.num_col
+             && header.nelem == header.num_row * header.num_col))
+      << "Binary DMatrix file is corrupted: invalid number of entries";
+  } else {
+    CHECK(row_ptr[0] == 0 && row_ptr[header.num_row] == header.nelem)
+      << "Binary DMatrix file is corrupted: invalid row pointers";
+    // rows and feature indices are used to index feature vectors, so check
+    // them in a single read-only pass
+    const size_t num_row = static_cast<size_t>(header.num_row);
+    const size_t nelem = static_cast<size_t>(header.nelem);
+    const uint64_t num_col = header.num_col;
+    bool valid_row_ptr = true;
+    bool valid_col_ind = true;
+    #pragma omp parallel for schedule(static) reduction(&&:valid_row_ptr)
+    for (size_t i = 0; i < num_row; ++i) {
+      valid_row_ptr = valid_row_ptr && (row_ptr[i] <= row_ptr[i + 1]);
+    }
+    CHECK(valid_row_ptr)
+      << "Binary DMatrix file is corrupted: row pointers are not monotone";
+    #pragma omp parallel for schedule(static) reduction(&&:valid_col_ind)
+    for (size_t i = 0; i < nelem; ++i) {
+      valid_col_ind = valid_col_ind && (col_ind[i] < num_col);
+    }
+    CHECK(valid_col_ind)
+      << "Binary DMatrix file is corrupted: feature index out of range";
+  }
+
+  out->num_row = header.num_row;
+  out->num_col = header.num_col;
+  out->nelem = header.nelem;
+  out->layout = static_cast<treelite::DMatrixLayout>(header.layout);
+  if (holder && sizeof(size_t) == sizeof(uint64_t)) {
+    out->row_ptr.SetExternal(reinterpret_cast<const size_t*>(row_ptr),
+                             row_ptr_len, holder);
+    out->col_ind.SetExternal(col_ind, col_ind_len, holder);
+    out->data.SetExternal(data, header.nelem, holder);
+  } else {
+    out->row_ptr.assign(row_ptr, row_ptr + row_ptr_len);
+    out->col_ind.assign(col_ind, col_ind + col_ind_len);
+    out->data.assign(data, data + header.nelem);
+  }
+}
+
+using treelite::common::ParsedPart;
+
+/* text parsing: minimum number of bytes of text given to each thread */
+const size_t kMinTextBytesPerThread = 1024 * 1024;
+
+inline void ParsePart(dmlc::Parser<uint32_t>* parser, ParsedPart* out) {
+  out->data.clear();
+  out->col_ind.clear();
+  out->row_ptr.assign(1, 0);
+  out->max_col_ind = 0;
+  parser->BeforeFirst();
+  while (parser->Next()) {
+    const dmlc::RowBlock<uint32_t>& batch = parser->Value();
+    const size_t ibegin = batch.offset[0];
+    const size_t iend = batch.offset[batch.size];
+    const size_t top = out->data.size();
+    for (size_t i = ibegin; i < iend; ++i) {
+      const uint32_t index = batch.index[i];
+      out->data.push_back((batch.value == nullptr) ? 1.0f :
+                          static_cast<float>(batch.value[i]));
+      out->col_ind.push_back(index);
+      out->max_col_ind = std::max(out->max_col_ind,
+                                  static_cast<size_t>(index));
+    }
+    for (size_t i = 0; i < batch.size; ++i) {
+      out->row_ptr.push_back(top + batch.offset[i + 1] - ibegin);
+    }
+  }
+}
+
+/*!
+ * \brief copy rows parsed by several threads into a new DMatrix, in order.
+ *        A prefix sum over row and nonzero counts locates each part, so that
+ *        all parts are copied in parallel into exactly sized arrays.
+ * \param parts rows of each part; emptied as they are copied
+ * \param dense whether to build the DMatrix in dense layout
+ */
+inline treelite::DMatrix* AssembleParts(std::vector<ParsedPart>* parts,
+                                        bool dense) {
+  using treelite::DMatrix;
+  const int nparser = static_cast<int>(parts->size());
+  std::vector<size_t> row_offset(nparser + 1, 0);
+  std::vector<size_t> elem_offset(nparser + 1, 0);
+  size_t max_col_ind = 0;
+  for (int i = 0; i < nparser; ++i) {
+    const ParsedPart& part = (*parts)[i];
+    row_offset[i + 1] = row_offset[i] + part.row_ptr.size() - 1;
+    elem_offset[i + 1] = elem_offset[i] + part.data.size();
+    max_col_ind = std::max(max_col_ind, part.max_col_ind);
+  }
+  std::unique_ptr<DMatrix> dmat(new DMatrix());
+  dmat->Clear();
+  const size_t num_row = row_offset[nparser];
+  const size_t num_col = (elem_offset[nparser] > 0) ? max_col_ind + 1 : 0;
+  if (dense) {
+    dmat->InitDense(num_row, num_col);
+    #pragma omp parallel for schedule(static, 1) num_threads(nparser)
+    for (int i = 0; i < nparser; ++i) {
+      ParsedPart& part = (*parts)[i];
+      float* out = dmat->data.data() + row_offset[i] * num_col;
+      for (size_t rid = 0; rid + 1 < part.row_ptr.size(); ++rid) {
+        for (size_t j = part.row_ptr[rid]; j < part.row_ptr[rid + 1]; ++j) {
+          out[rid * num_col + part.col_ind[j]]
+            = DMatrix::CanonicalizeMissing(part.data[j]);
+        }
+      }
+      part = ParsedPart();  // release private buffers early
+    }
+  } else if (nparser == 1) {
+    dmat->data = std::move((*parts)[0].data);
+    dmat->col_ind = std::move((*parts)[0].col_ind);
+    dmat->row_ptr = std::move((*parts)[0].row_ptr);
+  } else {
+    dmat->data.resize(elem_offset[nparser]);
+    dmat->col_ind.resize(elem_offset[nparser]);
+    dmat->row_ptr.resize(num_row + 1);
+    #pragma omp parallel for schedule(static, 1) num_threads(nparser)
+    for (int i = 0; i < nparser; ++i) {
+      ParsedPart& part = (*parts)[i];
+      std::copy(part.data.begin(), part.data.end(),
+                dmat->data.data() + elem_offset[i]);
+      std::copy(part.col_ind.begin(), part.col_ind.end(),
+                dmat->col_ind.data() + elem_offset[i]);
+      size_t* row_ptr = dmat->row_ptr.data() + row_offset[i];
+      for (size_t rid = 1; rid < part.row_ptr.size(); ++rid) {
+        row_ptr[rid] = elem_offset[i] + part.row_ptr[rid];
+      }
+      part = ParsedPart();  // release private buffers early
+    }
+  }
+  if (!dense) {
+    dmat->num_row = num_row;
+    dmat->num_col = num_col;
+    dmat->nelem = elem_offset[nparser];
+  }
+  return dmat.release();
+}
+
+/*! \brief read the whole content of a (possibly remote) file */
+inline void ReadStream(const char* filename, std::string* out) {
+  std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(filename, "r"));
+  const size_t chunk_size = 16 * 1024 * 1024;  // 16 MB
+  size_t size = 0;
+  size_t nread;
+  do {
+    out->resize(size + chunk_size);
+    nread = fi->Read(&(*out)[size], chunk_size);
+    size += nread;
+  } while (nread == chunk_size);
+  out->resize(size);
+}
+
+/*!
+ * \brief parse text held in memory into a new DMatrix. Small texts are
+ *        parsed with fewer threads, as each thread is given at least
+ *        [kMinTextBytesPerThread] bytes.
+ */
+inline treelite::DMatrix* ParseTextToDMatrix(
+    const char* begin, const char* end,
+    treelite::common::TextFormat format, int nthread) {
+  const size_t max_thread
+    = std::max(static_cast<size_t>(1),
+               static_cast<size_t>(end - begin) / kMinTextBytesPerThread);
+  nthread = static_cast<int>(std::min(static_cast<size_t>(nthread),
+                                      max_thread));
+  std::vector<ParsedPart> parts;
+  treelite::common::ParseText(begin, end, format, nthread, &parts);
+  return AssembleParts(&parts, format == treelite::common::TextFormat::kCSV);
+}
+
+/* paged DMatrix: number of pages to read ahead of the current page */
+const size_t kReadAheadPage = 2;
+/* paged DMatrix: magic number of cache file */
+const char kCacheMagic[8] = {'T', 'L', 'P', 'A', 'G', 'E', 'S', '\0'};
+/* paged DMatrix: current version of cache file format */
+const uint32_t kCacheVersion = 1;
+
+/*! \brief location of a page within a cache file */
+struct PageLocation {
+  uint64_t offset;
+  uint64_t size;
+};
+
+/*!
+ * \brief header of paged DMatrix cache file, identifying the source the
+ *        pages were built from. The header is followed by [source_len] bytes
+ *        of source description (format and name of source file) and then by
+ *        the pages, the first of which starts at [page_offset].
+ */
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t source_len;
+  uint64_t source_size;   // size of source file in bytes; 0 if unknown
+  int64_t source_mtime;   // modification time of source file; 0 if unknown
+  uint64_t page_offset;
+};
+static_assert(sizeof(CacheHeader) == 40,
+              "CacheHeader must be packed with no padding");
+
+/*!
+ * \brief make a cache header describing a source file. Size and
+ *        modification time are only known for local files; remote sources
+ *        are identified by name and format alone.
+ * \param filename name of source file
+ * \param format format of source file
+ * \param source used to save source description
+ * \return header for cache file
+ */
+inline CacheHeader MakeCacheHeader(const char* filename, const char* format,
+                                   std::string* source) {
+  *source = std::string(format) + '\n' + filename;
+  CacheHeader header;
+  std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+  header.version = kCacheVersion;
+  header.source_len = static_cast<uint32_t>(source->size());
+  header.source_size = 0;
+  header.source_mtime = 0;
+  header.page_offset = AlignSection(sizeof(header) + source->size());
+  if (treelite::common::MemoryMappedFile::IsLocalFile(filename)) {
+    std::string path(filename);
+    if (path.compare(0, 7, "file://") == 0) {
+      path = path.substr(7);
+    }
+    path = path.substr(0, path.find_first_of("#?"));  // strip URI arguments
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      header.source_size = static_cast<uint64_t>(st.st_size);
+      header.source_mtime = static_cast<int64_t>(st.st_mtime);
+    }
+  }
+  return header;
+}
+
+/*!
+ * \brief read the header of a cache file
+ * \param fi stream positioned at the beginning of cache file
+ * \param header used to save header
+ * \param source used to save source description
+ * \return whether the file is a cache file of the current version
+ */
+inline bool ReadCacheHeader(dmlc::Stream* fi, CacheHeader* header,
+                            std::string* source) {
+  if (fi->Read(header, sizeof(*header)) != sizeof(*header)
+      || std::memcmp(header->magic, kCacheMagic, sizeof(kCacheMagic)) != 0
+      || header->version != kCacheVersion
+      || header->page_offset
+         != AlignSection(sizeof(*header) + header->source_len)) {
+    return false;
+  }
+  source->resize(header->source_len);
+  return header->source_len == 0
+         || fi->Read(&(*source)[0], header->source_len)
+            == header->source_len;
+}
+
+/*!
+ * \brief parse a file and write its rows to a cache file, in pages of
+ *        roughly [page_size] bytes, after a CacheHeader identifying the
+ *        file. Each page is a binary DMatrix (see DMatrix::Save()) starting
+ *        at an offset aligned to [kSectionAlign].
+ */
+inline void WritePages(const char* filename, const char* format,
+                       const std::string& cache_file, size_t page_size,
+                       int verbose) {
+  std::unique_ptr<dmlc::Parser<uint32_t>> parser(
+    dmlc::Parser<uint32_t>::Create(filename, 0, 1, format));
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(cache_file.c_str(),
+                                                        "w"));
+  const char padding[kSectionAlign] = {0};
+  std::string source;
+  const CacheHeader header = MakeCacheHeader(filename, format, &source);
+  fo->Write(&header, sizeof(header));
+  fo->Write(source.data(), source.size());
+  fo->Write(padding, header.page_offset - sizeof(header) - source.size());
+  treelite::DMatrix page;
+  page.Clear();
+  uint64_t offset = header.page_offset;
+  size_t num_page = 0;
+  size_t num_row = 0;
+  auto flush_page = [&]() {
+    page.num_row = page.row_ptr.size() - 1;
+    page.nelem = page.data.size();
+    page.Save(fo.get());
+    const uint64_t end = offset + MakeBinaryHeader(page).file_size;
+    offset = AlignSection(end);
+    fo->Write(padding, offset - end);
+    num_row += page.num_row;
+    ++num_page;
+    page.Clear();
+    if (verbose > 0) {
+      LOG(INFO) << num_row << " rows written to " << num_page << " pages";
+    }
+  };
+
+  parser->BeforeFirst();
+  while (parser->Next()) {
+    const dmlc::RowBlock<uint32_t>& batch = parser->Value();
+    for (size_t i = 0; i < batch.size; ++i) {
+      for (size_t j = batch.offset[i]; j < batch.offset[i + 1]; ++j) {
+        const uint32_t index = batch.index[j];
+        page.data.push_back((batch.value == nullptr) ? 1.0f :
+                            static_cast<float>(batch.value[j]));
+        page.col_ind.push_back(index);
+        page.num_col = std::max(page.num_col, static_cast<size_t>(index) + 1);
+      }
+      page.row_ptr.push_back(page.data.size());
+      // pages end at row boundaries
+      const size_t page_bytes
+        = page.data.size() * (sizeof(float) + sizeof(uint32_t))
+          + page.row_ptr.size() * sizeof(uint64_t);
+      if (page_bytes >= page_size) {
+        flush_page();
+      }
+    }
+  }
+  if (page.row_ptr.size() > 1 || num_page == 0) {
+    flush_page();
+  }
+}
+
+/*! \brief load a code of type T from a possibly unaligned position */
+template <typename T>
+inline T LoadCode(const uint8_t* ptr) {
+  T code;
+  std::memcpy(&code, ptr, sizeof(T));
+  return code;
+}
+
+/*! \brief store a code of type T at a possibly unaligned position */
+template <typename T>
+inline void StoreCode(uint8_t* ptr, T code) {
+  std::memcpy(ptr, &code, sizeof(T));
+}
+
+inline uint32_t FloatBits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+/*!
+ * \brief convert a float to IEEE half precision, rounding to nearest even.
+ *        Values too large for half precision become infinity.
+ */
+inline uint16_t FloatToHalf(float value) {
+  const uint32_t bits = FloatBits(value);
+  const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  const uint32_t abs_bits = bits & 0x7FFFFFFF;
+  if (abs_bits >= 0x7F800000) {  // infinity or NaN
+    return sign | ((abs_bits > 0x7F800000) ? 0x7E00 : 0x7C00);
+  }
+  if (abs_bits >= 0x477FF000) {  // rounds to a value beyond half range
+    return sign | 0x7C00;
+  }
+  if (abs_bits < 0x38800000) {  // subnormal in half precision, or zero
+    if (abs_bits < 0x33000000) {
+      return sign;  // rounds to zero
+    }
+    const uint32_t mantissa = (abs_bits & 0x007FFFFF) | 0x00800000;
+    const int shift = 126 - static_cast<int>(abs_bits >> 23);
+    const uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t midpoint = 1u << (shift - 1);
+    const uint32_t round
+      = (rest > midpoint || (rest == midpoint && (half & 1)));
+    return sign | static_cast<uint16_t>(half + round);
+  }
+  // normal: rebias exponent and round mantissa to 10 bits; a carry out of
+  // the mantissa correctly increments the exponent
+  const uint32_t rebiased = abs_bits - 0x38000000;
+  const uint32_t round = 0x00000FFF + ((rebiased >> 13) & 1);
+  return sign | static_cast<uint16_t>((rebiased + round) >> 13);
+}
+
+/*! \brief convert an IEEE half precision value to float, exactly */
+inline float HalfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1F;
+  uint32_t mantissa = half & 0x3FF;
+  uint32_t bits;
+  if (exponent == 0x1F) {  // infinity or NaN
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {  // normal
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {  // zero
+    bits = sign;
+  } else {  // subnormal: normalize
+    uint32_t e = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      --e;
+    }
+    bits = sign | (e << 23) | ((mantissa & 0x3FF) << 13);
+  }
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/* compressed CSR: maximum number of distinct values in a column dictionary */
+const size_t kMaxDictSize = 1 << 16;
+
+/*!
+ * \brief gather the feature values of a CSR matrix by column, as bit
+ *        patterns, with NaN values mapped to DMatrix::MissingValue() first.
+ *        Each thread counts the entries of its own block of rows per column,
+ *        and then scatters them to its share of every column, so every entry
+ *        is read twice in total.
+ * \param dmat data matrix in CSR layout
+ * \param nthread number of threads to use
+ * \param out_col_ptr used to store pointer to the values of each column
+ *                    within [out_col_value]; length of num_col + 1
+ * \param out_col_value used to store values, grouped by column
+ */
+inline void GatherColumns(const treelite::DMatrix& dmat, int nthread,
+                          std::vector<size_t>* out_col_ptr,
+                          std::vector<uint32_t>* out_col_value) {
+  const size_t num_row = dmat.num_row;
+  const size_t num_col = dmat.num_col;
+  std::vector<size_t>& col_ptr = *out_col_ptr;
+  std::vector<uint32_t>& col_value = *out_col_value;
+  col_ptr.assign(num_col + 1, 0);
+  col_value.resize(dmat.nelem);
+  // a count of every column per thread; use fewer threads for wide
+  // matrices, so that the counts take no more memory than the entries
+  nthread = static_cast<int>(std::max<size_t>(1, std::min<size_t>(
+    nthread, dmat.nelem / std::max<size_t>(num_col, 1))));
+  std::vector<size_t> offset(static_cast<size_t>(nthread) * num_col, 0);
+  #pragma omp parallel num_threads(nthread)
+  {
+    const size_t tid = static_cast<size_t>(omp_get_thread_num());
+    const size_t nthread_ = static_cast<size_t>(omp_get_num_threads());
+    const size_t rbegin = num_row * tid / nthread_;
+    const size_t rend = num_row * (tid + 1) / nthread_;
+    size_t* count = offset.data() + tid * num_col;
+    for (size_t i = dmat.row_ptr[rbegin]; i < dmat.row_ptr[rend]; ++i) {
+      ++count[dmat.col_ind[i]];
+    }
+    #pragma omp barrier
+    #pragma omp single
+    {
+      // turn the counts into the position of each thread's share
+      size_t pos = 0;
+      for (size_t col = 0; col < num_col; ++col) {
+        col_ptr[col] = pos;
+        for (size_t t = 0; t < nthread_; ++t) {
+          const size_t n = offset[t * num_col + col];
+          offset[t * num_col + col] = pos;
+          pos += n;
+        }
+      }
+      col_ptr[num_col] = pos;
+    }
+    for (size_t i = dmat.row_ptr[rbegin]; i < dmat.row_ptr[rend]; ++i) {
+      col_value[count[dmat.col_ind[i]]++]
+        = FloatBits(treelite::DMatrix::CanonicalizeMissing(dmat.data[i]));
+    }
+  }
+}
+
+}  // namespace anonymous
 
 namespace treelite {
 
+constexpr size_t CompressedCSR::kDecodeChunk;
+
+void
+CompressedCSR::DecodeColumns(size_t rid, size_t offset, size_t n,
+                             uint32_t* last_col, uint32_t* out_col_ind) const {
+  const size_t row_nelem = row_ptr[rid + 1] - row_ptr[rid];
+  const size_t width = (col_ptr[rid + 1] - col_ptr[rid]) / row_nelem;
+  const uint8_t* code = col_code.data() + col_ptr[rid] + offset * width;
+  uint32_t col = *last_col;
+  switch (width) {
+   case 1:
+    for (size_t k = 0; k < n; ++k) {
+      col += code[k];
+      out_col_ind[k] = col;
+    }
+    break;
+   case 2:
+    for (size_t k = 0; k < n; ++k) {
+      col += LoadCode<uint16_t>(&code[k * 2]);
+      out_col_ind[k] = col;
+    }
+    break;
+   case 4:
+    for (size_t k = 0; k < n; ++k) {
+      out_col_ind[k] = LoadCode<uint32_t>(&code[k * 4]);
+    }
+    break;
+   default:
+    LOG(FATAL) << "Compressed DMatrix is corrupted: invalid index width";
+  }
+  *last_col = col;
+}
+
+void
+CompressedCSR::DecodeValues(size_t n, const uint32_t* col_ind,
+                            size_t* value_pos, float* out_value) const {
+  const uint8_t* code = value_code.data() + *value_pos;
+  for (size_t k = 0; k < n; ++k) {
+    const uint32_t col = col_ind[k];
+    switch (value_coding[col]) {
+     case ValueCoding::kFloat32:
+      out_value[k] = LoadCode<float>(code);
+      code += 4;
+      break;
+     case ValueCoding::kFloat16:
+      out_value[k] = HalfToFloat(LoadCode<uint16_t>(code));
+      code += 2;
+      break;
+     case ValueCoding::kDictionary8:
+      out_value[k] = dict[dict_ptr[col] + *code];
+      code += 1;
+      break;
+     case ValueCoding::kDictionary16:
+      out_value[k] = dict[dict_ptr[col] + LoadCode<uint16_t>(code)];
+      code += 2;
+      break;
+    }
+  }
+  *value_pos = code - value_code.data();
+}
+
+size_t
+CompressedCSR::MemoryUsage() const {
+  return (row_ptr.size() + col_ptr.size() + value_ptr.size()
+          + dict_ptr.size()) * sizeof(size_t)
+         + value_coding.size() * sizeof(ValueCoding)
+         + col_code.size() + value_code.size() + dict.size() * sizeof(float);
+}
+
+/*!
+ * \brief pages of a paged DMatrix held in memory, with a background thread
+ *        reading pages ahead
+ */
+class PagedDMatrix::PageCache {
+ public:
+  PageCache(const std::string& cache_file,
+            const std::vector<PageLocation>& page_loc,
+            size_t num_col, size_t max_cached_page)
+    : page_loc_(page_loc), num_col_(num_col), capacity_(max_cached_page),
+      fi_(dmlc::SeekStream::CreateForRead(cache_file.c_str())),
+      stop_(false) {
+    loader_ = std::thread(&PageCache::Run, this);
+  }
+  ~PageCache() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    request_cv_.notify_all();
+    loader_.join();
+  }
+
+  std::shared_ptr<const DMatrix> Get(size_t page_id) {
+    CHECK_LT(page_id, page_loc_.size()) << "Page index out of range";
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      auto it = pages_.find(page_id);
+      if (it != pages_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.second);
+        return it->second.first;
+      }
+      if (loading_.count(page_id) == 0) {
+        break;
+      }
+      loaded_cv_.wait(lock);  // page is being read by another thread
+    }
+    loading_.insert(page_id);
+    lock.unlock();
+    std::shared_ptr<const DMatrix> page;
+    try {
+      page = Read(page_id);
+    } catch (...) {
+      lock.lock();
+      loading_.erase(page_id);
+      loaded_cv_.notify_all();
+      throw;
+    }
+    lock.lock();
+    loading_.erase(page_id);
+    lru_.push_front(page_id);
+    pages_[page_id] = std::make_pair(page, lru_.begin());
+    while (lru_.size() > capacity_) {
+      // evicted pages stay alive while held by consumers
+      pages_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    loaded_cv_.notify_all();
+    return page;
+  }
+
+  /*! \brief maximum number of pages held in memory */
+  inline size_t capacity() const {
+    return capacity_;
+  }
+
+  /*! \brief read pages in range [page_begin, page_end) in the background */
+  void ReadAhead(size_t page_begin, size_t page_end) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_.clear();  // earlier requests are stale
+      for (size_t page_id = page_begin; page_id < page_end; ++page_id) {
+        requests_.push_back(page_id);
+      }
+    }
+    request_cv_.notify_all();
+  }
+
+ private:
+  const std::vector<PageLocation> page_loc_;
+  const size_t num_col_;
+  const size_t capacity_;
+  std::mutex stream_mutex_;  // guards fi_
+  std::unique_ptr<dmlc::SeekStream> fi_;
+  std::mutex mutex_;  // guards all fields below
+  std::condition_variable loaded_cv_;
+  std::condition_variable request_cv_;
+  std::list<size_t> lru_;  // most recently used page first
+  std::unordered_map<size_t,
+                     std::pair<std::shared_ptr<const DMatrix>,
+                               std::list<size_t>::iterator>> pages_;
+  std::unordered_set<size_t> loading_;
+  std::deque<size_t> requests_;
+  bool stop_;
+  std::thread loader_;
+
+  std::shared_ptr<const DMatrix> Read(size_t page_id) {
+    const PageLocation& loc = page_loc_[page_id];
+    // page arrays will refer to the buffer, which lives as long as they do
+    std::shared_ptr<std::vector<uint64_t>> buf(
+      new std::vector<uint64_t>((loc.size + 7) / 8));
+    {
+      std::lock_guard<std::mutex> lock(stream_mutex_);
+      fi_->Seek(loc.offset);
+      CHECK_EQ(fi_->Read(buf->data(), loc.size), loc.size)
+        << "Cache file is truncated";
+    }
+    std::shared_ptr<DMatrix> page(new DMatrix());
+    page->Clear();
+    LoadBinaryBuffer(reinterpret_cast<const char*>(buf->data()), loc.size,
+                     buf, page.get());
+    page->num_col = num_col_;
+    return page;
+  }
+
+  void Run() {
+    while (true) {
+      size_t page_id;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        request_cv_.wait(lock, [this] { return stop_ || !requests_.empty(); });
+        if (stop_) {
+          return;
+        }
+        page_id = requests_.front();
+        requests_.pop_front();
+        if (pages_.count(page_id) > 0 || loading_.count(page_id) > 0) {
+          continue;
+        }
+      }
+      try {
+        Get(page_id);
+      } catch (const dmlc::Error&) {
+        // the consumer will get the same error when it asks for the page
+      }
+    }
+  }
+};
+
+
 DMatrix*
 DMatrix::Create(const char* filename, const char* format,
-                int nthread, int verbose) {
-  std::unique_ptr<dmlc::Parser<uint32_t>> parser(
-    dmlc::Parser<uint32_t>::Create(filename, 0, 1, format));
-  return Create(parser.get(), nthread, verbose);
+                int nthread, int verbose,
+                unsigned part_index, unsigned num_parts) {
+  CHECK_LT(part_index, num_parts) << "part_index must be less than num_parts";
+  const std::string format_str(format);
+  if (format_str == "binary") {
+    CHECK_EQ(num_parts, 1) << "Binary DMatrix files cannot be split into parts";
+    return Load(filename);
+  }
+  const int max_thread = omp_get_max_threads();
+  nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
+  if (format_str == "fast_csv" || format_str == "fast_libsvm") {
+    const common::TextFormat text_format = (format_str == "fast_csv")
+                                           ? common::TextFormat::kCSV
+                                           : common::TextFormat::kLibSVM;
+    // Parse straight from the mapping, so that no copy of the text is made
+    std::unique_ptr<common::MemoryMappedFile> mapping;
+    std::string buf;
+    const char* begin;
+    const char* end;
+    if (common::MemoryMappedFile::IsLocalFile(filename)) {
+      mapping.reset(new common::MemoryMappedFile(filename));
+      begin = mapping->data();
+      end = begin + mapping->size();
+    } else {
+      ReadStream(filename, &buf);
+      begin = buf.data();
+      end = begin + buf.size();
+    }
+    // Unlike dmlc parsers, a part can be split further into sub-parts
+    common::SplitText(begin, end, part_index, num_parts, &begin, &end);
+    std::unique_ptr<DMatrix> dmat(ParseTextToDMatrix(begin, end, text_format,
+                                                     nthread));
+    if (verbose > 0) {
+      LOG(INFO) << dmat->num_row << " rows read into memory";
+    }
+    return dmat.release();
+  }
+  // Splitting a part into sub-parts would not reproduce the boundaries of
+  // the part exactly, so parts of a file are loaded with a single parser
+  const int nparser = (num_parts > 1) ? 1 : nthread;
+  const bool dense = (format_str == "csv");
+
+  // Pass 1: each thread parses its own byte range into private buffers
+  std::vector<std::unique_ptr<dmlc::Parser<uint32_t>>> parsers;
+  for (int i = 0; i < nparser; ++i) {
+    parsers.emplace_back(dmlc::Parser<uint32_t>::Create(filename,
+                           (nparser == 1) ? part_index : i,
+                           (nparser == 1) ? num_parts : nparser, format));
+  }
+  std::vector<ParsedPart> parts(nparser);
+  common::OMPException omp_exc;
+  #pragma omp parallel for schedule(static, 1) num_threads(nparser)
+  for (int i = 0; i < nparser; ++i) {
+    omp_exc.Run([&] {
+      ParsePart(parsers[i].get(), &parts[i]);
+      parsers[i].reset();
+    });
+  }
+  omp_exc.Rethrow();
+
+  // Pass 2: copy all parts into exactly sized arrays
+  std::unique_ptr<DMatrix> dmat(AssembleParts(&parts, dense));
+  if (verbose > 0) {
+    LOG(INFO) << dmat->num_row << " rows read into memory";
+  }
+  return dmat.release();
+}
+
+DMatrix*
+DMatrix::CreateFromBuffer(const char* buf, size_t size, const char* format,
+                          int nthread, int verbose) {
+  const std::string format_str(format);
+  common::TextFormat text_format;
+  if (format_str == "csv" || format_str == "fast_csv") {
+    text_format = common::TextFormat::kCSV;
+  } else if (format_str == "libsvm" || format_str == "fast_libsvm") {
+    text_format = common::TextFormat::kLibSVM;
+  } else {
+    LOG(FATAL) << "Text format `" << format_str << "' cannot be parsed from "
+               << "a memory buffer; use libsvm or csv";
+  }
+  const int max_thread = omp_get_max_threads();
+  nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
+  std::unique_ptr<DMatrix> dmat(ParseTextToDMatrix(buf, buf + size,
+                                                   text_format, nthread));
+  if (verbose > 0) {
+    LOG(INFO) << dmat->num_row << " rows read into memory";
+  }
+  return dmat.release();
 }
 
 DMatrix*
@@ -30,7 +918,7 @@ DMatrix::Create(dmlc::Parser<uint32_t>* parser, int nthread, int verbose) {
   auto& col_ind_ = dmat->col_ind;
   auto& row_ptr_ = dmat->row_ptr;
   auto& num_row_ = dmat->num_row;
-  auto& num_col_ = dmat->num_row;
+  auto& num_col_ = dmat->num_col;
   auto& nelem_ = dmat->nelem;
 
   std::vector<size_t> max_col_ind(nthread, 0);
@@ -38,7 +926,7 @@ DMatrix::Create(dmlc::Parser<uint32_t>* parser, int nthread, int verbose) {
   while (parser->Next()) {
     const dmlc::RowBlock<uint32_t>& batch = parser->Value();
     num_row_ += batch.size;
-    nelem_ += batch.offset[batch.size];
+    nelem_ += batch.offset[batch.size] - batch.offset[0];
     const size_t top = data_.size();
     data_.resize(top + batch.offset[batch.size] - batch.offset[0]);
     col_ind_.resize(top + batch.offset[batch.size] - batch.offset[0]);
@@ -64,8 +952,475 @@ DMatrix::Create(dmlc::Parser<uint32_t>* parser, int nthread, int verbose) {
       LOG(INFO) << num_row_ << " rows read into memory";
     }
   }
-  num_col_ = *std::max_element(max_col_ind.begin(), max_col_ind.end()) + 1;
+  num_col_ = (nelem_ > 0)
+             ? *std::max_element(max_col_ind.begin(), max_col_ind.end()) + 1
+             : 0;
   return dmat;
 }
 
+void
+DMatrix::Save(dmlc::Stream* fo) const {
+  CHECK(layout != DMatrixLayout::kCompressedCSR)
+    << "Compressed DMatrix cannot be saved; save it before compressing";
+  if (layout == DMatrixLayout::kDense) {
+    CHECK(row_ptr.empty() && col_ind.empty());
+    CHECK_EQ(data.size(), num_row * num_col);
+  } else {
+    CHECK_EQ(row_ptr.size(), num_row + 1);
+    CHECK(col_ind.size() == nelem && data.size() == nelem);
+  }
+  const BinaryHeader header = MakeBinaryHeader(*this);
+  const char padding[kSectionAlign] = {0};
+  uint64_t offset = 0;
+  auto write_section = [fo, &offset, &padding](uint64_t section_offset,
+                                               const void* ptr, size_t size) {
+    CHECK_LE(offset, section_offset);
+    fo->Write(padding, section_offset - offset);
+    fo->Write(ptr, size);
+    offset = section_offset + size;
+  };
+  write_section(0, &header, sizeof(header));
+  if (sizeof(size_t) == sizeof(uint64_t)) {
+    write_section(header.row_ptr_offset, row_ptr.data(),
+                  row_ptr.size() * sizeof(uint64_t));
+  } else {
+    std::vector<uint64_t> row_ptr_(row_ptr.begin(), row_ptr.end());
+    write_section(header.row_ptr_offset, row_ptr_.data(),
+                  row_ptr_.size() * sizeof(uint64_t));
+  }
+  write_section(header.col_ind_offset, col_ind.data(),
+                col_ind.size() * sizeof(uint32_t));
+  write_section(header.data_offset, data.data(), data.size() * sizeof(float));
+  CHECK_EQ(offset, header.file_size);
+}
+
+DMatrix*
+DMatrix::Load(const char* filename) {
+  std::unique_ptr<DMatrix> dmat(new DMatrix());
+  dmat->Clear();
+  if (common::MemoryMappedFile::IsLocalFile(filename)) {
+    // CSR arrays will refer to the mapping, which lives as long as they do
+    std::shared_ptr<common::MemoryMappedFile> mapping(
+      new common::MemoryMappedFile(filename));
+    LoadBinaryBuffer(mapping->data(), mapping->size(), mapping, dmat.get());
+  } else {
+    std::string buf;
+    ReadStream(filename, &buf);
+    const size_t size = buf.size();
+    // std::string storage is not guaranteed to be aligned for the sections
+    std::vector<uint64_t> aligned_buf((size + 7) / 8);
+    std::memcpy(aligned_buf.data(), buf.data(), size);
+    LoadBinaryBuffer(reinterpret_cast<const char*>(aligned_buf.data()), size,
+                     nullptr, dmat.get());
+  }
+  return dmat.release();
+}
+
+void
+DMatrix::Compress(bool allow_float16, int verbose) {
+  if (layout != DMatrixLayout::kCSR) {
+    return;  // dense matrices have no indices to compress
+  }
+  CHECK_EQ(row_ptr.size(), num_row + 1);
+  CHECK(col_ind.size() == nelem && data.size() == nelem);
+  // read through const arrays, so that borrowed storage is not copied
+  const DataArray<size_t>& row_ptr_ = row_ptr;
+  const DataArray<uint32_t>& col_ind_ = col_ind;
+  const DataArray<float>& data_ = data;
+  const int nthread = omp_get_max_threads();
+  const size_t uncompressed_size
+    = row_ptr.size() * sizeof(size_t)
+      + nelem * (sizeof(uint32_t) + sizeof(float));
+  std::shared_ptr<CompressedCSR> comp(new CompressedCSR());
+  comp->row_ptr.assign(row_ptr_.begin(), row_ptr_.end());
+
+  // column indices: choose width of each row, prefix-sum sizes, then encode
+  std::vector<size_t>& col_ptr = comp->col_ptr;
+  col_ptr.assign(num_row + 1, 0);
+  #pragma omp parallel for schedule(static) num_threads(nthread)
+  for (size_t rid = 0; rid < num_row; ++rid) {
+    uint32_t last_col = 0;
+    uint32_t max_delta = 0;
+    bool increasing = true;
+    for (size_t i = row_ptr_[rid]; i < row_ptr_[rid + 1]; ++i) {
+      increasing = increasing && (col_ind_[i] >= last_col);
+      max_delta = std::max(max_delta, col_ind_[i] - last_col);
+      last_col = col_ind_[i];
+    }
+    const size_t width = !increasing ? 4 : (max_delta <= 0xFF) ? 1
+                         : (max_delta <= 0xFFFF) ? 2 : 4;
+    col_ptr[rid + 1] = width * (row_ptr_[rid + 1] - row_ptr_[rid]);
+  }
+  for (size_t rid = 0; rid < num_row; ++rid) {
+    col_ptr[rid + 1] += col_ptr[rid];
+  }
+  comp->col_code.resize(col_ptr[num_row]);
+  #pragma omp parallel for schedule(static) num_threads(nthread)
+  for (size_t rid = 0; rid < num_row; ++rid) {
+    const size_t ibegin = row_ptr_[rid];
+    const size_t iend = row_ptr_[rid + 1];
+    if (ibegin == iend) {
+      continue;
+    }
+    const size_t width = (col_ptr[rid + 1] - col_ptr[rid]) / (iend - ibegin);
+    uint8_t* code = &comp->col_code[col_ptr[rid]];
+    uint32_t last_col = 0;
+    for (size_t i = ibegin; i < iend; ++i, code += width) {
+      if (width == 1) {
+        *code = static_cast<uint8_t>(col_ind_[i] - last_col);
+      } else if (width == 2) {
+        StoreCode<uint16_t>(code,
+                            static_cast<uint16_t>(col_ind_[i] - last_col));
+      } else {
+        StoreCode<uint32_t>(code, col_ind_[i]);
+      }
+      last_col = col_ind_[i];
+    }
+  }
+
+  // feature values: choose the smallest coding for each column, from the
+  // distinct values of the column
+  std::vector<size_t> col_begin;
+  std::vector<uint32_t> col_value;
+  GatherColumns(*this, nthread, &col_begin, &col_value);
+  std::vector<ValueCoding>& value_coding = comp->value_coding;
+  value_coding.assign(num_col, ValueCoding::kFloat32);
+  std::vector<size_t>& dict_ptr = comp->dict_ptr;
+  dict_ptr.assign(num_col + 1, 0);
+  #pragma omp parallel for schedule(dynamic) num_threads(nthread)
+  for (size_t col = 0; col < num_col; ++col) {
+    // sort the values of the column in place; its distinct values are
+    // then left at the front, sorted by bit pattern
+    uint32_t* begin = col_value.data() + col_begin[col];
+    uint32_t* end = col_value.data() + col_begin[col + 1];
+    std::sort(begin, end);
+    const size_t num_distinct = std::unique(begin, end) - begin;
+    const size_t col_nelem = col_begin[col + 1] - col_begin[col];
+    ValueCoding coding = ValueCoding::kFloat32;
+    size_t coded_size = col_nelem * sizeof(float);
+    auto consider = [&coding, &coded_size](ValueCoding c, size_t size) {
+      if (size < coded_size) {
+        coding = c;
+        coded_size = size;
+      }
+    };
+    const size_t dict_size = num_distinct * sizeof(float);
+    if (num_distinct <= 0x100) {
+      consider(ValueCoding::kDictionary8, col_nelem + dict_size);
+    }
+    if (num_distinct <= kMaxDictSize) {
+      consider(ValueCoding::kDictionary16, col_nelem * 2 + dict_size);
+    }
+    if (allow_float16) {
+      // values beyond the range of half precision would become infinity
+      const bool in_range
+        = std::none_of(begin, begin + num_distinct, [](uint32_t bits) {
+            float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return std::abs(value) >= 65520.0f;
+          });
+      if (in_range) {
+        consider(ValueCoding::kFloat16, col_nelem * 2);
+      }
+    }
+    value_coding[col] = coding;
+    if (coding == ValueCoding::kDictionary8
+        || coding == ValueCoding::kDictionary16) {
+      dict_ptr[col + 1] = num_distinct;
+    }
+  }
+  for (size_t col = 0; col < num_col; ++col) {
+    dict_ptr[col + 1] += dict_ptr[col];
+  }
+  comp->dict.resize(dict_ptr[num_col]);
+  for (size_t col = 0; col < num_col; ++col) {
+    std::memcpy(comp->dict.data() + dict_ptr[col],
+                col_value.data() + col_begin[col],
+                (dict_ptr[col + 1] - dict_ptr[col]) * sizeof(float));
+  }
+  col_value.clear();
+  col_value.shrink_to_fit();
+
+  // value codes: prefix-sum the size of each row, then encode
+  auto code_width = [](ValueCoding coding) -> size_t {
+    return (coding == ValueCoding::kFloat32) ? 4
+           : (coding == ValueCoding::kDictionary8) ? 1 : 2;
+  };
+  std::vector<size_t>& value_ptr = comp->value_ptr;
+  value_ptr.assign(num_row + 1, 0);
+  #pragma omp parallel for schedule(static) num_threads(nthread)
+  for (size_t rid = 0; rid < num_row; ++rid) {
+    size_t row_size = 0;
+    for (size_t i = row_ptr_[rid]; i < row_ptr_[rid + 1]; ++i) {
+      row_size += code_width(value_coding[col_ind_[i]]);
+    }
+    value_ptr[rid + 1] = row_size;
+  }
+  for (size_t rid = 0; rid < num_row; ++rid) {
+    value_ptr[rid + 1] += value_ptr[rid];
+  }
+  comp->value_code.resize(value_ptr[num_row]);
+  const std::vector<float>& dict = comp->dict;
+  // dictionaries are sorted by bit pattern, so codes are found by bisection
+  auto dict_code = [&dict, &dict_ptr](uint32_t col, float value) {
+    const uint32_t bits = FloatBits(value);
+    const float* begin = dict.data() + dict_ptr[col];
+    const float* end = dict.data() + dict_ptr[col + 1];
+    return static_cast<size_t>(std::lower_bound(begin, end, bits,
+      [](float a, uint32_t b) { return FloatBits(a) < b; }) - begin);
+  };
+  #pragma omp parallel for schedule(static) num_threads(nthread)
+  for (size_t rid = 0; rid < num_row; ++rid) {
+    uint8_t* code = comp->value_code.data() + value_ptr[rid];
+    for (size_t i = row_ptr_[rid]; i < row_ptr_[rid + 1]; ++i) {
+      const uint32_t col = col_ind_[i];
+      const float value = DMatrix::CanonicalizeMissing(data_[i]);
+      switch (value_coding[col]) {
+       case ValueCoding::kFloat32:
+        StoreCode<float>(code, value);
+        break;
+       case ValueCoding::kFloat16:
+        StoreCode<uint16_t>(code, FloatToHalf(value));
+        break;
+       case ValueCoding::kDictionary8:
+        *code = static_cast<uint8_t>(dict_code(col, value));
+        break;
+       case ValueCoding::kDictionary16:
+        StoreCode<uint16_t>(code, static_cast<uint16_t>(dict_code(col, value)));
+        break;
+      }
+      code += code_width(value_coding[col]);
+    }
+  }
+
+  if (verbose > 0) {
+    LOG(INFO) << "Compressed DMatrix from " << uncompressed_size << " to "
+              << comp->MemoryUsage() << " bytes";
+  }
+  data.clear();
+  data.shrink_to_fit();
+  col_ind.clear();
+  col_ind.shrink_to_fit();
+  row_ptr.clear();
+  row_ptr.shrink_to_fit();
+  compressed = std::move(comp);
+  layout = DMatrixLayout::kCompressedCSR;
+}
+
+DMatrixBuilder::DMatrixBuilder(size_t num_col, DMatrixLayout layout) {
+  CHECK(layout == DMatrixLayout::kCSR || layout == DMatrixLayout::kDense)
+    << "DMatrixBuilder: only CSR and dense layouts can be built";
+  dmat_.Clear();
+  dmat_.layout = layout;
+  dmat_.num_col = num_col;
+  Clear();
+}
+
+void
+DMatrixBuilder::Clear() {
+  const size_t num_col = dmat_.num_col;
+  // clearing the arrays keeps their capacity
+  if (dmat_.layout == DMatrixLayout::kDense) {
+    dmat_.InitDense(0, num_col);
+  } else {
+    dmat_.Clear();
+    dmat_.num_col = num_col;
+  }
+}
+
+void
+DMatrixBuilder::Reserve(size_t num_row, size_t nelem) {
+  if (dmat_.layout == DMatrixLayout::kDense) {
+    dmat_.data.reserve(num_row * dmat_.num_col);
+  } else {
+    dmat_.data.reserve(nelem);
+    dmat_.col_ind.reserve(nelem);
+    dmat_.row_ptr.reserve(num_row + 1);
+  }
+}
+
+void
+DMatrixBuilder::AddSparseRow(const uint32_t* col_ind, const float* data,
+                             size_t num_entry) {
+  const size_t num_col = dmat_.num_col;
+  if (dmat_.layout == DMatrixLayout::kDense) {
+    const size_t offset = dmat_.data.size();
+    dmat_.data.resize(offset + num_col, DMatrix::MissingValue());
+    float* row = dmat_.data.data() + offset;
+    for (size_t i = 0; i < num_entry; ++i) {
+      CHECK_LT(col_ind[i], num_col) << "DMatrixBuilder: column out of range";
+      row[col_ind[i]] = DMatrix::CanonicalizeMissing(data[i]);
+    }
+  } else {
+    for (size_t i = 0; i < num_entry; ++i) {
+      CHECK_LT(col_ind[i], num_col) << "DMatrixBuilder: column out of range";
+      if (!std::isnan(data[i])) {
+        dmat_.data.push_back(data[i]);
+        dmat_.col_ind.push_back(col_ind[i]);
+      }
+    }
+    dmat_.row_ptr.push_back(dmat_.data.size());
+  }
+  ++dmat_.num_row;
+  dmat_.nelem = dmat_.data.size();
+}
+
+void
+DMatrixBuilder::AddDenseRows(const float* data, size_t num_row,
+                             float missing_value) {
+  const size_t num_col = dmat_.num_col;
+  if (dmat_.layout == DMatrixLayout::kDense) {
+    const size_t offset = dmat_.data.size();
+    dmat_.data.resize(offset + num_row * num_col);
+    float* out = dmat_.data.data() + offset;
+    for (size_t i = 0; i < num_row * num_col; ++i) {
+      out[i] = (std::isnan(data[i]) || data[i] == missing_value)
+               ? DMatrix::MissingValue() : data[i];
+    }
+  } else {
+    for (size_t rid = 0; rid < num_row; ++rid) {
+      const float* row = data + rid * num_col;
+      for (size_t j = 0; j < num_col; ++j) {
+        if (!std::isnan(row[j]) && row[j] != missing_value) {
+          dmat_.data.push_back(row[j]);
+          dmat_.col_ind.push_back(static_cast<uint32_t>(j));
+        }
+      }
+      dmat_.row_ptr.push_back(dmat_.data.size());
+    }
+  }
+  dmat_.num_row += num_row;
+  dmat_.nelem = dmat_.data.size();
+}
+
+DMatrixView::DMatrixView(const DMatrix* dmat)
+  : dmat_(dmat), row_begin_(0), num_row_(dmat->num_row) {}
+
+DMatrixView::DMatrixView(const DMatrix* dmat, size_t row_begin,
+                         size_t row_end)
+  : dmat_(dmat), row_begin_(row_begin), num_row_(row_end - row_begin) {
+  CHECK(row_begin <= row_end && row_end <= dmat->num_row)
+    << "DMatrixView: invalid row range [" << row_begin << ", " << row_end
+    << ") for a matrix with " << dmat->num_row << " rows";
+}
+
+DMatrixView::DMatrixView(const DMatrix* dmat, std::vector<size_t> row_index)
+  : dmat_(dmat), row_begin_(0), num_row_(row_index.size()),
+    row_index_(std::move(row_index)) {
+  if (!row_index_.empty()) {
+    const size_t max_index
+      = *std::max_element(row_index_.begin(), row_index_.end());
+    CHECK_LT(max_index, dmat->num_row)
+      << "DMatrixView: row index out of range";
+  }
+}
+
+PagedDMatrix::PagedDMatrix()
+  : num_row_(0), num_col_(0), nelem_(0), num_page_(0), next_page_(0) {}
+
+PagedDMatrix::~PagedDMatrix() = default;
+
+PagedDMatrix*
+PagedDMatrix::Create(const char* filename, const char* format,
+                     const char* cache_file, size_t page_size,
+                     size_t max_cached_page, int verbose) {
+  CHECK(common::MemoryMappedFile::IsLocalFile(cache_file))
+    << "Cache file must be a local file";
+  // reuse an existing cache file only if it was built from the same source
+  // file, which has not been modified since
+  bool reuse = false;
+  {
+    std::unique_ptr<dmlc::Stream> existing(
+      dmlc::Stream::Create(cache_file, "r", true));
+    if (existing) {
+      std::string source, expected_source;
+      const CacheHeader expected
+        = MakeCacheHeader(filename, format, &expected_source);
+      CacheHeader header;
+      reuse = ReadCacheHeader(existing.get(), &header, &source)
+              && source == expected_source
+              && header.source_size == expected.source_size
+              && header.source_mtime == expected.source_mtime;
+      if (verbose > 0) {
+        LOG(INFO) << (reuse ? "Reusing" : "Rebuilding stale") << " cache file "
+                  << cache_file;
+      }
+    }
+  }
+  if (!reuse) {
+    // write to a temporary file first, so that an interrupted run does not
+    // leave behind an incomplete cache file to be reused later
+    const std::string tmp_file = std::string(cache_file) + ".tmp";
+    WritePages(filename, format, tmp_file, page_size, verbose);
+#ifdef _WIN32
+    std::remove(cache_file);  // rename() does not replace files on Windows
+#endif
+    CHECK_EQ(std::rename(tmp_file.c_str(), cache_file), 0)
+      << "Failed to rename " << tmp_file << " to " << cache_file;
+  }
+  return Open(cache_file, max_cached_page);
+}
+
+PagedDMatrix*
+PagedDMatrix::Open(const char* cache_file, size_t max_cached_page) {
+  CHECK_GE(max_cached_page, 1) << "max_cached_page must be at least 1";
+  std::unique_ptr<PagedDMatrix> dmat(new PagedDMatrix());
+  std::vector<PageLocation> page_loc;
+  {
+    // scan page headers, without reading page content
+    std::unique_ptr<dmlc::SeekStream> fi(
+      dmlc::SeekStream::CreateForRead(cache_file));
+    CacheHeader cache_header;
+    std::string source;
+    CHECK(ReadCacheHeader(fi.get(), &cache_header, &source))
+      << "Not a cache file of paged DMatrix: " << cache_file;
+    uint64_t offset = cache_header.page_offset;
+    fi->Seek(offset);
+    BinaryHeader header;
+    size_t nread;
+    while ((nread = fi->Read(&header, sizeof(header))) > 0) {
+      CHECK(nread == sizeof(header)
+            && std::memcmp(header.magic, kBinaryMagic,
+                           sizeof(kBinaryMagic)) == 0)
+        << "Not a cache file of paged DMatrix: " << cache_file;
+      page_loc.push_back({offset, header.file_size});
+      dmat->num_row_ += header.num_row;
+      dmat->num_col_ = std::max(dmat->num_col_,
+                                static_cast<size_t>(header.num_col));
+      dmat->nelem_ += header.nelem;
+      offset = AlignSection(offset + header.file_size);
+      fi->Seek(offset);
+    }
+  }
+  dmat->num_page_ = page_loc.size();
+  dmat->cache_.reset(new PageCache(cache_file, page_loc, dmat->num_col_,
+                                   max_cached_page));
+  return dmat.release();
+}
+
+std::shared_ptr<const DMatrix>
+PagedDMatrix::GetPage(size_t page_id) {
+  return cache_->Get(page_id);
+}
+
+void
+PagedDMatrix::BeforeFirst() {
+  next_page_ = 0;
+  page_.reset();
+}
+
+bool
+PagedDMatrix::Next() {
+  if (next_page_ >= num_page_) {
+    page_.reset();
+    return false;
+  }
+  page_ = cache_->Get(next_page_);
+  ++next_page_;
+  // the current page and the pages read ahead must fit in the cache
+  const size_t num_ahead = std::min(kReadAheadPage, cache_->capacity() - 1);
+  cache_->ReadAhead(next_page_, std::min(next_page_ + num_ahead, num_page_));
+  return true;
+}
+
 }  // namespace treelite
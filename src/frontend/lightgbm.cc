@@ -7,15 +7,21 @@
 
 #include <dmlc/data.h>
 #include <treelite/tree.h>
-#include <unordered_map>
-#include <queue>
+#include <omp.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
 #include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <climits>
+#include "../common/mmap.h"
+#include "../common/omp_exception.h"
 
 namespace {
 
-treelite::Model ParseStream(dmlc::Stream* fi);
+treelite::Model ParseBuffer(const char* begin, const char* end);
 
 }  // namespace anonymous
 
@@ -25,8 +31,22 @@ namespace frontend {
 DMLC_REGISTRY_FILE_TAG(lightgbm);
 
 Model LoadLightGBMModel(const char* filename) {
+  if (common::MemoryMappedFile::IsLocalFile(filename)) {
+    // parse local files in place
+    common::MemoryMappedFile mmap(filename);
+    return ParseBuffer(mmap.data(), mmap.data() + mmap.size());
+  }
   std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(filename, "r"));
-  return ParseStream(fi.get());
+  const size_t chunk_size = 16 * 1024 * 1024;  // 16 MB
+  std::string buf;
+  size_t size = 0;
+  size_t nread;
+  do {
+    buf.resize(size + chunk_size);
+    nread = fi->Read(&buf[size], chunk_size);
+    size += nread;
+  } while (nread == chunk_size);
+  return ParseBuffer(buf.data(), buf.data() + size);
 }
 
 }  // namespace frontend
@@ -50,221 +70,406 @@ struct LGBTree {
   std::vector<int> right_child;
 };
 
+/*! \brief a range of characters within the model text */
+struct Token {
+  const char* begin;
+  const char* end;
+};
+
+/*!
+ * \brief fields of a tree within the model text; a field that does not
+ *        appear has begin == nullptr
+ */
+struct TreeText {
+  Token num_leaves;
+  Token leaf_value;
+  Token decision_type;
+  Token split_feature;
+  Token default_value;
+  Token threshold;
+  Token left_child;
+  Token right_child;
+};
+
+/*! \brief fields of the model text that are used to build the model */
+struct ModelText {
+  Token objective;
+  Token max_feature_idx;
+  std::vector<TreeText> trees;
+};
+
+/*! \brief maximum length of a number; strtod() is given a copy on stack */
+const size_t kMaxNumberLength = 127;
+/*! \brief maximum number of significant digits for exact conversion */
+const int kMaxExactDigit = 15;
+/* powers of 10 that are exactly representable as double */
+const double kPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15
+};
+
+inline bool IsBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool IsDigit(char c) {
+  return static_cast<unsigned>(c - '0') < 10u;
+}
+
+inline bool KeyIs(const Token& key, const char* name) {
+  const size_t len = std::strlen(name);
+  return static_cast<size_t>(key.end - key.begin) == len
+         && std::memcmp(key.begin, name, len) == 0;
+}
+
+inline std::string ToString(const Token& token) {
+  return std::string(token.begin, token.end);
+}
+
 template <typename T>
-inline T TextToEntry(const std::string& str) {
+inline T ParseEntry(const char* begin, const char* end) {
   static_assert(std::is_same<T, double>::value || std::is_same<T, int>::value,
-                "unsupported data type for TextToEntry; use double or int");
+                "unsupported data type for ParseEntry; use double or int");
 }
 
 template <>
-inline double TextToEntry(const std::string& str) {
+inline double ParseEntry(const char* begin, const char* end) {
+  // Numbers of the form [-]ddd[.ddd] with few digits are converted exactly:
+  // both the digits and the power of 10 are exact, so a single division
+  // gives the correctly rounded result
+  const char* p = begin;
+  const bool negative = (p != end && *p == '-');
+  if (negative) {
+    ++p;
+  }
+  int64_t mantissa = 0;
+  int num_digit = 0;
+  int num_frac_digit = 0;
+  bool seen_point = false;
+  for (; p != end && num_digit <= kMaxExactDigit; ++p) {
+    if (IsDigit(*p)) {
+      mantissa = mantissa * 10 + (*p - '0');
+      ++num_digit;
+      num_frac_digit += seen_point;
+    } else if (*p == '.' && !seen_point) {
+      seen_point = true;
+    } else {
+      break;
+    }
+  }
+  if (p == end && num_digit > 0 && num_digit <= kMaxExactDigit) {
+    const double val = static_cast<double>(mantissa) / kPow10[num_frac_digit];
+    return negative ? -val : val;
+  }
+  // all other numbers are handed to strtod(), which needs a NUL-terminated
+  // string
+  const size_t len = end - begin;
+  if (len > kMaxNumberLength) {
+    LOG(FATAL) << "String does not represent a valid floating-point number";
+  }
+  char buf[kMaxNumberLength + 1];
+  std::memcpy(buf, begin, len);
+  buf[len] = '\0';
   errno = 0;
   char *endptr;
-  double val = std::strtod(str.c_str(), &endptr);
+  double val = std::strtod(buf, &endptr);
   if (errno == ERANGE) {
     LOG(FATAL) << "Range error while converting string to double";
   } else if (errno != 0) {
     LOG(FATAL) << "Unknown error";
-  } else if (*endptr != '\0') {
+  } else if (len == 0 || *endptr != '\0') {
     LOG(FATAL) << "String does not represent a valid floating-point number";
   }
   return val;
 }
 
 template <>
-inline int TextToEntry(const std::string& str) {
-  errno = 0;
-  char *endptr;
-  long int val = std::strtol(str.c_str(), &endptr, 10);
-  if (errno == ERANGE || val < INT_MIN || val > INT_MAX) {
-    LOG(FATAL) << "Range error while converting string to int";
-  } else if (errno != 0) {
-    LOG(FATAL) << "Unknown error";
-  } else if (*endptr != '\0') {
+inline int ParseEntry(const char* begin, const char* end) {
+  const char* p = begin;
+  bool negative = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    ++p;
+  }
+  if (p == end) {
     LOG(FATAL) << "String does not represent a valid integer";
   }
+  int64_t val = 0;
+  for (; p != end; ++p) {
+    if (!IsDigit(*p)) {
+      LOG(FATAL) << "String does not represent a valid integer";
+    }
+    val = val * 10 + (*p - '0');
+    if (val > static_cast<int64_t>(INT_MAX) + 1) {
+      LOG(FATAL) << "Range error while converting string to int";
+    }
+  }
+  val = negative ? -val : val;
+  if (val > INT_MAX) {
+    LOG(FATAL) << "Range error while converting string to int";
+  }
   return static_cast<int>(val);
 }
 
-template <typename T, typename S = T>
-inline std::vector<S> TextToArray(const std::string& text, int num_entry) {
-  std::vector<S> array;
-  std::istringstream ss(text);
-  std::string token;
-  for (int i = 0; i < num_entry; ++i) {
-    std::getline(ss, token, ' '); 
-    array.push_back(static_cast<S>(TextToEntry<T>(token)));
+/*! \brief parse a single value, ignoring surrounding blanks */
+template <typename T>
+inline T ParseScalar(const Token& text) {
+  const char* begin = text.begin;
+  const char* end = text.end;
+  while (begin != end && IsBlank(*begin)) {
+    ++begin;
+  }
+  while (end != begin && IsBlank(end[-1])) {
+    --end;
   }
-  return array;
+  return ParseEntry<T>(begin, end);
 }
 
-inline std::vector<std::string> LoadText(dmlc::Stream* fi) {
-  const size_t bufsize = 16 * 1024 * 1024;  // 16 MB
-  std::vector<char> buf(bufsize);
-
-  std::vector<std::string> lines;
-
-  size_t byte_read;
-
-  std::string leftover = "";  // carry over between buffers
-  while ( (byte_read = fi->Read(&buf[0], sizeof(char) * bufsize)) > 0) {
-    size_t i = 0;
-    size_t tok_begin = 0;
-    while (i < byte_read) {
-      if (buf[i] == '\n' || buf[i] == '\r') {  // delimiter for lines
-        if (tok_begin == 0 && leftover.length() + i > 0) {  // first line in buffer
-          lines.push_back(leftover + std::string(&buf[0], i));
-          leftover = "";
-        } else {
-          lines.emplace_back(&buf[tok_begin], i - tok_begin);
-        }
-        // skip all delimiters afterwards
-        for (; (buf[i] == '\n' || buf[i] == '\r') && i < byte_read; ++i);
-        tok_begin = i;
-      } else {
-        ++i;
-      }
+/*!
+ * \brief parse a list of exactly [num_entry] values separated by blanks
+ * \param text text to parse
+ * \param num_entry number of values
+ * \param out used to save values; existing content is discarded but its
+ *            capacity is reused
+ */
+template <typename T, typename S = T>
+inline void ParseArray(const Token& text, int num_entry, std::vector<S>* out) {
+  out->clear();
+  out->reserve(num_entry);
+  const char* p = text.begin;
+  while (true) {
+    while (p != text.end && IsBlank(*p)) {
+      ++p;
+    }
+    if (p == text.end) {
+      break;
+    }
+    const char* token_end = p;
+    while (token_end != text.end && !IsBlank(*token_end)) {
+      ++token_end;
     }
-    // left-over string
-    leftover += std::string(&buf[tok_begin], byte_read - tok_begin);
+    CHECK_LT(out->size(), static_cast<size_t>(num_entry))
+      << "Ill-formed LightGBM model file: expected " << num_entry
+      << " entries in `" << ToString(text) << "'";
+    out->push_back(static_cast<S>(ParseEntry<T>(p, token_end)));
+    p = token_end;
   }
+  CHECK_EQ(out->size(), static_cast<size_t>(num_entry))
+    << "Ill-formed LightGBM model file: expected " << num_entry
+    << " entries in `" << ToString(text) << "'";
+}
 
-  if (!leftover.empty()) {
-    LOG(INFO) << "Warning: input file was not terminated with end-of-line character.";
-    lines.push_back(leftover);
+/*! \brief locate the field of a tree with a given key, if it is used */
+inline Token* TreeField(TreeText* tree, const Token& key) {
+  if (KeyIs(key, "num_leaves")) {
+    return &tree->num_leaves;
+  } else if (KeyIs(key, "leaf_value")) {
+    return &tree->leaf_value;
+  } else if (KeyIs(key, "decision_type")) {
+    return &tree->decision_type;
+  } else if (KeyIs(key, "split_feature")) {
+    return &tree->split_feature;
+  } else if (KeyIs(key, "default_value")) {
+    return &tree->default_value;
+  } else if (KeyIs(key, "threshold")) {
+    return &tree->threshold;
+  } else if (KeyIs(key, "left_child")) {
+    return &tree->left_child;
+  } else if (KeyIs(key, "right_child")) {
+    return &tree->right_child;
   }
-
-  return lines;
+  return nullptr;
 }
 
-inline treelite::Model ParseStream(dmlc::Stream* fi) {
-  std::vector<LGBTree> lgb_trees_;
-  int max_feature_idx_;
-  std::string obj_name_;
-
-  /* 1. Parse input stream */
-  std::vector<std::string> lines = LoadText(fi);
-  std::unordered_map<std::string, std::string> global_dict;
-  std::vector<std::unordered_map<std::string, std::string>> tree_dict;
-
+/*!
+ * \brief locate the fields of the model text in a single pass over its
+ *        lines, each of form key=value. No text is copied: every field
+ *        refers to its value within the buffer.
+ * \param begin beginning of model text
+ * \param end end of model text
+ * \param out used to save fields
+ */
+inline void ScanModel(const char* begin, const char* end, ModelText* out) {
+  out->objective = out->max_feature_idx = Token{nullptr, nullptr};
+  out->trees.clear();
   bool in_tree = false;  // is current entry part of a tree?
-  for (const auto& line : lines) {
-    std::istringstream ss(line);
-    std::string key, value, rest;
-    std::getline(ss, key, '=');
-    std::getline(ss, value, '=');
-    std::getline(ss, rest);
-    CHECK(rest.empty()) << "Ill-formed LightGBM model file";
-    if (key == "Tree") {
+  const char* p = begin;
+  while (p < end) {
+    const void* pos = std::memchr(p, '\n', end - p);
+    const char* line_end = (pos == nullptr) ? end
+                                            : static_cast<const char*>(pos);
+    const char* next = (line_end == end) ? end : line_end + 1;
+    while (line_end != p && line_end[-1] == '\r') {
+      --line_end;
+    }
+    if (p == line_end) {  // skip empty lines
+      p = next;
+      continue;
+    }
+    const char* eq = static_cast<const char*>(
+      std::memchr(p, '=', line_end - p));
+    const Token key{p, (eq == nullptr) ? line_end : eq};
+    const Token value{(eq == nullptr) ? line_end : eq + 1, line_end};
+    CHECK(std::memchr(value.begin, '=', value.end - value.begin) == nullptr)
+      << "Ill-formed LightGBM model file";
+    if (KeyIs(key, "Tree")) {
       in_tree = true;
-      tree_dict.emplace_back();
-    } else {
-      if (in_tree) {
-        tree_dict.back()[key] = value;
-      } else {
-        global_dict[key] = value;
+      out->trees.push_back(TreeText());
+    } else if (in_tree) {
+      Token* field = TreeField(&out->trees.back(), key);
+      if (field != nullptr) {
+        *field = value;
       }
+    } else if (KeyIs(key, "objective")) {
+      out->objective = value;
+    } else if (KeyIs(key, "max_feature_idx")) {
+      out->max_feature_idx = value;
     }
+    p = next;
   }
+}
 
-  {
-    auto it = global_dict.find("objective");
-    CHECK(it != global_dict.end()) << "Ill-formed LightGBM model file: need objective";
-    obj_name_ = it->second;
-    it = global_dict.find("max_feature_idx");
-    CHECK(it != global_dict.end()) << "Ill-formed LightGBM model file: need max_feature_idx";
-    max_feature_idx_ = TextToEntry<int>(it->second);
-  }
-
-  for (const auto& dict : tree_dict) {
-    lgb_trees_.emplace_back();
-    LGBTree& tree = lgb_trees_.back();
-
-    auto it = dict.find("num_leaves");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need num_leaves";
-    tree.num_leaves = TextToEntry<int>(it->second);
+/*!
+ * \brief parse the fields of a tree
+ * \param text fields of the tree within the model text
+ * \param tree used to save parsed tree; capacity of its arrays is reused
+ */
+inline void ParseTree(const TreeText& text, LGBTree* tree) {
+  CHECK(text.num_leaves.begin)
+    << "Ill-formed LightGBM model file: need num_leaves";
+  tree->num_leaves = ParseScalar<int>(text.num_leaves);
+  CHECK_GT(tree->num_leaves, 0)
+    << "Ill-formed LightGBM model file: num_leaves must be positive";
+  const int num_internal = tree->num_leaves - 1;
+
+  CHECK(text.leaf_value.begin)
+    << "Ill-formed LightGBM model file: need leaf_value";
+  ParseArray<double>(text.leaf_value, tree->num_leaves, &tree->leaf_value);
+
+  CHECK(text.decision_type.begin)
+    << "Ill-formed LightGBM model file: need decision_type";
+  ParseArray<int, DecisionType>(text.decision_type, num_internal,
+                                &tree->decision_type);
+
+  CHECK(text.split_feature.begin)
+    << "Ill-formed LightGBM model file: need split_feature";
+  ParseArray<int>(text.split_feature, num_internal, &tree->split_feature);
+
+  CHECK(text.default_value.begin)
+    << "Ill-formed LightGBM model file: need default_value";
+  ParseArray<double>(text.default_value, num_internal, &tree->default_value);
+
+  CHECK(text.threshold.begin)
+    << "Ill-formed LightGBM model file: need threshold";
+  ParseArray<double>(text.threshold, num_internal, &tree->threshold);
+
+  CHECK(text.left_child.begin)
+    << "Ill-formed LightGBM model file: need left_child";
+  ParseArray<int>(text.left_child, num_internal, &tree->left_child);
+
+  CHECK(text.right_child.begin)
+    << "Ill-formed LightGBM model file: need right_child";
+  ParseArray<int>(text.right_child, num_internal, &tree->right_child);
+}
 
-    it = dict.find("leaf_value");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need leaf_value";
-    tree.leaf_value = TextToArray<double>(it->second, tree.num_leaves);
+/*! \brief parallel node arrays taken by treelite::Tree::Build() */
+struct NodeArrays {
+  std::vector<int> left_child, right_child;
+  std::vector<unsigned> split_index;
+  std::vector<uint8_t> default_left;
+  std::vector<treelite::tl_float> threshold, leaf_value;
+  std::vector<treelite::Operator> cmp;
+};
 
-    it = dict.find("decision_type");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need decision_type";
-    if (it == dict.end()) {
-      tree.decision_type = std::vector<DecisionType>(tree.num_leaves - 1, DecisionType::numerical);
-    } else {
-      tree.decision_type = TextToArray<int, DecisionType>(it->second, tree.num_leaves - 1);
+/*!
+ * \brief convert a LightGBM tree
+ * \param lgb_tree tree to convert
+ * \param arrays scratch space, reused across trees
+ * \param tree used to save converted tree
+ */
+inline void ConvertTree(const LGBTree& lgb_tree, NodeArrays* arrays,
+                        treelite::Tree* tree) {
+  // gather nodes into parallel arrays, where non-leaf node i keeps ID i and
+  // leaf i (referred to as ~i by LightGBM) gets ID [num_leaves - 1 + i].
+  // Tree::Build() assigns node ID's so that a breadth-wise traversal would
+  // yield the monotonic sequence 0, 1, 2, ...
+  const int num_internal = lgb_tree.num_leaves - 1;
+  const int num_nodes = num_internal + lgb_tree.num_leaves;
+  auto node_id = [num_internal](int lgb_id) {
+    return (lgb_id < 0) ? num_internal + ~lgb_id : lgb_id;
+  };
+  arrays->left_child.assign(num_nodes, -1);
+  arrays->right_child.assign(num_nodes, -1);
+  arrays->split_index.resize(num_nodes);
+  arrays->default_left.resize(num_nodes);
+  arrays->threshold.resize(num_nodes);
+  arrays->leaf_value.resize(num_nodes);
+  arrays->cmp.resize(num_nodes);
+  for (int nid = 0; nid < num_internal; ++nid) {
+    const treelite::tl_float default_value =
+      static_cast<treelite::tl_float>(lgb_tree.default_value[nid]);
+    arrays->left_child[nid] = node_id(lgb_tree.left_child[nid]);
+    arrays->right_child[nid] = node_id(lgb_tree.right_child[nid]);
+    const treelite::tl_float threshold =
+      static_cast<treelite::tl_float>(lgb_tree.threshold[nid]);
+    arrays->split_index[nid] =
+      static_cast<unsigned>(lgb_tree.split_feature[nid]);
+    arrays->threshold[nid] = threshold;
+    switch (lgb_tree.decision_type[nid]) {
+      case DecisionType::numerical:
+        arrays->cmp[nid] = treelite::Operator::kLE;
+        arrays->default_left[nid] = (default_value <= threshold);
+        break;
+      case DecisionType::categorical:
+        arrays->cmp[nid] = treelite::Operator::kEQ;
+        arrays->default_left[nid] = (default_value == threshold);
+        break;
+      default:
+        LOG(FATAL) << "invalid value for decision type";
     }
-
-    it = dict.find("split_feature");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need split_feature";
-    tree.split_feature = TextToArray<int>(it->second, tree.num_leaves - 1);
-
-    it = dict.find("default_value");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need default_value";
-    tree.default_value = TextToArray<double>(it->second, tree.num_leaves - 1);
-
-    it = dict.find("threshold");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need threshold";
-    tree.threshold = TextToArray<double>(it->second, tree.num_leaves - 1);
-
-    it = dict.find("left_child");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need left_child";
-    tree.left_child = TextToArray<int>(it->second, tree.num_leaves - 1);
-
-    it = dict.find("right_child");
-    CHECK(it != dict.end()) << "Ill-formed LightGBM model file: need right_child";
-    tree.right_child = TextToArray<int>(it->second, tree.num_leaves - 1);
   }
+  for (int i = 0; i < lgb_tree.num_leaves; ++i) {
+    arrays->leaf_value[num_internal + i] =
+      static_cast<treelite::tl_float>(lgb_tree.leaf_value[i]);
+  }
+  tree->Build(num_nodes, arrays->left_child.data(),
+              arrays->right_child.data(), arrays->split_index.data(),
+              arrays->default_left.data(), arrays->threshold.data(),
+              arrays->cmp.data(), arrays->leaf_value.data());
+}
 
-  /* 2. Export model */
+inline treelite::Model ParseBuffer(const char* begin, const char* end) {
+  /* 1. Locate fields of model text */
+  ModelText text;
+  ScanModel(begin, end, &text);
+  CHECK(text.objective.begin)
+    << "Ill-formed LightGBM model file: need objective";
+  CHECK(text.max_feature_idx.begin)
+    << "Ill-formed LightGBM model file: need max_feature_idx";
+  const int max_feature_idx = ParseScalar<int>(text.max_feature_idx);
+
+  /* 2. Parse trees and export model */
+  // trees are independent, so parse and convert them in parallel; each tree
+  // is written to its own slot, so the result does not depend on scheduling
   treelite::Model model;
-  model.num_features = max_feature_idx_ + 1;
-  for (const auto& lgb_tree : lgb_trees_) {
-    model.trees.emplace_back();
-    treelite::Tree& tree = model.trees.back();
-    tree.Init();
-
-    // assign node ID's so that a breadth-wise traversal would yield
-    // the monotonic sequence 0, 1, 2, ...
-    std::queue<std::pair<int, int>> Q;  // (old ID, new ID) pair
-    Q.push({0, 0});
-    while (!Q.empty()) {
-      int old_id, new_id;
-      std::tie(old_id, new_id) = Q.front(); Q.pop();
-      if (old_id < 0) {  // leaf
-        const double leaf_value = lgb_tree.leaf_value[~old_id];
-        tree[new_id].set_leaf(static_cast<treelite::tl_float>(leaf_value));
-      } else {  // non-leaf
-        const unsigned split_index =
-          static_cast<unsigned>(lgb_tree.split_feature[old_id]);
-        const treelite::tl_float threshold =
-          static_cast<treelite::tl_float>(lgb_tree.threshold[old_id]);
-        const treelite::tl_float default_value =
-          static_cast<treelite::tl_float>(lgb_tree.default_value[old_id]);
-        bool default_left;
-        treelite::Operator cmp_op;
-        switch (lgb_tree.decision_type[old_id]) {
-          case DecisionType::numerical:
-            cmp_op = treelite::Operator::kLE;
-            default_left = (default_value <= threshold);
-            break;
-          case DecisionType::categorical:
-            cmp_op = treelite::Operator::kEQ;
-            default_left = (default_value == threshold);
-            break;
-          default:
-            LOG(FATAL) << "invalid value for decision type";
-            cmp_op = treelite::Operator::kEQ;  // only remove warning
-            default_left = true;  // ditto
-        }
-        tree.AddChilds(new_id);
-        tree[new_id].set_split(split_index, threshold, default_left, cmp_op);
-        Q.push({lgb_tree.left_child[old_id], tree[new_id].cleft()});
-        Q.push({lgb_tree.right_child[old_id], tree[new_id].cright()});
-      }
+  model.num_features = max_feature_idx + 1;
+  const int ntree = static_cast<int>(text.trees.size());
+  model.trees.resize(ntree);
+  const int nthread = std::max(std::min(omp_get_max_threads(), ntree), 1);
+  treelite::common::OMPException omp_exc;
+  #pragma omp parallel num_threads(nthread)
+  {
+    LGBTree lgb_tree;
+    NodeArrays arrays;
+    #pragma omp for schedule(dynamic)
+    for (int i = 0; i < ntree; ++i) {
+      omp_exc.Run([&] {
+        ParseTree(text.trees[i], &lgb_tree);
+        ConvertTree(lgb_tree, &arrays, &model.trees[i]);
+      });
     }
   }
+  omp_exc.Rethrow();
   return model;
 }
 
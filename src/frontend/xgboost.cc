@@ -7,13 +7,19 @@
 
 #include <dmlc/data.h>
 #include <treelite/tree.h>
+#include <omp.h>
+#include <algorithm>
+#include <limits>
 #include <memory>
-#include <queue>
+#include <string>
+#include <vector>
 #include <cstring>
+#include "../common/mmap.h"
+#include "../common/omp_exception.h"
 
 namespace {
 
-treelite::Model ParseStream(dmlc::Stream* fi);
+treelite::Model ParseBuffer(const char* begin, const char* end);
 
 }  // namespace anonymous
 
@@ -23,8 +29,22 @@ namespace frontend {
 DMLC_REGISTRY_FILE_TAG(xgboost);
 
 Model LoadXGBoostModel(const char* filename) {
+  if (common::MemoryMappedFile::IsLocalFile(filename)) {
+    // use node arrays of local files in place
+    common::MemoryMappedFile mmap(filename);
+    return ParseBuffer(mmap.data(), mmap.data() + mmap.size());
+  }
   std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(filename, "r"));
-  return ParseStream(fi.get());
+  const size_t chunk_size = 16 * 1024 * 1024;  // 16 MB
+  std::string buf;
+  size_t size = 0;
+  size_t nread;
+  do {
+    buf.resize(size + chunk_size);
+    nread = fi->Read(&buf[size], chunk_size);
+    size += nread;
+  } while (nread == chunk_size);
+  return ParseBuffer(buf.data(), buf.data() + size);
 }
 
 }  // namespace frontend
@@ -35,101 +55,52 @@ namespace {
 
 typedef float bst_float;
 
-/* peekable input stream implemented with a ring buffer */
-class PeekableInputStream {
+/*!
+ * \brief cursor over a model file held in memory. Content is accessed in
+ *        place; only small headers are copied out.
+ */
+class BufferReader {
  public:
-  const size_t MAX_PEEK_WINDOW = 1024;  // peek up to 1024 bytes
-
-  PeekableInputStream(dmlc::Stream* fi)
-   : istm_(fi), buf_(MAX_PEEK_WINDOW + 1), begin_ptr_(0), end_ptr_(0) {}
-
-  inline size_t Read(void* ptr, size_t size) {
-    const size_t bytes_buffered = BytesBuffered();
-    char* cptr = static_cast<char*>(ptr);
-    if (size <= bytes_buffered) {
-      // all content already buffered; consume buffer
-      if (begin_ptr_ + size < MAX_PEEK_WINDOW + 1) {
-        std::memcpy(cptr, &buf_[begin_ptr_], size);
-        begin_ptr_ += size;
-      } else {
-        std::memcpy(cptr, &buf_[begin_ptr_], MAX_PEEK_WINDOW + 1 - begin_ptr_);
-        std::memcpy(cptr + MAX_PEEK_WINDOW + 1 - begin_ptr_, &buf_[0],
-                    size + begin_ptr_ - MAX_PEEK_WINDOW - 1);
-        begin_ptr_ = size + begin_ptr_ - MAX_PEEK_WINDOW - 1;
-      }
-      return size;
-    } else {  // consume buffer entirely and read more bytes
-      const size_t bytes_to_read = size - bytes_buffered;
-      if (begin_ptr_ <= end_ptr_) {
-        std::memcpy(cptr, &buf_[begin_ptr_], bytes_buffered);
-      } else {
-        std::memcpy(cptr, &buf_[begin_ptr_], MAX_PEEK_WINDOW + 1 - begin_ptr_);
-        std::memcpy(cptr + MAX_PEEK_WINDOW + 1 - begin_ptr_, &buf_[0],
-                    bytes_buffered + begin_ptr_ - MAX_PEEK_WINDOW - 1);
-      }
-      begin_ptr_ = end_ptr_;
-      return bytes_buffered
-             + istm_->Read(cptr + bytes_buffered, bytes_to_read);
-    }
+  BufferReader(const char* begin, const char* end)
+    : cur_(begin), end_(end) {}
+  /*! \brief number of bytes not yet consumed */
+  inline size_t BytesLeft() const {
+    return end_ - cur_;
   }
-
-  inline size_t PeekRead(void* ptr, size_t size) {
-    CHECK_LE(size, MAX_PEEK_WINDOW)
-      << "PeekableInputStream allows peeking up to "
-      << MAX_PEEK_WINDOW << " bytes";
-    char* cptr = static_cast<char*>(ptr);
-    const size_t bytes_buffered = BytesBuffered();
-    /* fill buffer with additional bytes, up to size */
-    if (size > bytes_buffered) {
-      const size_t bytes_to_read = size - bytes_buffered;
-      if (end_ptr_ + bytes_to_read < MAX_PEEK_WINDOW + 1) {
-        CHECK_EQ(istm_->Read(&buf_[end_ptr_], bytes_to_read), bytes_to_read)
-          << "Failed to peek " << size << " bytes";
-        end_ptr_ += bytes_to_read;
-      } else {
-        CHECK_EQ(  istm_->Read(&buf_[end_ptr_],
-                               MAX_PEEK_WINDOW + 1 - end_ptr_)
-                 + istm_->Read(&buf_[0],
-                               bytes_to_read + end_ptr_ - MAX_PEEK_WINDOW - 1),
-                 bytes_to_read)
-          << "Ill-formed XGBoost model: Failed to peek " << size << " bytes";
-        end_ptr_ = bytes_to_read + end_ptr_ - MAX_PEEK_WINDOW - 1;
-      }
-    }
-    /* copy buffer into ptr without emptying buffer */
-    if (begin_ptr_ <= end_ptr_) {  // usual case
-      std::memcpy(cptr, &buf_[begin_ptr_], end_ptr_ - begin_ptr_);
-    } else {  // context wrapped around the end
-      std::memcpy(cptr, &buf_[begin_ptr_], MAX_PEEK_WINDOW + 1 - begin_ptr_);
-      std::memcpy(cptr + MAX_PEEK_WINDOW + 1 - begin_ptr_, &buf_[0], end_ptr_);
-    }
-
-    return size;
+  /*!
+   * \brief consume bytes
+   * \param size number of bytes to consume
+   * \param what description of content, used in error messages
+   * \return pointer to the consumed bytes, within the buffer
+   */
+  inline const char* Take(size_t size, const char* what) {
+    CHECK_LE(size, BytesLeft())
+      << "Ill-formed XGBoost model file: cannot read " << what;
+    const char* ptr = cur_;
+    cur_ += size;
+    return ptr;
+  }
+  /*! \brief copy out an object of trivial type */
+  template <typename T>
+  inline void Read(T* out, const char* what) {
+    std::memcpy(out, Take(sizeof(T), what), sizeof(T));
+  }
+  /*! \brief copy out a string of [size] bytes */
+  inline void ReadString(std::string* out, size_t size, const char* what) {
+    const char* ptr = Take(size, what);
+    out->assign(ptr, size);
+  }
+  /*! \brief check whether the remaining content begins with [prefix] */
+  inline bool StartsWith(const char* prefix) const {
+    const size_t len = std::strlen(prefix);
+    return len <= BytesLeft() && std::memcmp(cur_, prefix, len) == 0;
   }
 
  private:
-  dmlc::Stream* istm_;
-  std::vector<char> buf_;
-  size_t begin_ptr_, end_ptr_;
-
-  inline size_t BytesBuffered() {
-    if (begin_ptr_ <= end_ptr_) {  // usual case
-      return end_ptr_ - begin_ptr_;
-    } else {  // context wrapped around the end
-      return MAX_PEEK_WINDOW + 1 + end_ptr_ - begin_ptr_;
-    }
-  }
+  const char* cur_;
+  const char* end_;
 };
 
-template <typename T>
-inline void CONSUME_BYTES(const T& fi, size_t size) {
-  static std::vector<char> dummy(500);
-  if (size > dummy.size()) dummy.resize(size);
-  CHECK_EQ(fi->Read(&dummy[0], size), size)
-    << "Ill-formed XGBoost model format: cannot read " << size
-    << " bytes from the file";
-}
-
 struct GBTreeModelParam {
   int num_trees;
   int pad0;
@@ -206,87 +177,106 @@ class XGBTree {
 
  private:
   TreeParam param;
-  std::vector<Node> nodes;
+  const char* nodes;  // node array, in place within the model buffer
 
  public:
-  inline Node& operator[](int nid) {
-    return nodes[nid];
+  /*!
+   * \brief get node given nid. Nodes are copied out of the model buffer,
+   *        as the node array need not be aligned.
+   */
+  inline Node operator[](int nid) const {
+    Node node;
+    std::memcpy(&node, nodes + sizeof(Node) * nid, sizeof(Node));
+    return node;
   }
-  inline const Node& operator[](int nid) const {
-    return nodes[nid];
+  inline int num_nodes() const {
+    return param.num_nodes;
   }
-  inline void Load(PeekableInputStream* fi) {
-    CHECK_EQ(fi->Read(&param, sizeof(TreeParam)), sizeof(TreeParam))
-     << "Ill-formed XGBoost model file: can't read TreeParam";
-    nodes.resize(param.num_nodes);
-    CHECK_NE(param.num_nodes, 0)
+  /*!
+   * \brief locate a tree within the model buffer; the node array is used in
+   *        place and node statistics are skipped
+   */
+  inline void Load(BufferReader* reader) {
+    reader->Read(&param, "TreeParam");
+    CHECK_GT(param.num_nodes, 0)
      << "Ill-formed XGBoost model file: a tree can't be empty";
-    CHECK_EQ(fi->Read(dmlc::BeginPtr(nodes), sizeof(Node) * nodes.size()),
-             sizeof(Node) * nodes.size())
-     << "Ill-formed XGBoost model file: cannot read specified number of nodes";
-    CONSUME_BYTES(fi, (3 * sizeof(bst_float) + sizeof(int)) * param.num_nodes);
-    if (param.size_leaf_vector != 0) {
-      uint64_t len;
-      CHECK_EQ(fi->Read(&len, sizeof(len)), sizeof(len))
-       << "Ill-formed XGBoost model file";
-      if (len > 0) {
-        CONSUME_BYTES(fi, sizeof(bst_float) * len);
-      }
-    }
     CHECK_EQ(param.num_roots, 1)
       << "Invalid XGBoost model file: treelite does not support trees "
       << "with multiple roots";
+    const size_t num_nodes = static_cast<size_t>(param.num_nodes);
+    nodes = reader->Take(sizeof(Node) * num_nodes, "nodes");
+    reader->Take((3 * sizeof(bst_float) + sizeof(int)) * num_nodes,
+                 "node statistics");
+    if (param.size_leaf_vector != 0) {
+      uint64_t len;
+      reader->Read(&len, "leaf vector");
+      CHECK_LE(len, reader->BytesLeft() / sizeof(bst_float))
+        << "Ill-formed XGBoost model file: cannot read leaf vector";
+      reader->Take(sizeof(bst_float) * len, "leaf vector");
+    }
   }
 };
 
-inline treelite::Model ParseStream(dmlc::Stream* fi) {
+/*!
+ * \brief convert an XGBoost tree. Nodes are read straight from the model
+ *        buffer into the final tree; Tree::Build() assigns node ID's so that
+ *        a breadth-wise traversal would yield the monotonic sequence
+ *        0, 1, 2, ... and excludes deleted nodes
+ * \param xgb_tree tree to convert
+ * \param tree used to save converted tree
+ */
+inline void ConvertTree(const XGBTree& xgb_tree, treelite::Tree* tree) {
+  tree->Build(xgb_tree.num_nodes(),
+              [&xgb_tree](int nid, treelite::Tree::SourceNode* out) {
+    const XGBTree::Node node = xgb_tree[nid];
+    if (node.is_leaf()) {
+      out->cleft = out->cright = -1;
+      out->leaf_value = static_cast<treelite::tl_float>(node.leaf_value());
+    } else {
+      out->cleft = node.cleft();
+      out->cright = node.cright();
+      out->split_index = node.split_index();
+      out->default_left = node.default_left();
+      out->threshold = static_cast<treelite::tl_float>(node.split_cond());
+      out->cmp = treelite::Operator::kLT;
+    }
+  });
+}
+
+inline treelite::Model ParseBuffer(const char* begin, const char* end) {
   std::vector<XGBTree> xgb_trees_;
   GBTreeModelParam gbm_param_;
   std::string name_gbm_;
   std::string name_obj_;
 
-  /* 1. Parse input stream */
-  std::unique_ptr<PeekableInputStream> fp(new PeekableInputStream(fi));
+  /* 1. Locate trees within the buffer */
+  BufferReader reader(begin, end);
   // backward compatible header check.
-  std::string header;
-  header.resize(4);
-  if (fp->PeekRead(&header[0], 4) == 4) {
-    CHECK_NE(header, "bs64")
-        << "Ill-formed XGBoost model file: Base64 format no longer supported";
-    if (header == "binf") {
-      CONSUME_BYTES(fp, 4);
-    }
+  CHECK(!reader.StartsWith("bs64"))
+    << "Ill-formed XGBoost model file: Base64 format no longer supported";
+  if (reader.StartsWith("binf")) {
+    reader.Take(4, "header");
   }
-  // read parameter
-  CONSUME_BYTES(fp, sizeof(bst_float) + sizeof(unsigned) + 32 * sizeof(int));
+  // skip parameter
+  reader.Take(sizeof(bst_float) + sizeof(unsigned) + 32 * sizeof(int),
+              "header");
   {
     // backward compatibility code for compatible with old model type
     // for new model, Read(&name_obj_) is suffice
     uint64_t len;
-    CHECK_EQ(fp->Read(&len, sizeof(len)), sizeof(len))
-     << "Ill-formed XGBoost model file: corrupted header";
+    reader.Read(&len, "header");
     if (len >= std::numeric_limits<unsigned>::max()) {
       int gap;
-      CHECK_EQ(fp->Read(&gap, sizeof(gap)), sizeof(gap))
-          << "Ill-formed XGBoost model file: corrupted header";
+      reader.Read(&gap, "header");
       len = len >> static_cast<uint64_t>(32UL);
     }
-    if (len != 0) {
-      name_obj_.resize(len);
-      CHECK_EQ(fp->Read(&name_obj_[0], len), len)
-          << "Ill-formed XGBoost model file: corrupted header";
-    }
+    reader.ReadString(&name_obj_, len, "header");
   }
 
   {
     uint64_t len;
-    CHECK_EQ(fp->Read(&len, sizeof(len)), sizeof(len))
-      << "Ill-formed XGBoost model file: corrupted header";
-    name_gbm_.resize(len);
-    if (len > 0) {
-      CHECK_EQ(fp->Read(&name_gbm_[0], len), len)
-        << "Ill-formed XGBoost model file: corrupted header";
-    }
+    reader.Read(&len, "header");
+    reader.ReadString(&name_gbm_, len, "header");
   }
 
   /* loading GBTree */
@@ -294,46 +284,35 @@ inline treelite::Model ParseStream(dmlc::Stream* fi) {
     << "Invalid XGBoost model file: "
     << "Gradient booster must be gbtree type.";
 
-  CHECK_EQ(fp->Read(&gbm_param_, sizeof(gbm_param_)), sizeof(gbm_param_))
-    << "Invalid XGBoost model file: corrupted GBTree parameters";
+  reader.Read(&gbm_param_, "GBTree parameters");
   LOG(INFO) << "gbm_param_.num_feature = " << gbm_param_.num_feature;
+  // every tree takes at least a TreeParam, so a corrupted tree count is
+  // caught before allocating
+  CHECK(gbm_param_.num_trees >= 0
+        && static_cast<size_t>(gbm_param_.num_trees)
+           <= reader.BytesLeft() / sizeof(TreeParam))
+    << "Ill-formed XGBoost model file: corrupted GBTree parameters";
+  xgb_trees_.resize(gbm_param_.num_trees);
   for (int i = 0; i < gbm_param_.num_trees; ++i) {
-    xgb_trees_.emplace_back();
-    xgb_trees_.back().Load(fp.get());
+    xgb_trees_[i].Load(&reader);
   }
 
   /* 2. Export model */
   treelite::Model model;
   model.num_features = gbm_param_.num_feature;
-  for (const auto& xgb_tree : xgb_trees_) {
-    model.trees.emplace_back();
-    treelite::Tree& tree = model.trees.back();
-    tree.Init();
-
-    // assign node ID's so that a breadth-wise traversal would yield
-    // the monotonic sequence 0, 1, 2, ...
-    // deleted nodes will be excluded
-    std::queue<std::pair<int, int>> Q;  // (old ID, new ID) pair
-    Q.push({0, 0});
-    while (!Q.empty()) {
-      int old_id, new_id;
-      std::tie(old_id, new_id) = Q.front(); Q.pop();
-      const XGBTree::Node& node = xgb_tree[old_id];
-      if (node.is_leaf()) {
-        const bst_float leaf_value = node.leaf_value();
-        tree[new_id].set_leaf(static_cast<treelite::tl_float>(leaf_value));
-      } else {
-        const bst_float split_cond = node.split_cond();
-        tree.AddChilds(new_id);
-        tree[new_id].set_split(node.split_index(),
-                               static_cast<treelite::tl_float>(split_cond),
-                               node.default_left(),
-                               treelite::Operator::kLT);
-        Q.push({node.cleft(), tree[new_id].cleft()});
-        Q.push({node.cright(), tree[new_id].cright()});
-      }
-    }
+  // trees are independent, so convert them in parallel; each tree is
+  // written to its own slot, so the result does not depend on scheduling
+  const int ntree = static_cast<int>(xgb_trees_.size());
+  model.trees.resize(ntree);
+  const int nthread = std::max(std::min(omp_get_max_threads(), ntree), 1);
+  treelite::common::OMPException omp_exc;
+  #pragma omp parallel for schedule(dynamic) num_threads(nthread)
+  for (int i = 0; i < ntree; ++i) {
+    omp_exc.Run([&] {
+      ConvertTree(xgb_trees_[i], &model.trees[i]);
+    });
   }
+  omp_exc.Rethrow();
   return model;
 }
 
@@ -7,8 +7,16 @@
 
 #include <treelite/predictor.h>
 #include <dmlc/logging.h>
+#include <dmlc/thread_local.h>
 #include <dmlc/timer.h>
 #include <omp.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
 
 #ifdef _WIN32
 #define NOMINMAX
@@ -19,23 +27,138 @@
 
 namespace {
 
+static_assert(sizeof(treelite::Predictor::Entry) == sizeof(float),
+              "Entry must have the layout of dense DMatrix values");
+
+// samples pending in the queue of the branch profiler, beyond which new
+// samples are dropped
+const size_t kMaxPendingSampleRows = 1 << 20;
+// counted batches of samples kept by the branch profiler for reuse
+const size_t kMaxSpareSampleBatches = 1024;
+
+/*!
+ * \brief feature vectors used by Predict(), kept for each calling thread so
+ *        that repeated calls on small matrices do not allocate memory
+ */
+struct PredictScratch {
+  std::vector<treelite::Predictor::Entry> inst;
+};
+
+/*! \brief per-thread state for sampling rows during prediction */
+struct LiveSample {
+  uint64_t state;      // state of xorshift random number generator
+  uint64_t threshold;  // a row is sampled if the next number is below this
+  treelite::DMatrix rows;
+
+  inline bool Draw() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL < threshold;
+  }
+  inline void Push(const treelite::DMatrix* dmat, size_t rid) {
+    if (dmat->layout == treelite::DMatrixLayout::kDense) {
+      const float* row = dmat->data.data() + rid * dmat->num_col;
+      rows.data.insert(rows.data.end(), row, row + dmat->num_col);
+      ++rows.num_row;
+      rows.nelem = rows.data.size();
+      return;
+    }
+    if (dmat->layout == treelite::DMatrixLayout::kCompressedCSR) {
+      dmat->compressed->ForEachEntry(rid, [this](uint32_t col, float value) {
+        rows.data.push_back(value);
+        rows.col_ind.push_back(col);
+      });
+      rows.row_ptr.push_back(rows.data.size());
+      ++rows.num_row;
+      rows.nelem = rows.data.size();
+      return;
+    }
+    const size_t ibegin = dmat->row_ptr[rid];
+    const size_t iend = dmat->row_ptr[rid + 1];
+    rows.data.insert(rows.data.end(), dmat->data.begin() + ibegin,
+                     dmat->data.begin() + iend);
+    rows.col_ind.insert(rows.col_ind.end(), dmat->col_ind.begin() + ibegin,
+                        dmat->col_ind.begin() + iend);
+    rows.row_ptr.push_back(rows.data.size());
+    ++rows.num_row;
+    rows.nelem = rows.data.size();
+  }
+};
+
 inline void PredLoop(treelite::Predictor::PredFunc func,
-                     const treelite::DMatrix* dmat,
+                     const treelite::DMatrixView& view,
                      size_t rbegin, size_t rend, int nthread,
                      treelite::Predictor::Entry* inst,
-                     float* out_pred) {
+                     LiveSample* samples, float* out_pred) {
+  const treelite::DMatrix* dmat = view.base();
   #pragma omp parallel for schedule(static) num_threads(nthread)
-  for (size_t rid = rbegin; rid < rend; ++rid) {
+  for (size_t i = rbegin; i < rend; ++i) {
     const int tid = omp_get_thread_num();
     const size_t off = dmat->num_col * tid;
+    const size_t rid = view.RowIndex(i);
     const size_t ibegin = dmat->row_ptr[rid];
     const size_t iend = dmat->row_ptr[rid + 1];
-    for (size_t i = ibegin; i < iend; ++i) {
-      inst[off + dmat->col_ind[i]].fvalue = dmat->data[i];
+    for (size_t j = ibegin; j < iend; ++j) {
+      // borrowed matrices may hold NaN, which must read as missing
+      inst[off + dmat->col_ind[j]].fvalue
+        = treelite::DMatrix::CanonicalizeMissing(dmat->data[j]);
+    }
+    out_pred[i] = func(&inst[off]);
+    for (size_t j = ibegin; j < iend; ++j) {
+      inst[off + dmat->col_ind[j]].missing = -1;
+    }
+    if (samples != nullptr && samples[tid].Draw()) {
+      samples[tid].Push(dmat, rid);
+    }
+  }
+}
+
+inline void PredLoopDense(treelite::Predictor::PredFunc func,
+                          const treelite::DMatrixView& view,
+                          size_t rbegin, size_t rend, int nthread,
+                          treelite::Predictor::Entry* inst,
+                          LiveSample* samples, float* out_pred) {
+  const treelite::DMatrix* dmat = view.base();
+  const size_t num_col = dmat->num_col;
+  #pragma omp parallel for schedule(static) num_threads(nthread)
+  for (size_t i = rbegin; i < rend; ++i) {
+    const int tid = omp_get_thread_num();
+    const size_t off = num_col * tid;
+    const size_t rid = view.RowIndex(i);
+    // Missing values are stored with the bit pattern of Entry::missing, so
+    // the row is copied as it is. The copy is still needed because
+    // prediction code may overwrite its input (e.g. with quantized values).
+    std::memcpy(&inst[off], dmat->data.data() + rid * num_col,
+                num_col * sizeof(float));
+    out_pred[i] = func(&inst[off]);
+    if (samples != nullptr && samples[tid].Draw()) {
+      samples[tid].Push(dmat, rid);
     }
-    out_pred[rid] = func(&inst[off]);
-    for (size_t i = ibegin; i < iend; ++i) {
-      inst[off + dmat->col_ind[i]].missing = -1;
+  }
+}
+
+inline void PredLoopCompressed(treelite::Predictor::PredFunc func,
+                               const treelite::DMatrixView& view,
+                               size_t rbegin, size_t rend, int nthread,
+                               treelite::Predictor::Entry* inst,
+                               LiveSample* samples, float* out_pred) {
+  const treelite::DMatrix* dmat = view.base();
+  const treelite::CompressedCSR& comp = *dmat->compressed;
+  #pragma omp parallel for schedule(static) num_threads(nthread)
+  for (size_t i = rbegin; i < rend; ++i) {
+    const int tid = omp_get_thread_num();
+    treelite::Predictor::Entry* row_inst = &inst[dmat->num_col * tid];
+    const size_t rid = view.RowIndex(i);
+    comp.ForEachEntry(rid, [row_inst](uint32_t col, float value) {
+      row_inst[col].fvalue = treelite::DMatrix::CanonicalizeMissing(value);
+    });
+    out_pred[i] = func(row_inst);
+    comp.ForEachColumn(rid, [row_inst](uint32_t col) {
+      row_inst[col].missing = -1;
+    });
+    if (samples != nullptr && samples[tid].Draw()) {
+      samples[tid].Push(dmat, rid);
     }
   }
 }
@@ -44,7 +167,206 @@ inline void PredLoop(treelite::Predictor::PredFunc func,
 
 namespace treelite {
 
-Predictor::Predictor() : lib_handle_(nullptr), func_(nullptr) {}
+/*!
+ * \brief background thread that counts branches taken by rows sampled during
+ *        prediction, and exports the counts periodically. Only the
+ *        background thread writes to the counters, so they need no locking;
+ *        they are converted to an annotation only when exported.
+ */
+class BranchProfiler {
+ public:
+  BranchProfiler(const Model& model, double sample_rate,
+                 const std::string& export_path, double export_interval,
+                 AnnotationFormat format)
+    : sample_rate_(sample_rate), export_path_(export_path),
+      export_interval_(export_interval), format_(format),
+      num_call_(0), counter_(model, 1), num_pending_row_(0),
+      num_dropped_row_(0), stop_(false) {
+    thread_ = std::thread(&BranchProfiler::Run, this);
+  }
+  ~BranchProfiler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+  /*!
+   * \brief prepare per-thread sampling state for one call to Predict().
+   *        The state is taken from a pool, so that its row buffers keep
+   *        their capacity across calls and are reserved only when a call
+   *        samples more rows than the calls before it.
+   * \param nthread number of threads used for prediction
+   * \param view rows being predicted
+   * \return sampling state for each thread; to be passed to Submit()
+   */
+  std::unique_ptr<std::vector<LiveSample>> Begin(int nthread,
+                                                 const DMatrixView& view) {
+    const DMatrix* dmat = view.base();
+    const uint64_t call_id = num_call_.fetch_add(1);
+    const uint64_t threshold
+      = (sample_rate_ >= 1.0) ? std::numeric_limits<uint64_t>::max()
+        : static_cast<uint64_t>(sample_rate_ * 18446744073709551616.0);
+    std::unique_ptr<std::vector<LiveSample>> samples;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_samples_.empty()) {
+        samples = std::move(idle_samples_.back());
+        idle_samples_.pop_back();
+      }
+    }
+    if (!samples) {
+      samples.reset(new std::vector<LiveSample>());
+    }
+    samples->resize(nthread);
+    // expected number of sampled rows per thread
+    const size_t num_expected_row = std::min(kMaxPendingSampleRows,
+      static_cast<size_t>(sample_rate_ * view.num_row() / nthread) + 16);
+    const size_t row_nelem
+      = (dmat->num_row == 0) ? 0
+        : (dmat->nelem + dmat->num_row - 1) / dmat->num_row;
+    for (int tid = 0; tid < nthread; ++tid) {
+      LiveSample& e = (*samples)[tid];
+      // xorshift state must be nonzero
+      e.state = (call_id * 0x9E3779B97F4A7C15ULL)
+                ^ (static_cast<uint64_t>(tid + 1) * 0xBF58476D1CE4E5B9ULL);
+      e.state = (e.state == 0) ? 1 : e.state;
+      e.threshold = threshold;
+      e.rows.Clear();  // keeps the capacity of the buffers
+      if (dmat->layout == DMatrixLayout::kDense) {
+        e.rows.InitDense(0, dmat->num_col);
+      } else {
+        e.rows.row_ptr.reserve(num_expected_row + 1);
+        e.rows.col_ind.reserve(num_expected_row * row_nelem);
+      }
+      e.rows.data.reserve(num_expected_row * row_nelem);
+      e.rows.num_col = dmat->num_col;
+    }
+    return samples;
+  }
+  /*!
+   * \brief hand over rows sampled during one call to Predict(). Only the
+   *        filled buffers are queued; each is replaced with a spare one
+   *        returned by the background thread, and the sampling state goes
+   *        back to the pool.
+   * \param samples sampling state for each thread, obtained from Begin()
+   */
+  void Submit(std::unique_ptr<std::vector<LiveSample>> samples) {
+    size_t num_row = 0;
+    for (const LiveSample& e : *samples) {
+      num_row += e.rows.num_row;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (num_row > 0
+          && num_pending_row_ + num_row > kMaxPendingSampleRows) {
+        num_dropped_row_ += num_row;
+        num_row = 0;
+      }
+      if (num_row > 0) {
+        num_pending_row_ += num_row;
+        for (LiveSample& e : *samples) {
+          if (e.rows.num_row == 0) {
+            continue;
+          }
+          queue_.push_back(std::move(e.rows));
+          if (!spare_batches_.empty()) {
+            e.rows = std::move(spare_batches_.back());
+            spare_batches_.pop_back();
+          }
+        }
+      }
+      idle_samples_.push_back(std::move(samples));
+    }
+    if (num_row > 0) {
+      cv_.notify_one();
+    }
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  const double sample_rate_;
+  const std::string export_path_;
+  const double export_interval_;
+  const AnnotationFormat format_;
+  std::atomic<uint64_t> num_call_;
+  // accessed only from the background thread
+  BranchCounter counter_;
+  // guarded by mutex_
+  std::vector<DMatrix> queue_;
+  std::vector<DMatrix> spare_batches_;  // counted batches, for reuse
+  std::vector<std::unique_ptr<std::vector<LiveSample>>> idle_samples_;
+  size_t num_pending_row_;
+  size_t num_dropped_row_;
+  bool stop_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+
+  void Run() {
+    const auto interval = std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double>(export_interval_));
+    auto next_export = Clock::now() + interval;
+    // swapped with the queue, so that both keep their capacity
+    std::vector<DMatrix> batches;
+    while (true) {
+      bool stop;
+      size_t num_dropped_row;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_until(lock, next_export,
+                       [this] { return stop_ || !queue_.empty(); });
+        batches.swap(queue_);
+        num_pending_row_ = 0;
+        num_dropped_row = num_dropped_row_;
+        stop = stop_;
+      }
+      for (const DMatrix& batch : batches) {
+        counter_.Count(DMatrixView(&batch));
+      }
+      if (!batches.empty()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (DMatrix& batch : batches) {
+          if (spare_batches_.size() < kMaxSpareSampleBatches) {
+            spare_batches_.push_back(std::move(batch));
+          }
+        }
+      }
+      batches.clear();
+      if (stop || Clock::now() >= next_export) {
+        Export(num_dropped_row);
+        next_export = Clock::now() + interval;
+      }
+      if (stop) {
+        break;
+      }
+    }
+  }
+
+  void Export(size_t num_dropped_row) {
+    try {
+      BranchAnnotator annotation;
+      counter_.GetAnnotation(&annotation);
+      std::unique_ptr<dmlc::Stream> fo(
+        dmlc::Stream::Create(export_path_.c_str(), "w"));
+      annotation.Save(fo.get(), format_);
+    } catch (const dmlc::Error& e) {
+      LOG(WARNING) << "Failed to export branch profile to `" << export_path_
+                   << "': " << e.what();
+    }
+    if (num_dropped_row > 0) {
+      LOG(WARNING) << "Branch profiler fell behind; " << num_dropped_row
+                   << " sampled rows dropped so far";
+    }
+  }
+};
+
+Predictor::Predictor() : lib_handle_(nullptr), func_(nullptr),
+                         num_tree_func_(nullptr), num_node_func_(nullptr),
+                         fingerprint_func_(nullptr), dump_count_func_(nullptr),
+                         reset_count_func_(nullptr) {}
 Predictor::~Predictor() {
   Free();
 }
@@ -60,6 +382,18 @@ Predictor::Load(const char* name) {
   CHECK(func_ != nullptr)
     << "Dynamic shared library `" << name
     << "' does not contain predict_margin() function";
+  // optional functions, present only in instrumented code
+  HMODULE lib = static_cast<HMODULE>(lib_handle_);
+  num_tree_func_
+    = reinterpret_cast<NumTreeFunc>(GetProcAddress(lib, "get_num_tree"));
+  num_node_func_
+    = reinterpret_cast<NumNodeFunc>(GetProcAddress(lib, "get_num_node"));
+  fingerprint_func_ = reinterpret_cast<FingerprintFunc>(
+    GetProcAddress(lib, "get_model_fingerprint"));
+  dump_count_func_
+    = reinterpret_cast<DumpCountFunc>(GetProcAddress(lib, "dump_node_count"));
+  reset_count_func_ = reinterpret_cast<ResetCountFunc>(
+    GetProcAddress(lib, "reset_node_count"));
 }
 
 void
@@ -76,6 +410,17 @@ Predictor::Load(const char* name) {
   CHECK(func_ != nullptr)
     << "Dynamic shared library `" << name
     << "' does not contain predict_margin() function";
+  // optional functions, present only in instrumented code
+  num_tree_func_
+    = reinterpret_cast<NumTreeFunc>(dlsym(lib_handle_, "get_num_tree"));
+  num_node_func_
+    = reinterpret_cast<NumNodeFunc>(dlsym(lib_handle_, "get_num_node"));
+  fingerprint_func_ = reinterpret_cast<FingerprintFunc>(
+    dlsym(lib_handle_, "get_model_fingerprint"));
+  dump_count_func_
+    = reinterpret_cast<DumpCountFunc>(dlsym(lib_handle_, "dump_node_count"));
+  reset_count_func_
+    = reinterpret_cast<ResetCountFunc>(dlsym(lib_handle_, "reset_node_count"));
 }
 
 void
@@ -87,23 +432,72 @@ Predictor::Free() {
 void
 Predictor::Predict(const DMatrix* dmat, int nthread, int verbose,
                    float* out_pred) const {
+  const DMatrixView view(dmat);
+  Predict(&view, nthread, verbose, out_pred);
+}
+
+void
+Predictor::Predict(const DMatrixView* view, int nthread, int verbose,
+                   float* out_pred) const {
   CHECK(func_ != nullptr)
     << "The predict_margin() function needs to be loaded first.";
+  const DMatrix* dmat = view->base();
   const int max_thread = omp_get_max_threads();
   nthread = (nthread == 0) ? max_thread : std::min(nthread, max_thread);
-  std::vector<Entry> inst(nthread * dmat->num_col, {-1});
-  const size_t pstep = (dmat->num_row + 99) / 100;
+  // assign() keeps the capacity of the buffer
+  std::vector<Entry>& inst
+    = dmlc::ThreadLocalStore<PredictScratch>::Get()->inst;
+  inst.assign(nthread * dmat->num_col, {-1});
+  const size_t num_row = view->num_row();
+  const size_t pstep = (num_row + 99) / 100;
       // interval to display progress
 
   if (verbose > 0) {
     LOG(INFO) << "Begin prediction";
   }
+  std::unique_ptr<std::vector<LiveSample>> samples;
+  if (profiler_) {
+    samples = profiler_->Begin(nthread, *view);
+  }
+  double tstart = dmlc::GetTime();
+  for (size_t rbegin = 0; rbegin < num_row; rbegin += pstep) {
+    const size_t rend = std::min(rbegin + pstep, num_row);
+    LiveSample* samples_ = samples ? samples->data() : nullptr;
+    if (dmat->layout == DMatrixLayout::kDense) {
+      PredLoopDense(func_, *view, rbegin, rend, nthread, &inst[0], samples_,
+                    out_pred);
+    } else if (dmat->layout == DMatrixLayout::kCompressedCSR) {
+      PredLoopCompressed(func_, *view, rbegin, rend, nthread, &inst[0],
+                         samples_, out_pred);
+    } else {
+      PredLoop(func_, *view, rbegin, rend, nthread, &inst[0], samples_,
+               out_pred);
+    }
+    if (verbose > 0) {
+      LOG(INFO) << rend << " of " << num_row << " rows processed";
+    }
+  }
+  if (profiler_) {
+    profiler_->Submit(std::move(samples));
+  }
+  if (verbose > 0) {
+    LOG(INFO) << "Finished prediction in "
+              << dmlc::GetTime() - tstart << " sec";
+  }
+}
+
+void
+Predictor::Predict(PagedDMatrix* dmat, int nthread, int verbose,
+                   float* out_pred) const {
   double tstart = dmlc::GetTime();
-  for (size_t rbegin = 0; rbegin < dmat->num_row; rbegin += pstep) {
-    const size_t rend = std::min(rbegin + pstep, dmat->num_row);
-    PredLoop(func_, dmat, rbegin, rend, nthread, &inst[0], out_pred);
+  size_t num_row = 0;
+  dmat->BeforeFirst();
+  while (dmat->Next()) {
+    const DMatrix& page = dmat->Value();
+    Predict(&page, nthread, 0, &out_pred[num_row]);
+    num_row += page.num_row;
     if (verbose > 0) {
-      LOG(INFO) << rend << " of " << dmat->num_row << " rows processed";
+      LOG(INFO) << num_row << " of " << dmat->num_row() << " rows processed";
     }
   }
   if (verbose > 0) {
@@ -112,4 +506,56 @@ Predictor::Predict(const DMatrix* dmat, int nthread, int verbose,
   }
 }
 
+void
+Predictor::GetBranchAnnotation(BranchAnnotator* out) const {
+  CHECK(IsInstrumented())
+    << "The loaded library was not compiled with instrumentation; "
+    << "set compiler parameter instrument=1";
+  const size_t num_tree = num_tree_func_();
+  std::vector<size_t> count_row_ptr{0};
+  for (size_t tree_id = 0; tree_id < num_tree; ++tree_id) {
+    count_row_ptr.push_back(count_row_ptr.back() + num_node_func_(tree_id));
+  }
+  std::vector<size_t> counts(count_row_ptr.back());
+  dump_count_func_(counts.data());
+
+  std::vector<std::vector<size_t>> annotation;
+  annotation.reserve(num_tree);
+  for (size_t tree_id = 0; tree_id < num_tree; ++tree_id) {
+    annotation.emplace_back(&counts[count_row_ptr[tree_id]],
+                            &counts[count_row_ptr[tree_id + 1]]);
+  }
+  out->Set(std::move(annotation), fingerprint_func_());
+}
+
+void
+Predictor::ResetBranchAnnotation() {
+  CHECK(IsInstrumented())
+    << "The loaded library was not compiled with instrumentation; "
+    << "set compiler parameter instrument=1";
+  reset_count_func_();
+}
+
+void
+Predictor::EnableBranchProfiling(const Model& model, double sample_rate,
+                                 const std::string& export_path,
+                                 double export_interval,
+                                 AnnotationFormat format) {
+  CHECK(sample_rate > 0.0 && sample_rate <= 1.0)
+    << "sample_rate must be in range (0, 1]";
+  CHECK_GT(export_interval, 0.0) << "export_interval must be positive";
+  if (IsInstrumented()) {
+    CHECK_EQ(fingerprint_func_(), BranchAnnotator::ComputeFingerprint(model))
+      << "The loaded library was generated from a different model";
+  }
+  profiler_.reset();  // finish previous profiling session, if any
+  profiler_.reset(new BranchProfiler(model, sample_rate, export_path,
+                                     export_interval, format));
+}
+
+void
+Predictor::DisableBranchProfiling() {
+  profiler_.reset();
+}
+
 }  // namespace treelite
@@ -0,0 +1,307 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file tree.cc
+ * \author Philip Cho
+ * \brief Native binary serialization of tree ensemble models
+ */
+
+#include <treelite/tree.h>
+#include <dmlc/io.h>
+#include <dmlc/logging.h>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "./common/mmap.h"
+
+namespace {
+
+/* native model format: magic number */
+const char kBinaryMagic[8] = {'T', 'L', 'M', 'O', 'D', 'E', 'L', '\0'};
+/* native model format: current version */
+const uint32_t kBinaryVersion = 1;
+/* native model format: alignment of sections, in bytes */
+const uint64_t kSectionAlign = 8;
+/* native model format: number of node arrays per tree */
+const int kNumSection = 7;
+/*
+ * native model format: size of each element of the node arrays, in order:
+ * parent (int32), cleft (int32), cright (int32), sindex (uint32),
+ * threshold (float), leaf_value (float) and cmp (int8)
+ */
+const uint64_t kElemSize[kNumSection] = {4, 4, 4, 4, 4, 4, 1};
+static_assert(sizeof(int) == 4 && sizeof(unsigned) == 4
+              && sizeof(treelite::tl_float) == 4
+              && sizeof(treelite::Operator) == 1,
+              "node arrays must match element sizes of native model format");
+
+/*!
+ * \brief header of native model file. The header is followed by a table of
+ *        [num_tree] TreeEntry records and then by the node arrays of every
+ *        tree. The node arrays of a tree are [kNumSection] sections, in the
+ *        order of [kElemSize], each aligned to [kSectionAlign] bytes and
+ *        starting at the offset recorded in its table entry. Offsets are
+ *        relative to the beginning of the file. All numbers are stored in
+ *        native byte order, so that node arrays can be used directly from a
+ *        memory-mapped file; files are not portable between hosts of
+ *        different byte order.
+ */
+struct BinaryHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t num_features;
+  uint64_t num_tree;
+  uint64_t table_offset;
+  uint64_t file_size;
+};
+static_assert(sizeof(BinaryHeader) == 40,
+              "BinaryHeader must be packed with no padding");
+
+/*! \brief location of the node arrays of a tree */
+struct TreeEntry {
+  uint64_t num_nodes;
+  uint64_t offset;
+};
+static_assert(sizeof(TreeEntry) == 16,
+              "TreeEntry must be packed with no padding");
+
+inline uint64_t AlignSection(uint64_t offset) {
+  return (offset + kSectionAlign - 1) / kSectionAlign * kSectionAlign;
+}
+
+/*!
+ * \brief compute offsets of the node arrays of a tree
+ * \param entry location of the tree
+ * \param out used to save offset of each section, followed by the offset of
+ *            the end of the last section
+ */
+inline void SectionOffsets(const TreeEntry& entry,
+                           uint64_t out[kNumSection + 1]) {
+  out[0] = entry.offset;
+  for (int i = 0; i < kNumSection; ++i) {
+    const uint64_t end = out[i] + entry.num_nodes * kElemSize[i];
+    out[i + 1] = (i + 1 < kNumSection) ? AlignSection(end) : end;
+  }
+}
+
+/*!
+ * \brief validate the layout of a native model file in memory
+ * \param buf beginning of file content
+ * \param size size of file content, in bytes
+ * \param header used to save file header
+ * \param table used to save location of every tree
+ */
+inline void ReadBinaryLayout(const char* buf, size_t size,
+                             BinaryHeader* header,
+                             std::vector<TreeEntry>* table) {
+  CHECK(size >= sizeof(*header)) << "Model file is truncated";
+  std::memcpy(header, buf, sizeof(*header));
+  CHECK(std::memcmp(header->magic, kBinaryMagic, sizeof(kBinaryMagic)) == 0)
+    << "Not a treelite model file";
+  CHECK_EQ(header->version, kBinaryVersion)
+    << "Unsupported version of treelite model format";
+  CHECK_EQ(header->file_size, size) << "Model file is truncated";
+  CHECK(header->table_offset % kSectionAlign == 0
+        && header->table_offset >= sizeof(*header)
+        && header->table_offset <= size
+        && header->num_tree
+           <= (size - header->table_offset) / sizeof(TreeEntry))
+    << "Model file is corrupted: invalid tree table";
+
+  table->resize(header->num_tree);
+  std::memcpy(table->data(), buf + header->table_offset,
+              table->size() * sizeof(TreeEntry));
+  uint64_t min_offset = header->table_offset
+                        + header->num_tree * sizeof(TreeEntry);
+  for (uint64_t i = 0; i < header->num_tree; ++i) {
+    const TreeEntry& entry = (*table)[i];
+    CHECK(entry.num_nodes > 0 && entry.num_nodes < INT_MAX)
+      << "Model file is corrupted: invalid number of nodes in tree " << i;
+    CHECK(entry.offset % kSectionAlign == 0 && entry.offset >= min_offset
+          && entry.offset <= size)
+      << "Model file is corrupted: invalid offset of tree " << i;
+    uint64_t offsets[kNumSection + 1];
+    SectionOffsets(entry, offsets);
+    CHECK_LE(offsets[kNumSection], size)
+      << "Model file is corrupted: tree " << i << " exceeds end of file";
+    min_offset = offsets[kNumSection];
+  }
+}
+
+/*!
+ * \brief validate the node arrays of a tree in a native model file, so that
+ *        traversals cannot go outside the tree: the children of every node
+ *        are either both -1 or both valid node IDs, no node is reachable by
+ *        more than one path, parents are valid node IDs and comparison
+ *        operators are defined. Only reads the arrays.
+ * \param tree_id index of the tree, for error messages
+ * \param num_nodes number of nodes in the tree
+ * \param parent parent of each node
+ * \param cleft left child of each node
+ * \param cright right child of each node
+ * \param cmp comparison operator of each node
+ */
+inline void ValidateNodes(size_t tree_id, size_t num_nodes, const int* parent,
+                          const int* cleft, const int* cright,
+                          const treelite::Operator* cmp) {
+  const int max_nid = static_cast<int>(num_nodes);
+  // number of nodes having each node as child; the root must have none
+  std::vector<uint8_t> num_parent(num_nodes, 0);
+  num_parent[0] = 1;
+  for (size_t nid = 0; nid < num_nodes; ++nid) {
+    const int left = cleft[nid];
+    const int right = cright[nid];
+    if (left != -1 || right != -1) {
+      CHECK(left >= 0 && left < max_nid && right >= 0 && right < max_nid)
+        << "Model file is corrupted: node " << nid << " of tree " << tree_id
+        << " has invalid children (" << left << ", " << right << ")";
+      CHECK(left != right && num_parent[left] == 0 && num_parent[right] == 0)
+        << "Model file is corrupted: a child of node " << nid << " of tree "
+        << tree_id << " is reachable by more than one path";
+      num_parent[left] = num_parent[right] = 1;
+    }
+    const int pidx = parent[nid] & ((1U << 31) - 1);
+    CHECK(parent[nid] == -1 || pidx < max_nid)
+      << "Model file is corrupted: node " << nid << " of tree " << tree_id
+      << " has invalid parent " << pidx;
+    const int8_t op = static_cast<int8_t>(cmp[nid]);
+    CHECK(op >= static_cast<int8_t>(treelite::Operator::kEQ)
+          && op <= static_cast<int8_t>(treelite::Operator::kGE))
+      << "Model file is corrupted: node " << nid << " of tree " << tree_id
+      << " has invalid comparison operator " << static_cast<int>(op);
+  }
+}
+
+inline void ReadStream(const char* filename, std::string* out) {
+  std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(filename, "r"));
+  const size_t chunk_size = 16 * 1024 * 1024;  // 16 MB
+  size_t size = 0;
+  size_t nread;
+  do {
+    out->resize(size + chunk_size);
+    nread = fi->Read(&(*out)[size], chunk_size);
+    size += nread;
+  } while (nread == chunk_size);
+  out->resize(size);
+}
+
+}  // namespace anonymous
+
+namespace treelite {
+
+void
+Model::Save(dmlc::Stream* fo) const {
+  BinaryHeader header;
+  std::memcpy(header.magic, kBinaryMagic, sizeof(kBinaryMagic));
+  header.version = kBinaryVersion;
+  header.num_features = num_features;
+  header.num_tree = trees.size();
+  header.table_offset = AlignSection(sizeof(BinaryHeader));
+  std::vector<TreeEntry> table(trees.size());
+  uint64_t end = header.table_offset + table.size() * sizeof(TreeEntry);
+  for (size_t i = 0; i < trees.size(); ++i) {
+    const Tree& tree = trees[i];
+    CHECK_GT(tree.num_nodes, 0) << "Tree " << i << " is empty";
+    CHECK(tree.parent_.size() == static_cast<size_t>(tree.num_nodes)
+          && tree.cmp_.size() == static_cast<size_t>(tree.num_nodes));
+    table[i].num_nodes = static_cast<uint64_t>(tree.num_nodes);
+    table[i].offset = AlignSection(end);
+    uint64_t offsets[kNumSection + 1];
+    SectionOffsets(table[i], offsets);
+    end = offsets[kNumSection];
+  }
+  header.file_size = end;
+
+  const char padding[kSectionAlign] = {0};
+  uint64_t offset = 0;
+  auto write_section = [fo, &offset, &padding](uint64_t section_offset,
+                                               const void* ptr, size_t size) {
+    CHECK_LE(offset, section_offset);
+    fo->Write(padding, section_offset - offset);
+    fo->Write(ptr, size);
+    offset = section_offset + size;
+  };
+  write_section(0, &header, sizeof(header));
+  write_section(header.table_offset, table.data(),
+                table.size() * sizeof(TreeEntry));
+  for (size_t i = 0; i < trees.size(); ++i) {
+    const Tree& tree = trees[i];
+    const size_t num_nodes = static_cast<size_t>(tree.num_nodes);
+    uint64_t offsets[kNumSection + 1];
+    SectionOffsets(table[i], offsets);
+    write_section(offsets[0], tree.parent_.data(), num_nodes * kElemSize[0]);
+    write_section(offsets[1], tree.cleft_.data(), num_nodes * kElemSize[1]);
+    write_section(offsets[2], tree.cright_.data(), num_nodes * kElemSize[2]);
+    write_section(offsets[3], tree.sindex_.data(), num_nodes * kElemSize[3]);
+    write_section(offsets[4], tree.threshold_.data(),
+                  num_nodes * kElemSize[4]);
+    write_section(offsets[5], tree.leaf_value_.data(),
+                  num_nodes * kElemSize[5]);
+    write_section(offsets[6], tree.cmp_.data(), num_nodes * kElemSize[6]);
+  }
+  CHECK_EQ(offset, header.file_size);
+}
+
+Model
+Model::Load(const char* filename) {
+  Model model;
+  // set up node arrays referring to [buf], which [holder] keeps alive;
+  // [buf] must be 8-byte aligned
+  auto load_buffer = [&model](const char* buf, size_t size,
+                              std::shared_ptr<const void> holder) {
+    BinaryHeader header;
+    std::vector<TreeEntry> table;
+    ReadBinaryLayout(buf, size, &header, &table);
+    model.num_features = header.num_features;
+    model.trees.resize(table.size());
+    for (size_t i = 0; i < table.size(); ++i) {
+      Tree& tree = model.trees[i];
+      const size_t num_nodes = static_cast<size_t>(table[i].num_nodes);
+      uint64_t offsets[kNumSection + 1];
+      SectionOffsets(table[i], offsets);
+      tree.num_nodes = static_cast<int>(num_nodes);
+      tree.parent_.SetExternal(
+        reinterpret_cast<const int*>(buf + offsets[0]), num_nodes, holder);
+      tree.cleft_.SetExternal(
+        reinterpret_cast<const int*>(buf + offsets[1]), num_nodes, holder);
+      tree.cright_.SetExternal(
+        reinterpret_cast<const int*>(buf + offsets[2]), num_nodes, holder);
+      tree.sindex_.SetExternal(
+        reinterpret_cast<const unsigned*>(buf + offsets[3]), num_nodes,
+        holder);
+      tree.threshold_.SetExternal(
+        reinterpret_cast<const tl_float*>(buf + offsets[4]), num_nodes,
+        holder);
+      tree.leaf_value_.SetExternal(
+        reinterpret_cast<const tl_float*>(buf + offsets[5]), num_nodes,
+        holder);
+      tree.cmp_.SetExternal(
+        reinterpret_cast<const Operator*>(buf + offsets[6]), num_nodes,
+        holder);
+      const Tree& ctree = tree;
+      ValidateNodes(i, num_nodes, ctree.parent_.data(), ctree.cleft_.data(),
+                    ctree.cright_.data(), ctree.cmp_.data());
+    }
+  };
+  if (common::MemoryMappedFile::IsLocalFile(filename)) {
+    // node arrays will refer to the mapping, which lives as long as they do
+    std::shared_ptr<common::MemoryMappedFile> mapping(
+      new common::MemoryMappedFile(filename));
+    load_buffer(mapping->data(), mapping->size(), mapping);
+  } else {
+    std::string buf;
+    ReadStream(filename, &buf);
+    const size_t size = buf.size();
+    // std::string storage is not guaranteed to be aligned for the sections;
+    // node arrays will refer to the aligned copy
+    std::shared_ptr<std::vector<uint64_t>> aligned_buf(
+      new std::vector<uint64_t>((size + 7) / 8));
+    std::memcpy(aligned_buf->data(), buf.data(), size);
+    load_buffer(reinterpret_cast<const char*>(aligned_buf->data()), size,
+                aligned_buf);
+  }
+  return model;
+}
+
+}  // namespace treelite